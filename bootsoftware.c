@@ -4,7 +4,8 @@
 #include <stdint.h>
 
 static enum Iso14229ResponseCodeEnum onRequest(void *userCtx, const uint8_t dataFormatIdentifier,
-                                               const void *memoryAddress, const size_t memorySize,
+                                               const uint64_t memoryAddress,
+                                               const uint64_t memorySize,
                                                uint16_t *maxNumberOfBlockLength) {
     UDSBootloaderInstance *self = (UDSBootloaderInstance *)userCtx;
 
@@ -38,6 +39,66 @@ static enum Iso14229ResponseCodeEnum onExit(void *userCtx) {
     return kPositiveResponse;
 }
 
+static int lz4Init(void *ctx) {
+    UDSBootloaderInstance *self = (UDSBootloaderInstance *)ctx;
+    return lz4DecoderInit(&self->lz4Decoder, self->cfg->lz4Window, self->cfg->lz4WindowSize);
+}
+
+static int lz4ToTransferSink(void *sinkCtx, const uint8_t *data, size_t len) {
+    UDSBootloaderInstance *self = (UDSBootloaderInstance *)sinkCtx;
+    self->lz4SinkErr = self->lz4Sink(self->lz4SinkCtx, data, len);
+    return kPositiveResponse != self->lz4SinkErr;
+}
+
+static enum Iso14229ResponseCodeEnum lz4Decompress(void *ctx, const uint8_t *data, uint32_t len,
+                                                   Iso14229TransferSink sink, void *sinkCtx) {
+    UDSBootloaderInstance *self = (UDSBootloaderInstance *)ctx;
+    self->lz4Sink = sink;
+    self->lz4SinkCtx = sinkCtx;
+
+    switch (lz4DecoderUpdate(&self->lz4Decoder, data, len, lz4ToTransferSink, self)) {
+    case LZ4DECODER_OK:
+        return kPositiveResponse;
+    case LZ4DECODER_ERR_SINK:
+        return self->lz4SinkErr;
+    default:
+        return kRequestOutOfRange;
+    }
+}
+
+static int lz4Finish(void *ctx) {
+    UDSBootloaderInstance *self = (UDSBootloaderInstance *)ctx;
+    return lz4DecoderFinish(&self->lz4Decoder);
+}
+
+static int ctrInit(void *ctx) {
+    // the stream is set up once the initial counter block has been received
+    return 0;
+}
+
+static int ctrSetIV(void *ctx, const uint8_t *iv) {
+    UDSBootloaderInstance *self = (UDSBootloaderInstance *)ctx;
+    static const uint8_t zero[CTRSTREAM_BLOCK_SIZE] = {0};
+
+    // Reusing a counter block under the same key reuses the keystream
+    if (0 == memcmp(iv, zero, CTRSTREAM_BLOCK_SIZE) ||
+        0 == memcmp(iv, self->ctrLastInitialCounter, CTRSTREAM_BLOCK_SIZE)) {
+        return -1;
+    }
+    if (NULL != self->cfg->ctrAcceptInitialCounter && 0 != self->cfg->ctrAcceptInitialCounter(iv)) {
+        return -1;
+    }
+    memcpy(self->ctrLastInitialCounter, iv, CTRSTREAM_BLOCK_SIZE);
+    return ctrStreamInit(&self->ctrStream, self->cfg->ctrBlockEncrypt,
+                         self->cfg->ctrBlockEncryptCtx, iv);
+}
+
+static int ctrDecrypt(void *ctx, uint8_t *data, uint32_t len) {
+    UDSBootloaderInstance *self = (UDSBootloaderInstance *)ctx;
+    ctrStreamXor(&self->ctrStream, data, len);
+    return 0;
+}
+
 enum Iso14229ResponseCodeEnum startEraseAppProgramFlashRoutine(void *userCtx,
                                                                Iso14229RoutineControlArgs *args) {
     UDSBootloaderInstance *self = (UDSBootloaderInstance *)userCtx;
@@ -56,6 +117,7 @@ int udsBootloaderInit(void *vptr_self, const void *vptr_cfg, Iso14229Instance *i
     }
 
     self->cfg = cfg;
+    memset(self->ctrLastInitialCounter, 0, sizeof(self->ctrLastInitialCounter));
 
     // ISO14229-1:2013 15.3.1.1.2 Boot software diagnostic service requirements
     iso14229UserEnableService(iso14229, kSID_DIAGNOSTIC_SESSION_CONTROL);
@@ -80,14 +142,44 @@ int udsBootloaderInit(void *vptr_self, const void *vptr_cfg, Iso14229Instance *i
         .userCtx = self,
     };
 
+    self->downloadResultsRoutine = (Iso14229Routine){
+        .routineIdentifier = 0xFF01,
+        .startRoutine = iso14229DownloadResultsRoutine,
+        .requestRoutineResults = iso14229DownloadResultsRoutine,
+        .userCtx = &self->dlHandler,
+    };
+
+    self->lz4Decompressor = (Iso14229Decompressor){
+        .compressionMethod = UDS_BOOTLOADER_LZ4_COMPRESSION_METHOD,
+        .init = lz4Init,
+        .decompress = lz4Decompress,
+        .finish = lz4Finish,
+        .ctx = self,
+    };
+
+    self->ctrCipher = (Iso14229Cipher){
+        .encryptingMethod = UDS_BOOTLOADER_CTR_ENCRYPTING_METHOD,
+        .init = ctrInit,
+        .ivLength = CTRSTREAM_BLOCK_SIZE,
+        .setIV = ctrSetIV,
+        .decrypt = ctrDecrypt,
+        .ctx = self,
+    };
+
     self->dlHandlerCfg = (Iso14229DownloadHandlerConfig){
         .onRequest = onRequest,
         .onTransfer = onTransfer,
         .onExit = onExit,
         .userCtx = self,
+        .decompressors = &self->lz4Decompressor,
+        .nDecompressors = (NULL != cfg->lz4Window) ? 1 : 0,
+        .ciphers = &self->ctrCipher,
+        .nCiphers = (NULL != cfg->ctrBlockEncrypt) ? 1 : 0,
+        .functional = cfg->multicastDownload,
     };
 
-    if (0 != iso14229UserRegisterRoutine(iso14229, &self->eraseAppProgramFlashRoutine)) {
+    if (0 != iso14229UserRegisterRoutine(iso14229, &self->eraseAppProgramFlashRoutine) ||
+        0 != iso14229UserRegisterRoutine(iso14229, &self->downloadResultsRoutine)) {
         return -1;
     }
 
@@ -153,4 +245,28 @@ int udsBootloaderPoll(void *vptr_self, Iso14229Instance *iso14229) {
     UDSBootloaderInstance *self = (UDSBootloaderInstance *)vptr_self;
 
     return udsBootloaderStateMachine(self, iso14229);
+}
+
+uint32_t udsBootloaderNextDeadline(void *vptr_self, Iso14229Instance *iso14229) {
+    UDSBootloaderInstance *self = (UDSBootloaderInstance *)vptr_self;
+    uint32_t timer;
+
+    switch (self->sm_state) {
+    case kBootloaderSMStateWaitForTesterPresent:
+        if (kDiagModeExtendedDiagnostic == iso14229->diag_mode) {
+            return 0;
+        }
+        timer = self->startup_20ms_timer;
+        break;
+    case kBootloaderSMStateDiagnosticSession:
+        timer = iso14229->s3_session_timeout_timer;
+        break;
+    default:
+        return 0;
+    }
+
+    if (Iso14229TimeAfter(iso14229UserGetms(), timer)) {
+        return 0;
+    }
+    return timer - iso14229UserGetms() + 1;
 }
\ No newline at end of file
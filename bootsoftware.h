@@ -8,7 +8,9 @@
  */
 
 #include "bufferedwriter.h"
+#include "ctrstream.h"
 #include "iso14229.h"
+#include "lz4decoder.h"
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -38,8 +40,47 @@ typedef struct {
     BufferedWriterConfig bufferedWriter;
 
     size_t logicalPartitionSize; // total logical partition size in bytes
+
+    /**
+     * @brief window for LZ4-compressed downloads (dataFormatIdentifier
+     * 0x10). Optional. Must be a power of two in size and at least the
+     * largest match distance used by the compressor.
+     */
+    uint8_t *lz4Window;
+    size_t lz4WindowSize;
+
+    /**
+     * @brief block cipher for CTR-encrypted downloads (dataFormatIdentifier
+     * 0x01), e.g. AES with the key provisioned in the boot software.
+     * Optional. The transfer stream starts with a 16 byte initial counter
+     * block chosen by the client, which must be unique per image and key:
+     * an all-zero counter, and the counter of the previous download, are
+     * rejected.
+     * @note CTR mode only provides confidentiality. The ciphertext is not
+     * authenticated, so the image must be verified by other means (e.g. a
+     * signature checked by applicationIsValid) before it is run.
+     */
+    CTRStreamBlockEncrypt ctrBlockEncrypt;
+    void *ctrBlockEncryptCtx;
+
+    /**
+     * @brief checks that an initial counter block was never used before,
+     * e.g. against a record in NVM, and records it. Optional. Return 0 to
+     * accept it.
+     */
+    int (*ctrAcceptInitialCounter)(const uint8_t initialCounter[CTRSTREAM_BLOCK_SIZE]);
+
+    /**
+     * @brief accept downloads on the functional link without responding, to
+     * program several identical ECUs at once. Each ECU then reports the
+     * outcome through routine 0xFF01.
+     */
+    bool multicastDownload;
 } UDSBootloaderConfig;
 
+#define UDS_BOOTLOADER_LZ4_COMPRESSION_METHOD 0x1
+#define UDS_BOOTLOADER_CTR_ENCRYPTING_METHOD 0x1
+
 enum UDSBootloaderStateMachineStateEnum {
     kBootloaderSMStateCheckHasProgrammingRequest = 0,
     kBootloaderSMStateCheckHasValidApp,
@@ -66,16 +107,40 @@ typedef struct {
      */
     Iso14229Routine eraseAppProgramFlashRoutine;
 
+    /**
+     * @brief 0x31 RoutineControl 0xFF01: Iso14229DownloadResults of the last
+     * download
+     */
+    Iso14229Routine downloadResultsRoutine;
+
     BufferedWriter bufferedWriter;
+
+    /**
+     * @brief LZ4 decompression stage between TransferData and the buffered
+     * writer. lz4Sink is the TransferData sink of the block being decoded.
+     */
+    Iso14229Decompressor lz4Decompressor;
+    LZ4Decoder lz4Decoder;
+    Iso14229TransferSink lz4Sink;
+    void *lz4SinkCtx;
+    enum Iso14229ResponseCodeEnum lz4SinkErr;
+
+    /**
+     * @brief CTR decryption stage ahead of decompression
+     */
+    Iso14229Cipher ctrCipher;
+    CTRStream ctrStream;
+    uint8_t ctrLastInitialCounter[CTRSTREAM_BLOCK_SIZE];
 } UDSBootloaderInstance;
 
 int udsBootloaderInit(void *self, const void *cfg, Iso14229Instance *iso14229);
 int udsBootloaderPoll(void *self, Iso14229Instance *iso14229);
+uint32_t udsBootloaderNextDeadline(void *self, Iso14229Instance *iso14229);
 
 #define UDSBOOTSOFTWARE_MIDDLEWARE(self_obj, cfg_obj)                                              \
     {                                                                                              \
         .self = &self_obj, .cfg = &cfg_obj, .initFunc = udsBootloaderInit,                         \
-        .pollFunc = udsBootloaderPoll                                                              \
+        .pollFunc = udsBootloaderPoll, .nextDeadlineFunc = udsBootloaderNextDeadline               \
     }
 
 #endif
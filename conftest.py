@@ -136,6 +136,7 @@ class Iso14229TestHarness:
         self.bus = VirtualBus(channel=1)
         self.lib = lib
         self.should_exit = threading.Event()
+        self.poll_paused = threading.Event()
         self.recv_thread = threading.Thread(target=self.recv_task)
         self.poll_thread = threading.Thread(target=self.poll_task)
 
@@ -162,7 +163,8 @@ class Iso14229TestHarness:
         start_time = time.time()
         while not self.should_exit.is_set():
             time_now_ms = int((time.time() - start_time) * 1000)
-            self.lib.harnessPoll(time_now_ms)
+            if not self.poll_paused.is_set():
+                self.lib.harnessPoll(time_now_ms)
             time.sleep(0.01)
 
     def __enter__(self):
@@ -0,0 +1,93 @@
+#ifndef CTRSTREAM_H
+#define CTRSTREAM_H
+
+/**
+ * @file ctrstream.h
+ * @brief CTR mode (NIST SP 800-38A 6.5) around a user-provided 128 bit block
+ * cipher such as AES. Data is transformed in place and may be split at any
+ * byte: the position in the keystream is kept between calls.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define CTRSTREAM_BLOCK_SIZE 16
+
+/**
+ * @brief encrypts one block with the forward cipher. CTR mode uses the
+ * forward cipher for decryption too.
+ */
+typedef void (*CTRStreamBlockEncrypt)(void *ctx, const uint8_t in[CTRSTREAM_BLOCK_SIZE],
+                                      uint8_t out[CTRSTREAM_BLOCK_SIZE]);
+
+typedef struct {
+    CTRStreamBlockEncrypt encrypt;
+    void *encryptCtx;
+    uint8_t counter[CTRSTREAM_BLOCK_SIZE]; // next counter block
+    uint8_t keystream[CTRSTREAM_BLOCK_SIZE];
+    uint8_t keystreamUsed; // bytes of keystream already consumed
+} CTRStream;
+
+/**
+ * @brief
+ *
+ * @param self
+ * @param encrypt
+ * @param encryptCtx
+ * @param initialCounter the first counter block (nonce and counter)
+ * @return int 0 on success
+ */
+static inline int ctrStreamInit(CTRStream *self, CTRStreamBlockEncrypt encrypt, void *encryptCtx,
+                                const uint8_t initialCounter[CTRSTREAM_BLOCK_SIZE]) {
+    if (NULL == encrypt || NULL == initialCounter) {
+        return -1;
+    }
+    self->encrypt = encrypt;
+    self->encryptCtx = encryptCtx;
+    memcpy(self->counter, initialCounter, CTRSTREAM_BLOCK_SIZE);
+    self->keystreamUsed = CTRSTREAM_BLOCK_SIZE;
+    return 0;
+}
+
+/**
+ * @brief increments the whole counter block as a big-endian integer
+ */
+static inline void ctrStreamIncrement(uint8_t counter[CTRSTREAM_BLOCK_SIZE]) {
+    for (int i = CTRSTREAM_BLOCK_SIZE - 1; i >= 0; i--) {
+        if (++counter[i]) {
+            break;
+        }
+    }
+}
+
+/**
+ * @brief encrypts or decrypts `data` in place
+ *
+ * @param self
+ * @param data
+ * @param len
+ */
+static inline void ctrStreamXor(CTRStream *self, uint8_t *data, size_t len) {
+    while (len) {
+        if (CTRSTREAM_BLOCK_SIZE == self->keystreamUsed) {
+            self->encrypt(self->encryptCtx, self->counter, self->keystream);
+            ctrStreamIncrement(self->counter);
+            self->keystreamUsed = 0;
+        }
+
+        size_t n = CTRSTREAM_BLOCK_SIZE - self->keystreamUsed;
+        if (n > len) {
+            n = len;
+        }
+        const uint8_t *ks = self->keystream + self->keystreamUsed;
+        for (size_t i = 0; i < n; i++) {
+            data[i] ^= ks[i];
+        }
+        self->keystreamUsed += n;
+        data += n;
+        len -= n;
+    }
+}
+
+#endif
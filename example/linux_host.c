@@ -1,14 +1,21 @@
 #include <errno.h>
 #include <error.h>
+#include <fcntl.h>
 #include <linux/can.h>
+#include <linux/can/netlink.h>
 #include <linux/can/raw.h>
+#include <linux/rtnetlink.h>
+#include <limits.h>
 #include <net/if.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <linux/sockios.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -18,7 +25,8 @@
 
 #include "simple.h"
 
-int g_sockfd; // CAN socket FD
+int g_sockfd;                // CAN socket FD
+char g_ifname[IFNAMSIZ] = {0}; // CAN interface name
 bool g_should_exit = false;
 
 /**
@@ -72,6 +80,149 @@ int hostCANRxPoll(uint32_t *arb_id, uint8_t *data, uint8_t *size) {
     return 0;
 }
 
+int msleep(long tms);
+
+static uint8_t *g_nvm;
+static size_t g_nvmSize;
+
+/**
+ * @brief simple.h required function
+ *
+ * NVM is a file mapped into memory. Writes land in the page cache and
+ * hostNvmSync flushes them to the file.
+ */
+uint8_t *hostNvmMap(size_t size) {
+    int fd = open("nvm.bin", O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || ftruncate(fd, size) < 0) {
+        perror("nvm.bin");
+        exit(-1);
+    }
+    g_nvm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == g_nvm) {
+        perror("mmap");
+        exit(-1);
+    }
+    g_nvmSize = size;
+    return g_nvm;
+}
+
+/**
+ * @brief simple.h required function
+ */
+int hostNvmSync(void) { return msync(g_nvm, g_nvmSize, MS_SYNC); }
+
+/**
+ * @brief Waits for the frames written to g_sockfd to leave the controller.
+ * A CAN_RAW socket holds on to a frame until the driver reports that it was
+ * transmitted, so SIOCOUTQ drops to 0 once the bus has taken the last one.
+ */
+static int hostCANWaitTxDone(long timeout_ms) {
+    int queued = 0;
+    for (long i = 0; i < timeout_ms; i++) {
+        if (ioctl(g_sockfd, SIOCOUTQ, &queued) < 0) {
+            return -1;
+        }
+        if (0 == queued) {
+            return 0;
+        }
+        msleep(1);
+    }
+    return -1;
+}
+
+/**
+ * @brief Sends one RTM_NEWLINK request for g_ifname and waits for its
+ * acknowledgement.
+ *
+ * @param up the interface state to set
+ * @param bitrate 0: leave the bit timing alone
+ */
+static int hostCANNetlinkSetLink(bool up, uint32_t bitrate) {
+    struct {
+        struct nlmsghdr nh;
+        struct ifinfomsg ifi;
+        char attrs[128];
+    } req = {0};
+    struct {
+        struct nlmsghdr nh;
+        struct nlmsgerr err;
+    } ack = {0};
+    int err = -1;
+
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifi));
+    req.nh.nlmsg_type = RTM_NEWLINK;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    req.ifi.ifi_family = AF_UNSPEC;
+    req.ifi.ifi_index = if_nametoindex(g_ifname);
+    req.ifi.ifi_flags = up ? IFF_UP : 0;
+    req.ifi.ifi_change = IFF_UP;
+
+    if (bitrate) {
+        // IFLA_LINKINFO { IFLA_INFO_KIND "can", IFLA_INFO_DATA { IFLA_CAN_BITTIMING } }
+        struct can_bittiming bt = {.bitrate = bitrate};
+        struct rtattr *linkinfo = (struct rtattr *)((char *)&req + NLMSG_ALIGN(req.nh.nlmsg_len));
+        linkinfo->rta_type = IFLA_LINKINFO;
+        linkinfo->rta_len = RTA_LENGTH(0);
+
+        struct rtattr *kind = (struct rtattr *)((char *)linkinfo + RTA_ALIGN(linkinfo->rta_len));
+        kind->rta_type = IFLA_INFO_KIND;
+        kind->rta_len = RTA_LENGTH(strlen("can"));
+        memcpy(RTA_DATA(kind), "can", strlen("can"));
+        linkinfo->rta_len = RTA_ALIGN(linkinfo->rta_len) + RTA_ALIGN(kind->rta_len);
+
+        struct rtattr *data = (struct rtattr *)((char *)linkinfo + linkinfo->rta_len);
+        data->rta_type = IFLA_INFO_DATA;
+        data->rta_len = RTA_LENGTH(0);
+
+        struct rtattr *timing = (struct rtattr *)((char *)data + RTA_ALIGN(data->rta_len));
+        timing->rta_type = IFLA_CAN_BITTIMING;
+        timing->rta_len = RTA_LENGTH(sizeof(bt));
+        memcpy(RTA_DATA(timing), &bt, sizeof(bt));
+        data->rta_len = RTA_ALIGN(data->rta_len) + RTA_ALIGN(timing->rta_len);
+
+        linkinfo->rta_len += data->rta_len;
+        req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + RTA_ALIGN(linkinfo->rta_len);
+    }
+
+    int fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    if (fd < 0) {
+        return -1;
+    }
+    struct sockaddr_nl kernel = {.nl_family = AF_NETLINK};
+    if (sendto(fd, &req, req.nh.nlmsg_len, 0, (struct sockaddr *)&kernel, sizeof(kernel)) < 0) {
+        goto done;
+    }
+    if (recv(fd, &ack, sizeof(ack), 0) < (ssize_t)sizeof(ack) || NLMSG_ERROR != ack.nh.nlmsg_type) {
+        goto done;
+    }
+    err = ack.err.error; // 0 or -errno
+done:
+    close(fd);
+    return err;
+}
+
+/**
+ * @brief simple.h required function
+ *
+ * SocketCAN has no socket-level bit rate control: the interface is taken
+ * down, given the new bit timing and brought up again over rtnetlink. This
+ * needs CAP_NET_ADMIN and a real CAN controller: vcan has no bit rate and
+ * rejects the change.
+ */
+int hostCANSetBitrate(uint32_t baudrate) {
+    // The response to transitionMode may still be in the controller's queue
+    // and taking the interface down discards it.
+    if (hostCANWaitTxDone(100)) {
+        fprintf(stderr, "%s: transmit queue did not drain\n", g_ifname);
+    }
+    if (hostCANNetlinkSetLink(false, 0) || hostCANNetlinkSetLink(false, baudrate) ||
+        hostCANNetlinkSetLink(true, 0)) {
+        return -1;
+    }
+    return 0;
+}
+
 /**
  * @brief close file descriptor on SIGINT
  *
@@ -125,7 +276,8 @@ int main(int ac, char **av) {
         exit(-1);
     }
 
-    strcpy(ifr.ifr_name, av[1]);
+    strncpy(g_ifname, av[1], sizeof(g_ifname) - 1);
+    strcpy(ifr.ifr_name, g_ifname);
     ioctl(g_sockfd, SIOCGIFINDEX, &ifr);
 
     memset(&addr, 0, sizeof(addr));
@@ -145,6 +297,13 @@ int main(int ac, char **av) {
     simpleServerInit();
     while (!g_should_exit) {
         simpleServerPeriodicTask();
-        msleep(10);
+
+        // Sleep until the server has work to do or a frame arrives
+        uint32_t timeout_ms = simpleServerNextDeadline();
+        struct pollfd pfd = {.fd = g_sockfd, .events = POLLIN};
+        if (poll(&pfd, 1, timeout_ms > INT_MAX ? -1 : (int)timeout_ms) < 0 && EINTR != errno) {
+            perror("poll");
+            exit(-1);
+        }
     }
 }
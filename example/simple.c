@@ -17,8 +17,46 @@ static IsoTpLink isotpPhysLink;
 static IsoTpLink isotpFuncLink;
 static Iso14229Instance uds;
 
+// Writable data identifiers. 0x2E WriteDataByIdentifier updates them in the
+// mapped NVM and hostNvmSync commits the writes a second later.
+static Iso14229WriteBackDID writableDIDs[] = {
+    {.dataId = 0x0100, .size = 2, .nvmAddr = 0},
+    {.dataId = 0xF190, .size = 17, .nvmAddr = 2}, // VIN
+};
+#define NVM_SIZE 19
+
+static const Iso14229WriteBackConfig writeBackCfg = {
+    .dids = writableDIDs,
+    .nDIDs = sizeof(writableDIDs) / sizeof(writableDIDs[0]),
+    .nvmWriteDelay_ms = 1000,
+    .userNvmSync = hostNvmSync,
+};
+
 void hardReset() { printf("server hardReset! %u\n", iso14229UserGetms()); }
 
+void softReset(uint8_t resetType) {
+    printf("server softReset (0x%02x)! %u\n", resetType, iso14229UserGetms());
+}
+
+enum Iso14229ResponseCodeEnum linkControlVerify(uint8_t modeIdentifier, uint32_t baudrate) {
+    switch (baudrate) {
+    case 125000:
+    case 250000:
+    case 500000:
+    case 1000000:
+        return kPositiveResponse;
+    default:
+        return kRequestOutOfRange;
+    }
+}
+
+void linkControlTransition(uint8_t modeIdentifier, uint32_t baudrate) {
+    printf("server link transition to %u bit/s\n", baudrate);
+    if (0 != hostCANSetBitrate(baudrate)) {
+        printf("failed to set bit rate\n");
+    }
+}
+
 const Iso14229ServerConfig cfg = {
     .phys_recv_id = UDS_PHYS_RECV_ID,
     .func_recv_id = UDS_FUNC_RECV_ID,
@@ -28,9 +66,13 @@ const Iso14229ServerConfig cfg = {
     .userRDBIHandler = NULL,
     .userWDBIHandler = NULL,
     .userHardReset = hardReset,
+    .userSoftReset = softReset,
+    .userLinkControlVerify = linkControlVerify,
+    .userLinkControlTransition = linkControlTransition,
     .p2_ms = 50,
     .p2_star_ms = 2000,
     .s3_ms = 5000,
+    .writeBack = &writeBackCfg,
 };
 
 Iso14229Instance srv;
@@ -42,8 +84,17 @@ void simpleServerInit() {
     isotp_init_link(&isotpFuncLink, UDS_SEND_ID, isotpFuncSendBuf, ISOTP_BUFSIZE, isotpFuncRecvBuf,
                     ISOTP_BUFSIZE);
 
+    uint8_t *nvm = hostNvmMap(NVM_SIZE);
+    for (uint16_t i = 0; i < sizeof(writableDIDs) / sizeof(writableDIDs[0]); i++) {
+        writableDIDs[i].shadow = nvm + writableDIDs[i].nvmAddr;
+    }
+
     iso14229UserInit(&srv, &cfg);
     iso14229UserEnableService(&srv, kSID_ECU_RESET);
+    iso14229UserEnableService(&srv, kSID_DIAGNOSTIC_SESSION_CONTROL);
+    iso14229UserEnableService(&srv, kSID_LINK_CONTROL);
+    iso14229UserEnableService(&srv, kSID_READ_DATA_BY_IDENTIFIER);
+    iso14229UserEnableService(&srv, kSID_WRITE_DATA_BY_IDENTIFIER);
 }
 
 void simpleServerPeriodicTask() {
@@ -56,3 +107,5 @@ void simpleServerPeriodicTask() {
         iso14229UserReceiveCAN(&srv, arb_id, data, size);
     }
 }
+
+uint32_t simpleServerNextDeadline() { return iso14229UserNextDeadline(&srv); }
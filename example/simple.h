@@ -14,7 +14,37 @@
  */
 extern int hostCANRxPoll(uint32_t *arb_id, uint8_t *data, uint8_t *size);
 
+/**
+ * @brief reconfigure the CAN controller bit rate (0x87 LinkControl)
+ *
+ * @param baudrate bits per second
+ * @return int 0 on success, -1 on error
+ */
+extern int hostCANSetBitrate(uint32_t baudrate);
+
+/**
+ * @brief map `size` bytes of non-volatile memory. Writes to it are committed
+ * by hostNvmSync.
+ *
+ * @param size
+ * @return uint8_t* never NULL
+ */
+extern uint8_t *hostNvmMap(size_t size);
+
+/**
+ * @brief commit writes to the memory returned by hostNvmMap
+ *
+ * @return int 0 on success, -1 on error
+ */
+extern int hostNvmSync(void);
+
 void simpleServerInit();
 void simpleServerPeriodicTask();
 
+/**
+ * @brief milliseconds until simpleServerPeriodicTask must run again if no CAN
+ * frame arrives, or ISO14229_NO_DEADLINE
+ */
+uint32_t simpleServerNextDeadline();
+
 #endif
@@ -60,214 +60,2024 @@ static inline void iso14229SendResponse(Iso14229Instance *self, const Iso14229Se
     tport->pending = true;
 }
 
+/**
+ * @brief true once the last response has been handed to the CAN driver. The
+ * response is queued until P2 has elapsed and multi-frame responses are
+ * still in flight on the physical link until send_status returns to idle.
+ */
+static inline bool iso14229ResponseSent(const Iso14229Instance *self) {
+    return !self->tport_send.pending &&
+           ISOTP_SEND_STATUS_INPROGRESS != self->cfg->phys_link->send_status;
+}
+
 // Convenience method to retrieve from enum
 #define GET_RESPONSE_VIEW(self, fieldname) (&self->tport_send.buf.posResponse.type.fieldname)
 
 /**
- * @brief 0x10 DiagnosticSessionControl
+ * @brief decodes an unsigned big-endian field of `len` bytes such as the
+ * memoryAddress and memorySize parameters of memory-addressed services.
+ * `len` must not exceed 8.
+ */
+static inline uint64_t iso14229DecodeBigEndian(const uint8_t *buf, const uint8_t len) {
+    uint64_t val = 0;
+    for (uint8_t i = 0; i < len; i++) {
+        val = (val << 8) | buf[i];
+    }
+    return val;
+}
+
+/**
+ * @brief splits an addressAndLengthFormatIdentifier into the lengths of the
+ * memoryAddress (low nibble) and memorySize (high nibble) fields
+ * @return true if both are 1 to 8 bytes long
+ */
+static inline bool iso14229DecodeAddressAndLengthFormat(const uint8_t format,
+                                                        uint8_t *memoryAddressLength,
+                                                        uint8_t *memorySizeLength) {
+    *memoryAddressLength = format & 0x0F;
+    *memorySizeLength = (format & 0xF0) >> 4;
+    return *memoryAddressLength >= 1 && *memoryAddressLength <= sizeof(uint64_t) &&
+           *memorySizeLength >= 1 && *memorySizeLength <= sizeof(uint64_t);
+}
+
+static void iso14229PeriodicStopAll(Iso14229Instance *self);
+static void iso14229IOControlReturnAll(Iso14229Instance *self);
+static void iso14229Dispatch(Iso14229Instance *self, const Iso14229ServiceRequest *req);
+
+static void iso14229ClearDynamicDIDs(Iso14229Instance *self) {
+    self->dynamicDIDs.nDIDs = 0;
+    self->dynamicDIDs.nEntries = 0;
+}
+
+#define BITMAP_TEST(bitmap, n) ((bitmap)[(n) / 32] & (1UL << ((n) % 32)))
+#define BITMAP_SET(bitmap, n) ((bitmap)[(n) / 32] |= (1UL << ((n) % 32)))
+#define BITMAP_CLEAR(bitmap, n) ((bitmap)[(n) / 32] &= ~(1UL << ((n) % 32)))
+
+#define ISO14229_FNV1A_INIT 2166136261UL
+
+/**
+ * @brief continues the 32 bit FNV-1a hash `hash` over `data`. Start from
+ * ISO14229_FNV1A_INIT.
+ */
+static uint32_t iso14229FNV1a(uint32_t hash, const uint8_t *data, const uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+static inline uint32_t iso14229AccessRuleKey(const uint8_t sid, const uint8_t type,
+                                             const uint16_t id) {
+    return ((uint32_t)sid << 24) | ((uint32_t)type << 16) | id;
+}
+
+/**
+ * @brief Compiles the access rules for the active session and security level
+ * into the bitmaps checked by iso14229CallRequestedService
+ *
+ * @param self
+ */
+static void iso14229UpdateAccess(Iso14229Instance *self) {
+    Iso14229AccessState *access = &self->access;
+
+    // Cached responses passed the checks of the previous session and level
+    iso14229UserInvalidateCache(self);
+
+    // Sessions above 0x1F have no bit in the masks: only rules allowing all
+    // sessions apply to them
+    const uint32_t session =
+        self->diag_mode <= ISO14229_MAX_MASKED_SESSION ? ISO14229_SESSION_MASK(self->diag_mode) : 0;
+    // Anything allowed while locked stays allowed once a level is unlocked
+    const uint32_t security =
+        ISO14229_SECURITY_MASK(0) | ISO14229_SECURITY_MASK(self->security.level);
+
+    memset(access->sessionServices, 0xFF, sizeof(access->sessionServices));
+    memset(access->securityServices, 0xFF, sizeof(access->securityServices));
+    memset(access->sessionRules, 0, sizeof(access->sessionRules));
+    memset(access->securityRules, 0, sizeof(access->securityRules));
+
+    for (uint16_t i = 0; i < self->cfg->nAccessRules; i++) {
+        const Iso14229AccessRule *rule = &self->cfg->accessRules[i];
+        const bool sessionOk =
+            session ? rule->sessions & session : ISO14229_ALL_SESSIONS == rule->sessions;
+        const bool securityOk = rule->securityLevels & security;
+
+        if (kAccessRuleService == rule->type) {
+            if (!sessionOk) {
+                BITMAP_CLEAR(access->sessionServices, ISO14229_SID_INDEX(rule->sid));
+            }
+            if (!securityOk) {
+                BITMAP_CLEAR(access->securityServices, ISO14229_SID_INDEX(rule->sid));
+            }
+        } else {
+            if (sessionOk) {
+                BITMAP_SET(access->sessionRules, i);
+            }
+            if (securityOk) {
+                BITMAP_SET(access->securityRules, i);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Validates the access rules and marks services that have subfunction
+ * or data identifier rules
+ *
+ * @param self
+ * @return int 0 on success
+ */
+static int iso14229AccessInit(Iso14229Instance *self) {
+    const Iso14229ServerConfig *cfg = self->cfg;
+
+    if (cfg->nAccessRules > ISO14229_MAX_ACCESS_RULES ||
+        (cfg->nAccessRules && NULL == cfg->accessRules)) {
+        return -1;
+    }
+
+    for (uint16_t i = 0; i < cfg->nAccessRules; i++) {
+        const Iso14229AccessRule *rule = &cfg->accessRules[i];
+        if (!ISO14229_SID_IS_REQUEST(rule->sid) || rule->type > kAccessRuleDataIdentifier) {
+            return -1;
+        }
+        // sorted without duplicates, so that lookups can bisect
+        if (i > 0) {
+            const Iso14229AccessRule *prev = &cfg->accessRules[i - 1];
+            if (iso14229AccessRuleKey(prev->sid, prev->type, prev->id) >=
+                iso14229AccessRuleKey(rule->sid, rule->type, rule->id)) {
+                return -1;
+            }
+        }
+        if (kAccessRuleService != rule->type) {
+            BITMAP_SET(self->access.refinedServices, ISO14229_SID_INDEX(rule->sid));
+        }
+    }
+    return 0;
+}
+
+/**
+ * @return int index of the rule in cfg->accessRules, -1 if there is none
+ */
+static int iso14229FindAccessRule(const Iso14229Instance *self, const uint8_t sid,
+                                  const uint8_t type, const uint16_t id) {
+    const uint32_t key = iso14229AccessRuleKey(sid, type, id);
+    int lo = 0, hi = self->cfg->nAccessRules;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        const Iso14229AccessRule *rule = &self->cfg->accessRules[mid];
+        uint32_t midKey = iso14229AccessRuleKey(rule->sid, rule->type, rule->id);
+        if (midKey == key) {
+            return mid;
+        } else if (midKey < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Checks the subfunction or data identifier rule of `sid`, if any
+ *
+ * @param self
+ * @param sid
+ * @param type kAccessRuleSubFunction or kAccessRuleDataIdentifier
+ * @param id
+ * @return enum Iso14229ResponseCodeEnum
+ */
+static enum Iso14229ResponseCodeEnum iso14229CheckAccess(const Iso14229Instance *self,
+                                                         const uint8_t sid, const uint8_t type,
+                                                         const uint16_t id) {
+    if (!BITMAP_TEST(self->access.refinedServices, ISO14229_SID_INDEX(sid))) {
+        return kPositiveResponse;
+    }
+    int i = iso14229FindAccessRule(self, sid, type, id);
+    if (i < 0) {
+        return kPositiveResponse;
+    }
+    if (!BITMAP_TEST(self->access.sessionRules, i)) {
+        return kAccessRuleSubFunction == type ? kSubFunctionNotSupportedInActiveSession
+                                              : kRequestOutOfRange;
+    }
+    if (!BITMAP_TEST(self->access.securityRules, i)) {
+        return kSecurityAccessDenied;
+    }
+    return kPositiveResponse;
+}
+
+static const Iso14229WriteBackDID *iso14229FindWriteBackDID(const Iso14229Instance *self,
+                                                           const uint16_t dataId) {
+    const Iso14229WriteBackConfig *cfg = self->cfg->writeBack;
+    if (NULL == cfg) {
+        return NULL;
+    }
+    uint16_t lo = 0, hi = cfg->nDIDs;
+    while (lo < hi) {
+        const uint16_t mid = lo + (hi - lo) / 2;
+        if (cfg->dids[mid].dataId == dataId) {
+            return &cfg->dids[mid];
+        } else if (cfg->dids[mid].dataId < dataId) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Writes every dirty data identifier to NVM and commits them with
+ * userNvmSync. Failed writes stay dirty and are retried nvmWriteDelay_ms
+ * later.
+ */
+static void iso14229WriteBackFlush(Iso14229Instance *self) {
+    const Iso14229WriteBackConfig *cfg = self->cfg->writeBack;
+    if (NULL == cfg || !self->writeBack.pending) {
+        return;
+    }
+
+    uint32_t written[sizeof(self->writeBack.dirty) / sizeof(uint32_t)] = {0};
+    bool failed = false;
+    for (uint16_t i = 0; i < cfg->nDIDs; i++) {
+        if (!BITMAP_TEST(self->writeBack.dirty, i)) {
+            continue;
+        }
+        if (NULL == cfg->userNvmWrite || 0 == cfg->userNvmWrite(&cfg->dids[i])) {
+            BITMAP_SET(written, i);
+        } else {
+            failed = true;
+        }
+    }
+
+    // Written data identifiers stay dirty until the sync succeeds
+    if (NULL == cfg->userNvmSync || 0 == cfg->userNvmSync()) {
+        for (uint16_t i = 0; i < sizeof(written) / sizeof(uint32_t); i++) {
+            self->writeBack.dirty[i] &= ~written[i];
+        }
+    } else {
+        failed = true;
+    }
+
+    self->writeBack.pending = failed;
+    self->writeBack.flushTimer = iso14229UserGetms() + cfg->nvmWriteDelay_ms;
+}
+
+static void iso14229WriteBackPoll(Iso14229Instance *self) {
+    if (self->writeBack.pending &&
+        Iso14229TimeAfter(iso14229UserGetms(), self->writeBack.flushTimer)) {
+        iso14229WriteBackFlush(self);
+    }
+}
+
+/**
+ * @brief Enables all communication again, telling the application if any of
+ * it was disabled
+ */
+static void iso14229ResetCommunication(Iso14229Instance *self) {
+    for (uint8_t i = 0; i < 2; i++) {
+        if (self->communication[i].rxDisabled || self->communication[i].txDisabled) {
+            if (self->cfg->userCommunicationControl) {
+                self->cfg->userCommunicationControl(
+                    kEnableRxAndTx, kNormalAndNetworkManagementCommunicationMessages, 0);
+            }
+            break;
+        }
+    }
+    memset(self->communication, 0, sizeof(self->communication));
+}
+
+/**
+ * @brief Abandons a sendKey verification still running in userVerifyKeyPoll.
+ * The level it was for is no longer being unlocked.
+ */
+static void iso14229SecurityCancelVerify(Iso14229Instance *self) {
+    const Iso14229SecurityAccessConfig *cfg = self->cfg->securityAccess;
+    if (!self->security.verifyPending) {
+        return;
+    }
+    self->security.verifyPending = false;
+    if (NULL != cfg && NULL != cfg->userVerifyKeyCancel) {
+        cfg->userVerifyKeyCancel();
+    }
+}
+
+/**
+ * @brief Enter a diagnostic session, discarding state that is scoped to the
+ * session being left
+ *
+ * @param self
+ * @param diagSessionType
+ */
+static void iso14229SetDiagnosticSession(Iso14229Instance *self,
+                                         enum Iso14229DiagnosticModeEnum diagSessionType) {
+    // Dynamic DIDs, periodic schedules and ROE events read their sources
+    // without checking the access rules again, so they cannot outlive the
+    // security level they were set up with
+    const bool relocked = 0 != self->security.level;
+
+    // ISO14229-1:2013 9.2.1: any session transition relocks the server
+    iso14229SecurityCancelVerify(self);
+    self->security.level = 0;
+    self->security.seedLevel = 0;
+    self->linkControl.verified = false;
+
+    if (kDiagModeDefault != self->diag_mode) {
+        iso14229WriteBackFlush(self);
+    }
+
+    if (kDiagModeDefault == diagSessionType || relocked) {
+        iso14229PeriodicStopAll(self);
+        iso14229ClearDynamicDIDs(self);
+        memset(&self->roe, 0, sizeof(self->roe));
+    }
+    if (kDiagModeDefault == diagSessionType) {
+        iso14229IOControlReturnAll(self);
+        self->persistent.dtcStore.settingOff = false;
+        iso14229ResetCommunication(self);
+    }
+    self->diag_mode = diagSessionType;
+    iso14229UpdateAccess(self);
+}
+
+static Iso14229DynamicDID *iso14229FindDynamicDID(Iso14229Instance *self, const uint16_t dataId) {
+    for (uint8_t i = 0; i < self->dynamicDIDs.nDIDs; i++) {
+        if (self->dynamicDIDs.dids[i].dataId == dataId) {
+            return &self->dynamicDIDs.dids[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Copies the data record of `dataId` into `dst` from its write-back
+ * shadow, by running the gather list of a dynamically defined DID or by
+ * calling userRDBIHandler
+ *
+ * @param self
+ * @param dataId
+ * @param dst
+ * @param dstSize size of dst in bytes
+ * @param len number of bytes written to dst
+ * @return enum Iso14229ResponseCodeEnum
+ */
+static enum Iso14229ResponseCodeEnum iso14229ReadDID(Iso14229Instance *self, const uint16_t dataId,
+                                                     uint8_t *dst, const uint16_t dstSize,
+                                                     uint16_t *len) {
+    const Iso14229WriteBackDID *wb = iso14229FindWriteBackDID(self, dataId);
+    if (NULL != wb) {
+        if (wb->size > dstSize) {
+            return kResponseTooLong;
+        }
+        memcpy(dst, wb->shadow, wb->size);
+        *len = wb->size;
+        return kPositiveResponse;
+    }
+
+    const Iso14229DynamicDID *dyn = iso14229FindDynamicDID(self, dataId);
+    if (NULL != dyn) {
+        if (dyn->size > dstSize) {
+            return kResponseTooLong;
+        }
+        const Iso14229DynamicDIDEntry *entry = &self->dynamicDIDs.arena[dyn->firstEntry];
+        const Iso14229DynamicDIDEntry *end = entry + dyn->nEntries;
+        for (; entry < end; entry++) {
+            memcpy(dst, entry->src, entry->len);
+            dst += entry->len;
+        }
+        *len = dyn->size;
+        return kPositiveResponse;
+    }
+
+    if (NULL == self->cfg->userRDBIHandler) {
+        return kRequestOutOfRange;
+    }
+
+    uint8_t *data_location = NULL;
+    uint16_t dataRecordSize = 0;
+    enum Iso14229ResponseCodeEnum err =
+        self->cfg->userRDBIHandler(dataId, &data_location, &dataRecordSize);
+    if (kPositiveResponse != err) {
+        return err;
+    }
+    if (dataRecordSize > dstSize) {
+        return kResponseTooLong;
+    }
+    memcpy(dst, data_location, dataRecordSize);
+    *len = dataRecordSize;
+    return kPositiveResponse;
+}
+
+/**
+ * @brief 0x10 DiagnosticSessionControl
+ *
+ * @param self
+ * @param data
+ * @param size
+ */
+void iso14229DiagnosticSessionControl(Iso14229Instance *self, const Iso14229ServiceRequest *req) {
+    DiagnosticSessionControlResponse *response = GET_RESPONSE_VIEW(self, diagnosticSessionControl);
+
+    uint8_t diagSessionType = 0;
+    diagSessionType = req->buf[0] & 0x7F;
+
+    // TODO: add user-defined diag modes
+    switch (diagSessionType) {
+    case kDiagModeDefault:
+    case kDiagModeProgramming:
+    case kDiagModeExtendedDiagnostic:
+        break;
+    default:
+        iso14229SendNegativeResponse(self, req, kSubFunctionNotSupported);
+        return;
+    }
+
+    iso14229SetDiagnosticSession(self, diagSessionType);
+
+    response->diagSessionType = diagSessionType;
+
+    // ISO14229-1-2013: Table 29
+    // resolution: 1ms
+    response->P2 = Iso14229htons(self->cfg->p2_ms);
+    // resolution: 10ms
+    response->P2star = Iso14229htons(self->cfg->p2_star_ms / 10);
+
+    iso14229SendResponse(self, req, sizeof(DiagnosticSessionControlResponse));
+}
+
+/**
+ * @brief 0x11 ECUReset
+ *
+ * @param self
+ * @param data
+ * @param size
+ */
+void iso14229ECUReset(Iso14229Instance *self, const Iso14229ServiceRequest *req) {
+    ECUResetResponse *response = GET_RESPONSE_VIEW(self, ecuReset);
+    uint8_t resetType = 0;
+    resetType = req->buf[0] & 0x7F;
+
+    if (!self->ecu_reset_requested &&
+        (kHardReset == resetType || kKeyOffOnReset == resetType || kSoftReset == resetType)) {
+        self->ecu_reset_type = resetType;
+        self->ecu_reset_requested = true;
+    }
+
+    response->resetType = resetType;
+    response->powerDownTime = 0;
+
+    iso14229SendResponse(self, req, sizeof(ECUResetResponse));
+}
+
+static inline uint32_t iso14229DTCAt(const Iso14229DTCStoreConfig *cfg, const uint16_t dtcIndex) {
+    const uint8_t *dtc = &cfg->dtcs[3 * dtcIndex];
+    return iso14229LoadBE24(dtc);
+}
+
+/**
+ * @brief binary search of the DTC store's sorted index
+ * @return position in sortedIndex of the first DTC that is not less than `dtc`
+ */
+static uint16_t iso14229DTCLowerBound(const Iso14229DTCStore *store, const uint32_t dtc) {
+    uint16_t lo = 0;
+    uint16_t hi = store->count;
+    while (lo < hi) {
+        uint16_t mid = lo + (hi - lo) / 2;
+        if (iso14229DTCAt(store->cfg, store->cfg->sortedIndex[mid]) < dtc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// ISO14229-1:2013 D.6: FaultDetectionCounter limits
+#define FDC_MAX 127
+#define FDC_MIN -128
+
+static void iso14229DTCMarkDirty(Iso14229DTCStore *store, const uint16_t first,
+                                 const uint16_t last) {
+    if (NULL == store->cfg->userNvmWriteStatuses) {
+        return;
+    }
+    if (store->dirty) {
+        store->dirtyFirst = MIN(store->dirtyFirst, first);
+        store->dirtyLast = MAX(store->dirtyLast, last);
+        return;
+    }
+    store->dirty = true;
+    store->dirtyFirst = first;
+    store->dirtyLast = last;
+    store->nvmWriteTimer = iso14229UserGetms() + store->cfg->nvmWriteDelay_ms;
+}
+
+/**
+ * @brief Updates the fault detection counter and statusOfDTC of one DTC
+ * (ISO14229-1:2013 D.2)
+ */
+static void iso14229DTCApplyResult(Iso14229DTCStore *store, const Iso14229DTCReport *report) {
+    const Iso14229DTCStoreConfig *cfg = store->cfg;
+    const uint16_t i = report->dtcIndex;
+    int fdc = 0;
+
+    if (i >= store->count) {
+        return;
+    }
+
+    if (NULL != cfg->faultDetectionCounters) {
+        fdc = cfg->faultDetectionCounters[i];
+    }
+
+    switch (report->result) {
+    case kDTCTestPreFailed:
+        if (NULL != cfg->faultDetectionCounters && cfg->prefailedStep) {
+            fdc = MIN(fdc + cfg->prefailedStep, FDC_MAX);
+            break;
+        }
+        // fallthrough
+    case kDTCTestFailed:
+        fdc = FDC_MAX;
+        break;
+    case kDTCTestPrePassed:
+        if (NULL != cfg->faultDetectionCounters && cfg->prepassedStep) {
+            fdc = MAX(fdc - cfg->prepassedStep, FDC_MIN);
+            break;
+        }
+        // fallthrough
+    case kDTCTestPassed:
+        fdc = FDC_MIN;
+        break;
+    default:
+        return;
+    }
+
+    if (NULL != cfg->faultDetectionCounters) {
+        cfg->faultDetectionCounters[i] = fdc;
+    }
+
+    uint8_t status = cfg->statuses[i];
+    if (FDC_MAX == fdc) {
+        status |= ISO14229_DTC_STATUS_TEST_FAILED |
+                  ISO14229_DTC_STATUS_TEST_FAILED_THIS_OPERATION_CYCLE |
+                  ISO14229_DTC_STATUS_PENDING_DTC | ISO14229_DTC_STATUS_CONFIRMED_DTC |
+                  ISO14229_DTC_STATUS_TEST_FAILED_SINCE_LAST_CLEAR;
+        status &= ~(ISO14229_DTC_STATUS_TEST_NOT_COMPLETED_SINCE_LAST_CLEAR |
+                    ISO14229_DTC_STATUS_TEST_NOT_COMPLETED_THIS_OPERATION_CYCLE);
+        if (NULL != cfg->agingCounters) {
+            cfg->agingCounters[i] = 0;
+        }
+    } else if (FDC_MIN == fdc) {
+        status &= ~(ISO14229_DTC_STATUS_TEST_FAILED |
+                    ISO14229_DTC_STATUS_TEST_NOT_COMPLETED_SINCE_LAST_CLEAR |
+                    ISO14229_DTC_STATUS_TEST_NOT_COMPLETED_THIS_OPERATION_CYCLE);
+    }
+
+    if (status != cfg->statuses[i]) {
+        cfg->statuses[i] = status;
+        iso14229DTCMarkDirty(store, i, i);
+    }
+}
+
+static void iso14229DTCProcessQueue(Iso14229DTCStore *store, uint16_t budget) {
+    while (budget-- && store->queueLen > 0) {
+        iso14229DTCApplyResult(store, &store->queue[store->queueHead]);
+        store->queueHead = (store->queueHead + 1) % ISO14229_DTC_REPORT_QUEUE_SIZE;
+        store->queueLen--;
+    }
+}
+
+/**
+ * @brief Applies one queued test result per call, up to
+ * ISO14229_DTC_POLL_BUDGET per poll round, then writes back statuses that have
+ * been dirty for nvmWriteDelay_ms
+ * @return true when done for this round
+ */
+static bool iso14229DTCPoll(Iso14229Instance *self) {
+    Iso14229DTCStore *store = &self->persistent.dtcStore;
+    if (NULL == store->cfg) {
+        return true;
+    }
+
+    if (store->queueLen > 0 && self->poll.dtcBudget > 0) {
+        iso14229DTCProcessQueue(store, 1);
+        self->poll.dtcBudget--;
+        return false;
+    }
+
+    if (store->dirty && Iso14229TimeAfter(iso14229UserGetms(), store->nvmWriteTimer)) {
+        const uint16_t first = store->dirtyFirst;
+        if (0 == store->cfg->userNvmWriteStatuses(first, &store->cfg->statuses[first],
+                                                  store->dirtyLast - first + 1)) {
+            store->dirty = false;
+        } else {
+            store->nvmWriteTimer = iso14229UserGetms() + store->cfg->nvmWriteDelay_ms;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Resets DTC information as required by 0x14 ClearDiagnosticInformation
+ *
+ * @param store
+ * @param dtcIndex -1: all DTCs
+ */
+static void iso14229DTCClear(Iso14229DTCStore *store, const int dtcIndex) {
+    const Iso14229DTCStoreConfig *cfg = store->cfg;
+    uint16_t first = 0;
+    uint16_t last = store->count - 1;
+
+    if (0 == store->count) {
+        return;
+    }
+
+    if (dtcIndex >= 0) {
+        first = last = dtcIndex;
+    } else {
+        // Results reported before the clear must not resurrect old statuses
+        store->queueLen = 0;
+    }
+
+    for (uint16_t i = first; i <= last; i++) {
+        cfg->statuses[i] = ISO14229_DTC_STATUS_TEST_NOT_COMPLETED_SINCE_LAST_CLEAR |
+                           ISO14229_DTC_STATUS_TEST_NOT_COMPLETED_THIS_OPERATION_CYCLE;
+        if (NULL != cfg->faultDetectionCounters) {
+            cfg->faultDetectionCounters[i] = 0;
+        }
+        if (NULL != cfg->agingCounters) {
+            cfg->agingCounters[i] = 0;
+        }
+    }
+    iso14229DTCMarkDirty(store, first, last);
+
+    if (NULL != cfg->userOnDTCCleared) {
+        cfg->userOnDTCCleared(dtcIndex);
+    }
+}
+
+/**
+ * @brief 0x14 ClearDiagnosticInformation
+ *
+ * @param self
+ * @param data
+ * @param size
+ */
+void iso14229ClearDiagnosticInformation(Iso14229Instance *self, const Iso14229ServiceRequest *req) {
+    Iso14229DTCStore *store = &self->persistent.dtcStore;
+
+    if (NULL == store->cfg) {
+        return iso14229SendNegativeResponse(self, req, kServiceNotSupported);
+    }
+
+    if (req->size != 3) {
+        return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+    }
+
+    const uint32_t groupOfDTC = iso14229LoadBE24(req->buf);
+    if (ISO14229_GROUP_OF_ALL_DTCS == groupOfDTC) {
+        iso14229DTCClear(store, -1);
+    } else {
+        int dtcIndex = iso14229UserFindDTC(self, groupOfDTC);
+        if (dtcIndex < 0) {
+            return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+        }
+        iso14229DTCClear(store, dtcIndex);
+    }
+
+    iso14229SendResponse(self, req, sizeof(ClearDiagnosticInformationResponse));
+}
+
+/*
+Status mask queries scan statusOfDTC a word at a time. Words in which no
+status matches the mask are skipped without looking at individual bytes.
+*/
+#define DTC_SCAN_BROADCAST(byte) ((uint64_t)(byte)*0x0101010101010101ULL)
+
+// Sets the high bit of each nonzero byte in w and clears all other bits
+static inline uint64_t nonzeroBytes(const uint64_t w) {
+    const uint64_t low7 = DTC_SCAN_BROADCAST(0x7F);
+    return (((w & low7) + low7) | w) & ~low7;
+}
+
+static uint16_t iso14229DTCCountByStatusMask(const Iso14229DTCStore *store, const uint8_t mask) {
+    const uint8_t *statuses = store->cfg->statuses;
+    const uint64_t broadcast = DTC_SCAN_BROADCAST(mask);
+    uint16_t count = 0;
+    uint16_t i = 0;
+
+    for (; i + sizeof(uint64_t) <= store->count; i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, statuses + i, sizeof(w));
+        count += __builtin_popcountll(nonzeroBytes(w & broadcast));
+    }
+    for (; i < store->count; i++) {
+        count += (statuses[i] & mask) != 0;
+    }
+    return count;
+}
+
+/**
+ * @brief Writes a DTCAndStatusRecord for each DTC matching `mask` directly into
+ * the response buffer
+ *
+ * @param store
+ * @param mask DTCStatusMask, already restricted to the availability mask
+ * @param out response buffer
+ * @param outSize
+ * @param len number of bytes written
+ * @return kResponseTooLong if the records don't fit in out
+ */
+static enum Iso14229ResponseCodeEnum
+iso14229DTCWriteByStatusMask(const Iso14229DTCStore *store, const uint8_t mask, uint8_t *out,
+                             const uint16_t outSize, uint16_t *len) {
+    const Iso14229DTCStoreConfig *cfg = store->cfg;
+    const uint64_t broadcast = DTC_SCAN_BROADCAST(mask);
+    const uint8_t *const start = out;
+    const uint8_t *const end = out + outSize;
+    uint16_t i = 0;
+
+    while (i < store->count) {
+        if (i + sizeof(uint64_t) <= store->count) {
+            uint64_t w;
+            memcpy(&w, cfg->statuses + i, sizeof(w));
+            if (0 == (w & broadcast)) {
+                i += sizeof(uint64_t);
+                continue;
+            }
+        }
+        const uint16_t wordEnd = MIN(i + sizeof(uint64_t), store->count);
+        for (; i < wordEnd; i++) {
+            const uint8_t status = cfg->statuses[i] & cfg->statusAvailabilityMask;
+            if (status & mask) {
+                if (end - out < 4) {
+                    return kResponseTooLong;
+                }
+                memcpy(out, &cfg->dtcs[3 * i], 3);
+                out[3] = status;
+                out += 4;
+            }
+        }
+    }
+    *len = out - start;
+    return kPositiveResponse;
+}
+
+/**
+ * @brief 0x19 ReadDTCInformation
+ *
+ * @param self
+ * @param data
+ * @param size
+ */
+void iso14229ReadDTCInformation(Iso14229Instance *self, const Iso14229ServiceRequest *req) {
+    ReadDTCInformationResponse *response = GET_RESPONSE_VIEW(self, readDTCInformation);
+    const Iso14229DTCStore *store = &self->persistent.dtcStore;
+    enum Iso14229ResponseCodeEnum err = kPositiveResponse;
+    uint8_t *data = response->data;
+    uint16_t len = 0;
+
+    // Bytes available in the response buffer after the reportType
+    const uint16_t dataBufSize = ISO14229_TPORT_SEND_BUFSIZE -
+                                 offsetof(Iso14229PositiveResponse, type) -
+                                 offsetof(ReadDTCInformationResponse, data);
+
+    if (NULL == store->cfg) {
+        return iso14229SendNegativeResponse(self, req, kServiceNotSupported);
+    }
+
+    const uint8_t reportType = req->buf[0] & 0x7F;
+    const uint8_t availabilityMask = store->cfg->statusAvailabilityMask;
+    response->reportType = reportType;
+
+    switch (reportType) {
+    case kReportNumberOfDTCByStatusMask: {
+        if (req->size != 2) {
+            return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+        }
+        uint16_t count = iso14229DTCCountByStatusMask(store, req->buf[1] & availabilityMask);
+        data[0] = availabilityMask;
+        data[1] = ISO14229_DTC_FORMAT_ISO14229_1;
+        data[2] = count >> 8;
+        data[3] = count & 0xFF;
+        len = 4;
+        break;
+    }
+    case kReportDTCByStatusMask:
+        if (req->size != 2) {
+            return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+        }
+        data[0] = availabilityMask;
+        err = iso14229DTCWriteByStatusMask(store, req->buf[1] & availabilityMask, data + 1,
+                                           dataBufSize - 1, &len);
+        len += 1;
+        break;
+    case kReportSupportedDTC:
+        if (req->size != 1) {
+            return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+        }
+        data[0] = availabilityMask;
+        len = 1;
+        if (1 + 4 * store->count > dataBufSize) {
+            err = kResponseTooLong;
+            break;
+        }
+        for (uint16_t i = 0; i < store->count; i++, len += 4) {
+            memcpy(data + len, &store->cfg->dtcs[3 * i], 3);
+            data[len + 3] = store->cfg->statuses[i] & availabilityMask;
+        }
+        break;
+    case kReportDTCSnapshotRecordByDTCNumber:
+    case kReportDTCExtDataRecordByDTCNumber: {
+        enum Iso14229ResponseCodeEnum (*readRecord)(uint16_t, uint8_t, uint8_t *, uint16_t,
+                                                    uint16_t *) =
+            (kReportDTCSnapshotRecordByDTCNumber == reportType)
+                ? store->cfg->userReadSnapshotRecord
+                : store->cfg->userReadExtDataRecord;
+        if (NULL == readRecord) {
+            return iso14229SendNegativeResponse(self, req, kSubFunctionNotSupported);
+        }
+        if (req->size != 5) {
+            return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+        }
+        uint32_t dtc = iso14229LoadBE24(req->buf + 1);
+        int dtcIndex = iso14229UserFindDTC(self, dtc);
+        if (dtcIndex < 0) {
+            return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+        }
+        memcpy(data, &req->buf[1], 3);
+        data[3] = store->cfg->statuses[dtcIndex] & availabilityMask;
+        err = readRecord(dtcIndex, req->buf[4], data + 4, dataBufSize - 4, &len);
+        len += 4;
+        break;
+    }
+    default:
+        return iso14229SendNegativeResponse(self, req, kSubFunctionNotSupported);
+    }
+
+    if (kPositiveResponse != err) {
+        return iso14229SendNegativeResponse(self, req, err);
+    }
+
+    iso14229SendResponse(self, req, sizeof(ReadDTCInformationResponse) + len);
+}
+
+static const Iso14229CacheRule *iso14229FindCacheRule(const Iso14229ResponseCacheConfig *cache,
+                                                      const uint16_t dataId) {
+    uint16_t lo = 0, hi = cache->nRules;
+    while (lo < hi) {
+        const uint16_t mid = lo + (hi - lo) / 2;
+        if (cache->rules[mid].dataId == dataId) {
+            return &cache->rules[mid];
+        } else if (cache->rules[mid].dataId < dataId) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+static inline uint8_t *iso14229CachedResponse(const Iso14229ResponseCacheConfig *cache,
+                                              const uint8_t idx) {
+    return cache->responses + idx * cache->responseSize;
+}
+
+void iso14229UserInvalidateCache(Iso14229Instance *self) {
+    const Iso14229ResponseCacheConfig *cache = self->cfg->responseCache;
+    if (NULL == cache) {
+        return;
+    }
+    for (uint8_t i = 0; i < cache->nEntries; i++) {
+        cache->entries[i].keyLen = 0;
+    }
+}
+
+void iso14229UserInvalidateCachedDID(Iso14229Instance *self, const uint16_t dataId) {
+    const Iso14229ResponseCacheConfig *cache = self->cfg->responseCache;
+    if (NULL == cache) {
+        return;
+    }
+    for (uint8_t i = 0; i < cache->nEntries; i++) {
+        Iso14229CacheEntry *entry = &cache->entries[i];
+        // The key is the 0x22 SID followed by data identifiers
+        for (uint8_t k = 1; k + 1 < entry->keyLen; k += 2) {
+            if (iso14229LoadBE16(entry->key + k) == dataId) {
+                entry->keyLen = 0;
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Sends the cached response to `buf`, if any
+ * @return true if the response has been handed to the ISO-TP layer
+ */
+static bool iso14229CacheSend(Iso14229Instance *self, const uint8_t *buf, const uint16_t size) {
+    const Iso14229ResponseCacheConfig *cache = self->cfg->responseCache;
+    const uint32_t now = iso14229UserGetms();
+
+    // A pending sendKey or an overload answers every request with 0x21
+    if (NULL == cache || size > ISO14229_RESPONSE_CACHE_KEY_LEN || self->security.verifyPending ||
+        self->overloaded) {
+        return false;
+    }
+
+    for (uint8_t i = 0; i < cache->nEntries; i++) {
+        Iso14229CacheEntry *entry = &cache->entries[i];
+        if (entry->keyLen != size || 0 != memcmp(entry->key, buf, size)) {
+            continue;
+        }
+        if (entry->expires && Iso14229TimeAfter(now, entry->expiry)) {
+            entry->keyLen = 0;
+            return false;
+        }
+        // e.g. a previous multi-frame response is still being sent
+        const uint8_t *response = iso14229CachedResponse(cache, i);
+        if (ISOTP_RET_OK != isotp_send(self->cfg->phys_link, response, entry->responseLen)) {
+            return false;
+        }
+        entry->lastUsed = now;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Stores the response that has just been written to tport_send
+ *
+ * @param self
+ * @param req
+ * @param expires
+ * @param ttl_ms
+ */
+static void iso14229CacheStore(Iso14229Instance *self, const Iso14229ServiceRequest *req,
+                               const bool expires, const uint32_t ttl_ms) {
+    const Iso14229ResponseCacheConfig *cache = self->cfg->responseCache;
+    const uint16_t keyLen = 1 + req->size;
+    const uint32_t now = iso14229UserGetms();
+    uint8_t victim = 0;
+
+    if (0 == cache->nEntries || keyLen > ISO14229_RESPONSE_CACHE_KEY_LEN ||
+        self->tport_send.buf_len_used > cache->responseSize) {
+        return;
+    }
+
+    // An unused entry, else the least recently used one
+    for (uint8_t i = 0; i < cache->nEntries; i++) {
+        const Iso14229CacheEntry *entry = &cache->entries[i];
+        if (0 == entry->keyLen) {
+            victim = i;
+            break;
+        }
+        if (Iso14229TimeAfter(cache->entries[victim].lastUsed, entry->lastUsed)) {
+            victim = i;
+        }
+    }
+
+    Iso14229CacheEntry *entry = &cache->entries[victim];
+    entry->key[0] = req->sid;
+    memcpy(entry->key + 1, req->buf, req->size);
+    entry->keyLen = keyLen;
+    entry->responseLen = self->tport_send.buf_len_used;
+    entry->expires = expires;
+    entry->expiry = now + ttl_ms;
+    entry->lastUsed = now;
+    memcpy(iso14229CachedResponse(cache, victim), self->tport_send.buf.raw, entry->responseLen);
+}
+
+/**
+ * @brief 0x22 ReadDataByIdentifier
+ *
+ * @param self
+ * @param data
+ * @param size
+ */
+void iso14229ReadDataByIdentifier(Iso14229Instance *self, const Iso14229ServiceRequest *req) {
+    ReadDataByIdentifierResponse *response = GET_RESPONSE_VIEW(self, readDataByIdentifier);
+    const uint16_t numDIDs = req->size / sizeof(uint16_t);
+    uint16_t dataRecordSize = 0;
+    uint16_t responseLength = 0;
+    uint16_t dataId = 0;
+    enum Iso14229ResponseCodeEnum rdbi_response;
+    const Iso14229ResponseCacheConfig *cache = self->cfg->responseCache;
+    bool cacheable = NULL != cache;
+    bool expires = false;
+    uint32_t ttl_ms = 0;
+
+    // Bytes available in the response buffer after the response SID
+    const uint16_t responseBufSize =
+        ISO14229_TPORT_SEND_BUFSIZE - offsetof(Iso14229PositiveResponse, type);
+
+    if (NULL == self->cfg->userRDBIHandler && 0 == self->dynamicDIDs.nDIDs &&
+        NULL == self->cfg->writeBack) {
+        return iso14229SendNegativeResponse(self, req, kServiceNotSupported);
+    }
+
+    if (req->size % sizeof(uint16_t) != 0) {
+        return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+    }
+
+    for (uint16_t i = 0; i < numDIDs; i++) {
+        dataId = iso14229LoadBE16(req->buf + sizeof(uint16_t) * i);
+
+        uint8_t *offset = ((uint8_t *)response) + responseLength;
+        if (responseLength + sizeof(uint16_t) > responseBufSize) {
+            return iso14229SendNegativeResponse(self, req, kResponseTooLong);
+        }
+
+        // ASSUMPTION: one inaccessible DID fails the whole request
+        rdbi_response = iso14229CheckAccess(self, req->sid, kAccessRuleDataIdentifier, dataId);
+        if (kPositiveResponse != rdbi_response) {
+            return iso14229SendNegativeResponse(self, req, rdbi_response);
+        }
+
+        rdbi_response = iso14229ReadDID(self, dataId, offset + sizeof(uint16_t),
+                                        responseBufSize - responseLength - sizeof(uint16_t),
+                                        &dataRecordSize);
+        if (kPositiveResponse != rdbi_response) {
+            return iso14229SendNegativeResponse(self, req, rdbi_response);
+        }
+
+        iso14229StoreBE16(offset, dataId);
+        responseLength += sizeof(uint16_t) + dataRecordSize;
+
+        const Iso14229CacheRule *rule = cacheable ? iso14229FindCacheRule(cache, dataId) : NULL;
+        if (NULL == rule) {
+            cacheable = false;
+        } else if (ISO14229_CACHE_TTL_UNTIL_INVALIDATED != rule->ttl_ms &&
+                   (!expires || rule->ttl_ms < ttl_ms)) {
+            expires = true;
+            ttl_ms = rule->ttl_ms;
+        }
+    }
+
+    iso14229SendResponse(self, req, sizeof(ReadDataByIdentifierResponse) + responseLength);
+
+    if (cacheable) {
+        iso14229CacheStore(self, req, expires, ttl_ms);
+    }
+}
+
+#define SECURITY_DEFAULT_MAX_ATTEMPTS 3
+
+static inline uint8_t iso14229SecurityMaxAttempts(const Iso14229SecurityAccessConfig *cfg) {
+    return cfg->maxAttempts ? cfg->maxAttempts : SECURITY_DEFAULT_MAX_ATTEMPTS;
+}
+
+static void iso14229SecuritySetFailedAttempts(Iso14229Instance *self, const uint8_t n) {
+    const Iso14229SecurityAccessConfig *cfg = self->cfg->securityAccess;
+    self->security.failedAttempts = n;
+    if (NULL != cfg->userSaveFailedAttempts) {
+        cfg->userSaveFailedAttempts(n);
+    }
+}
+
+static void iso14229SecurityStartDelay(Iso14229Instance *self) {
+    self->security.delayActive = true;
+    self->security.delayTimer = iso14229UserGetms() + self->cfg->securityAccess->delay_ms;
+}
+
+/**
+ * @brief Restores the failed attempt counter so that a reset during the
+ * required time delay restarts the delay instead of skipping it
+ */
+static void iso14229SecurityInit(Iso14229Instance *self) {
+    const Iso14229SecurityAccessConfig *cfg = self->cfg->securityAccess;
+    if (NULL == cfg || NULL == cfg->userLoadFailedAttempts) {
+        return;
+    }
+    self->security.failedAttempts = cfg->userLoadFailedAttempts();
+    if (self->security.failedAttempts >= iso14229SecurityMaxAttempts(cfg)) {
+        iso14229SecurityStartDelay(self);
+    }
+}
+
+/**
+ * @brief Finishes a sendKey request once the key has been verified
+ */
+static void iso14229SecurityKeyVerified(Iso14229Instance *self, const Iso14229ServiceRequest *req,
+                                        enum Iso14229ResponseCodeEnum result) {
+    SecurityAccessResponse *response = GET_RESPONSE_VIEW(self, securityAccess);
+    Iso14229SecurityAccess *sec = &self->security;
+    const uint8_t level = sec->seedLevel;
+
+    sec->verifyPending = false;
+    sec->seedLevel = 0; // a seed is only good for one attempt
+
+    // The seed was discarded while the key was being verified
+    if (0 == level) {
+        return iso14229SendNegativeResponse(self, req, kRequestSequenceError);
+    }
+
+    if (kPositiveResponse == result) {
+        sec->level = level;
+        iso14229UpdateAccess(self);
+        if (sec->failedAttempts) {
+            iso14229SecuritySetFailedAttempts(self, 0);
+        }
+        response->securityAccessType = level * 2;
+        return iso14229SendResponse(self, req, sizeof(SecurityAccessResponse));
+    }
+
+    if (kInvalidKey != result) {
+        return iso14229SendNegativeResponse(self, req, result);
+    }
+
+    iso14229SecuritySetFailedAttempts(self, sec->failedAttempts + 1);
+    if (sec->failedAttempts >= iso14229SecurityMaxAttempts(self->cfg->securityAccess)) {
+        iso14229SecurityStartDelay(self);
+        return iso14229SendNegativeResponse(self, req, kExceedNumberOfAttempts);
+    }
+    iso14229SendNegativeResponse(self, req, kInvalidKey);
+}
+
+/**
+ * @brief Runs the background part of 0x27 SecurityAccess: pending key
+ * verification, the required time delay and the seed pool
+ */
+static void iso14229SecurityAccessPoll(Iso14229Instance *self) {
+    const Iso14229SecurityAccessConfig *cfg = self->cfg->securityAccess;
+    Iso14229SecurityAccess *sec = &self->security;
+
+    if (NULL == cfg) {
+        return;
+    }
+
+    if (sec->verifyPending && !self->tport_send.pending) {
+        const Iso14229ServiceRequest req = {.sid = kSID_SECURITY_ACCESS};
+        enum Iso14229ResponseCodeEnum result = cfg->userVerifyKeyPoll();
+        if (kRequestCorrectlyReceived_ResponsePending != result) {
+            iso14229SecurityKeyVerified(self, &req, result);
+        } else if (Iso14229TimeAfter(iso14229UserGetms(), sec->responsePendingTimer)) {
+            // Keep the client waiting for up to another P2*
+            iso14229SendNegativeResponse(self, &req, kRequestCorrectlyReceived_ResponsePending);
+            sec->responsePendingTimer = iso14229UserGetms() + self->cfg->p2_star_ms / 2;
+        }
+    }
+
+    if (sec->delayActive && Iso14229TimeAfter(iso14229UserGetms(), sec->delayTimer)) {
+        sec->delayActive = false;
+        // Allow one more attempt before the delay applies again
+        iso14229SecuritySetFailedAttempts(self, iso14229SecurityMaxAttempts(cfg) - 1);
+    }
+
+    if (sec->seedRetryActive && Iso14229TimeAfter(iso14229UserGetms(), sec->seedRetryTimer)) {
+        sec->seedRetryActive = false;
+    }
+
+    // Refill one seed per call to bound the time spent here
+    if (!sec->seedRetryActive && sec->seedPoolCount < ISO14229_SECURITY_SEED_POOL_SIZE) {
+        if (0 == cfg->userGenerateSeed(sec->seedPool[sec->seedPoolCount], cfg->seedLength)) {
+            sec->seedPoolCount++;
+        } else {
+            sec->seedRetryActive = true;
+            sec->seedRetryTimer = iso14229UserGetms() + ISO14229_SECURITY_SEED_RETRY_MS;
+        }
+    }
+}
+
+/**
+ * @brief 0x27 SecurityAccess
+ *
+ * @param self
+ * @param data
+ * @param size
+ */
+void iso14229SecurityAccess(Iso14229Instance *self, const Iso14229ServiceRequest *req) {
+    SecurityAccessResponse *response = GET_RESPONSE_VIEW(self, securityAccess);
+    const Iso14229SecurityAccessConfig *cfg = self->cfg->securityAccess;
+    Iso14229SecurityAccess *sec = &self->security;
+
+    if (NULL == cfg) {
+        return iso14229SendNegativeResponse(self, req, kServiceNotSupported);
+    }
+
+    const uint8_t securityAccessType = req->buf[0] & 0x7F;
+    const bool isRequestSeed = securityAccessType & 1;
+    const uint8_t level = (securityAccessType + 1) / 2;
+
+    if (0 == level || level > 31 || !(cfg->supportedLevels & (1UL << level))) {
+        return iso14229SendNegativeResponse(self, req, kSubFunctionNotSupported);
+    }
+
+    if (sec->delayActive) {
+        return iso14229SendNegativeResponse(self, req, kRequiredTimeDelayNotExpired);
+    }
+
+    if (isRequestSeed) {
+        if (req->size != 1) {
+            return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+        }
+        response->securityAccessType = securityAccessType;
+
+        // ISO14229-1:2013 9.4.1: an already unlocked level gets an all-zero seed
+        if (sec->level == level) {
+            memset(response->securitySeed, 0, cfg->seedLength);
+            return iso14229SendResponse(self, req,
+                                        sizeof(SecurityAccessResponse) + cfg->seedLength);
+        }
+
+        if (sec->seedPoolCount > 0) {
+            sec->seedPoolCount--;
+            memcpy(sec->seed, sec->seedPool[sec->seedPoolCount], cfg->seedLength);
+        } else if (0 != cfg->userGenerateSeed(sec->seed, cfg->seedLength)) {
+            return iso14229SendNegativeResponse(self, req, kConditionsNotCorrect);
+        }
+        sec->seedLevel = level;
+        memcpy(response->securitySeed, sec->seed, cfg->seedLength);
+        return iso14229SendResponse(self, req, sizeof(SecurityAccessResponse) + cfg->seedLength);
+    }
+
+    // sendKey
+    if (req->size < 2 || req->size - 1 > ISO14229_SECURITY_MAX_KEY_LEN) {
+        return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+    }
+    if (sec->seedLevel != level) {
+        return iso14229SendNegativeResponse(self, req, kRequestSequenceError);
+    }
+
+    // The request buffer may be reused before an asynchronous verification ends
+    sec->keyLen = req->size - 1;
+    memcpy(sec->key, req->buf + 1, sec->keyLen);
+
+    enum Iso14229ResponseCodeEnum result =
+        cfg->userVerifyKeyStart(level, sec->seed, cfg->seedLength, sec->key, sec->keyLen);
+
+    if (kRequestCorrectlyReceived_ResponsePending == result) {
+        if (NULL == cfg->userVerifyKeyPoll) {
+            sec->seedLevel = 0;
+            return iso14229SendNegativeResponse(self, req, kGeneralReject);
+        }
+        sec->verifyPending = true;
+        sec->responsePendingTimer = iso14229UserGetms() + self->cfg->p2_star_ms / 2;
+        return iso14229SendNegativeResponse(self, req, kRequestCorrectlyReceived_ResponsePending);
+    }
+
+    iso14229SecurityKeyVerified(self, req, result);
+}
+
+/**
+ * @brief Applies a CommunicationControl controlType to the message types
+ * selected by `messageType`
+ */
+static void iso14229SetCommunication(Iso14229Instance *self, const uint8_t controlType,
+                                     const uint8_t messageType) {
+    for (uint8_t i = 0; i < 2; i++) {
+        if (messageType & (1 << i)) {
+            self->communication[i].rxDisabled =
+                (kDisableRxAndEnableTx == controlType || kDisableRxAndTx == controlType);
+            self->communication[i].txDisabled =
+                (kEnableRxAndDisableTx == controlType || kDisableRxAndTx == controlType);
+        }
+    }
+}
+
+/**
+ * @brief 0x28 CommunicationControl
+ *
+ * @param self
+ * @param data
+ * @param size
+ */
+void iso14229CommunicationControl(Iso14229Instance *self, const Iso14229ServiceRequest *req) {
+    CommunicationControlResponse *response = GET_RESPONSE_VIEW(self, communicationControl);
+    const Iso14229ServerConfig *cfg = self->cfg;
+    uint16_t nodeIdentificationNumber = 0;
+
+    const uint8_t controlType = req->buf[0] & 0x7F;
+    switch (controlType) {
+    case kEnableRxAndTx:
+    case kEnableRxAndDisableTx:
+    case kDisableRxAndEnableTx:
+    case kDisableRxAndTx:
+        if (req->size != 2) {
+            return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+        }
+        break;
+    case kEnableRxAndDisableTxWithEnhancedAddressInformation:
+    case kEnableRxAndTxWithEnhancedAddressInformation:
+        // the node is addressed through a gateway, only the user can act on it
+        if (NULL == cfg->userCommunicationControl) {
+            return iso14229SendNegativeResponse(self, req, kSubFunctionNotSupported);
+        }
+        if (req->size != 4) {
+            return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+        }
+        nodeIdentificationNumber = iso14229LoadBE16(req->buf + 2);
+        break;
+    default:
+        return iso14229SendNegativeResponse(self, req, kSubFunctionNotSupported);
+    }
+
+    const uint8_t communicationType = req->buf[1];
+    const uint8_t messageType = communicationType & 0x03;
+    const uint8_t subnet = communicationType >> 4;
+    // bits 3-2 are reserved
+    if (0 == messageType || (communicationType & 0x0C)) {
+        return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+    }
+    const bool thisNetwork =
+        (ISO14229_COMM_SUBNET_ALL == subnet || ISO14229_COMM_SUBNET_RECEIVING == subnet);
+    if (!thisNetwork && NULL == cfg->userCommunicationControl) {
+        return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+    }
+
+    if (cfg->userCommunicationControl) {
+        enum Iso14229ResponseCodeEnum err =
+            cfg->userCommunicationControl(controlType, communicationType, nodeIdentificationNumber);
+        if (kPositiveResponse != err) {
+            return iso14229SendNegativeResponse(self, req, err);
+        }
+    }
+
+    if (thisNetwork && controlType <= kDisableRxAndTx) {
+        iso14229SetCommunication(self, controlType, messageType);
+    }
+
+    response->controlType = controlType;
+    iso14229SendResponse(self, req, sizeof(CommunicationControlResponse));
+}
+
+// ISO14229-1:2013 Table C.1: periodicDataIdentifier is the low byte of 0xF2xx
+#define PERIODIC_DID_BASE 0xF200
+
+// ISO14229-2: a periodic message fits in a single CAN frame, the first byte
+// being the periodicDataIdentifier
+#define PERIODIC_FRAME_DATA_LEN 7
+
+static uint32_t iso14229PeriodicRate_ms(const Iso14229Instance *self, const uint8_t mode) {
+    const Iso14229ServerConfig *cfg = self->cfg;
+    switch (mode) {
+    case kSendAtSlowRate:
+        return cfg->periodic_slow_ms ? cfg->periodic_slow_ms : ISO14229_PERIODIC_SLOW_MS;
+    case kSendAtMediumRate:
+        return cfg->periodic_medium_ms ? cfg->periodic_medium_ms : ISO14229_PERIODIC_MEDIUM_MS;
+    case kSendAtFastRate:
+    default:
+        return cfg->periodic_fast_ms ? cfg->periodic_fast_ms : ISO14229_PERIODIC_FAST_MS;
+    }
+}
+
+static void iso14229PeriodicStopAll(Iso14229Instance *self) {
+    Iso14229PeriodicScheduler *sched = &self->periodic;
+    memset(sched->slots, ISO14229_PERIODIC_NIL, sizeof(sched->slots));
+    for (uint8_t i = 0; i < ISO14229_MAX_PERIODIC_DIDS; i++) {
+        sched->entries[i].transmissionMode = 0;
+    }
+    sched->nScheduled = 0;
+}
+
+static uint8_t iso14229PeriodicFind(const Iso14229PeriodicScheduler *sched,
+                                    const uint8_t periodicDataId) {
+    for (uint8_t i = 0; i < ISO14229_MAX_PERIODIC_DIDS; i++) {
+        if (sched->entries[i].transmissionMode &&
+            sched->entries[i].periodicDataId == periodicDataId) {
+            return i;
+        }
+    }
+    return ISO14229_PERIODIC_NIL;
+}
+
+/**
+ * @brief Inserts entry `idx` into the wheel so that it is due `delay_ms` from
+ * the current tick
+ */
+static void iso14229PeriodicSchedule(Iso14229PeriodicScheduler *sched, const uint8_t idx,
+                                     const uint32_t delay_ms) {
+    uint32_t ticks = (delay_ms + ISO14229_PERIODIC_TICK_MS - 1) / ISO14229_PERIODIC_TICK_MS;
+    if (0 == ticks) {
+        ticks = 1;
+    }
+    const uint8_t slot = (sched->cursor + ticks) % ISO14229_PERIODIC_WHEEL_SLOTS;
+    sched->entries[idx].rounds = (ticks - 1) / ISO14229_PERIODIC_WHEEL_SLOTS;
+    sched->entries[idx].next = sched->slots[slot];
+    sched->slots[slot] = idx;
+}
+
+static void iso14229PeriodicUnschedule(Iso14229PeriodicScheduler *sched, const uint8_t idx) {
+    for (uint8_t slot = 0; slot < ISO14229_PERIODIC_WHEEL_SLOTS; slot++) {
+        for (uint8_t *link = &sched->slots[slot]; *link != ISO14229_PERIODIC_NIL;
+             link = &sched->entries[*link].next) {
+            if (*link == idx) {
+                *link = sched->entries[idx].next;
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Sends one periodic message
+ * @return 0 on success, -1 if the data identifier could no longer be read
+ */
+static int iso14229PeriodicSend(Iso14229Instance *self, const Iso14229PeriodicDID *entry) {
+    uint8_t frame[1 + PERIODIC_FRAME_DATA_LEN];
+    uint16_t len = 0;
+
+    frame[0] = entry->periodicDataId;
+    if (kPositiveResponse != iso14229ReadDID(self, PERIODIC_DID_BASE | entry->periodicDataId,
+                                             frame + 1, PERIODIC_FRAME_DATA_LEN, &len)) {
+        return -1;
+    }
+    iso14229UserSendCAN(self->cfg->periodic_send_id, frame, 1 + len);
+    return 0;
+}
+
+/**
+ * @brief Advances the wheel by one slot and sends everything that is due
+ */
+static void iso14229PeriodicTick(Iso14229Instance *self) {
+    Iso14229PeriodicScheduler *sched = &self->periodic;
+    uint8_t due = ISO14229_PERIODIC_NIL;
+
+    sched->cursor = (sched->cursor + 1) % ISO14229_PERIODIC_WHEEL_SLOTS;
+
+    uint8_t *link = &sched->slots[sched->cursor];
+    while (*link != ISO14229_PERIODIC_NIL) {
+        Iso14229PeriodicDID *entry = &sched->entries[*link];
+        if (entry->rounds > 0) {
+            entry->rounds--;
+            link = &entry->next;
+        } else {
+            uint8_t idx = *link;
+            *link = entry->next;
+            entry->next = due;
+            due = idx;
+        }
+    }
+
+    // Rescheduling may insert into the current slot, so it happens after the walk
+    while (due != ISO14229_PERIODIC_NIL) {
+        uint8_t idx = due;
+        Iso14229PeriodicDID *entry = &sched->entries[idx];
+        due = entry->next;
+        if (0 == iso14229PeriodicSend(self, entry)) {
+            iso14229PeriodicSchedule(sched, idx,
+                                     iso14229PeriodicRate_ms(self, entry->transmissionMode));
+        } else {
+            // e.g. a dynamically defined DID that has since been cleared
+            entry->transmissionMode = 0;
+            sched->nScheduled--;
+        }
+    }
+}
+
+/**
+ * @brief Advances the wheel by one tick per call while ticks are due
+ * @return true when the wheel has caught up
+ */
+static bool iso14229PeriodicPoll(Iso14229Instance *self) {
+    Iso14229PeriodicScheduler *sched = &self->periodic;
+    const uint32_t now = iso14229UserGetms();
+
+    if (0 == sched->nScheduled || Iso14229TimeAfter(sched->nextTick, now)) {
+        return true;
+    }
+
+    // Catch up on missed ticks, but by no more than one revolution of the wheel
+    if (now - sched->nextTick >= ISO14229_PERIODIC_WHEEL_SLOTS * ISO14229_PERIODIC_TICK_MS) {
+        sched->nextTick = now - (ISO14229_PERIODIC_WHEEL_SLOTS - 1) * ISO14229_PERIODIC_TICK_MS;
+    }
+    iso14229PeriodicTick(self);
+    sched->nextTick += ISO14229_PERIODIC_TICK_MS;
+    return Iso14229TimeAfter(sched->nextTick, now);
+}
+
+/**
+ * @brief 0x2A ReadDataByPeriodicIdentifier
  *
  * @param self
  * @param data
  * @param size
  */
-void iso14229DiagnosticSessionControl(Iso14229Instance *self, const Iso14229ServiceRequest *req) {
-    DiagnosticSessionControlResponse *response = GET_RESPONSE_VIEW(self, diagnosticSessionControl);
+void iso14229ReadDataByPeriodicIdentifier(Iso14229Instance *self,
+                                          const Iso14229ServiceRequest *req) {
+    Iso14229PeriodicScheduler *sched = &self->periodic;
+    uint8_t scratch[PERIODIC_FRAME_DATA_LEN];
+    uint16_t len = 0;
+    enum Iso14229ResponseCodeEnum err;
 
-    uint8_t diagSessionType = 0;
-    if (req->size < 1) {
-        iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
-        return;
-    }
+    const uint8_t transmissionMode = req->buf[0];
+    const uint8_t *periodicDataIds = req->buf + 1;
+    const uint16_t nPeriodicDataIds = req->size - 1;
 
-    diagSessionType = req->buf[0] & 0x4F;
+    // The schedule is cleared when the default session is entered, so it
+    // cannot be started in it
+    if (kDiagModeDefault == self->diag_mode) {
+        return iso14229SendNegativeResponse(self, req, kServiceNotSupportedInActiveSession);
+    }
 
-    // TODO: add user-defined diag modes
-    switch (diagSessionType) {
-    case kDiagModeDefault:
-    case kDiagModeProgramming:
-    case kDiagModeExtendedDiagnostic:
+    switch (transmissionMode) {
+    case kStopSending:
+        if (0 == nPeriodicDataIds) {
+            iso14229PeriodicStopAll(self);
+            break;
+        }
+        for (uint16_t i = 0; i < nPeriodicDataIds; i++) {
+            uint8_t idx = iso14229PeriodicFind(sched, periodicDataIds[i]);
+            if (ISO14229_PERIODIC_NIL != idx) {
+                iso14229PeriodicUnschedule(sched, idx);
+                sched->entries[idx].transmissionMode = 0;
+                sched->nScheduled--;
+            }
+        }
         break;
-    default:
-        iso14229SendNegativeResponse(self, req, kServiceNotSupported);
-        return;
-    }
+    case kSendAtSlowRate:
+    case kSendAtMediumRate:
+    case kSendAtFastRate: {
+        uint16_t nNew = 0;
+        if (0 == nPeriodicDataIds) {
+            return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+        }
 
-    self->diag_mode = diagSessionType;
+        // Validate the whole request before scheduling anything
+        for (uint16_t i = 0; i < nPeriodicDataIds; i++) {
+            err = iso14229CheckAccess(self, kSID_READ_DATA_BY_IDENTIFIER,
+                                      kAccessRuleDataIdentifier,
+                                      PERIODIC_DID_BASE | periodicDataIds[i]);
+            if (kPositiveResponse != err) {
+                return iso14229SendNegativeResponse(self, req, err);
+            }
+            err = iso14229ReadDID(self, PERIODIC_DID_BASE | periodicDataIds[i], scratch,
+                                  sizeof(scratch), &len);
+            if (kResponseTooLong == err) {
+                err = kRequestOutOfRange;
+            }
+            if (kPositiveResponse != err) {
+                return iso14229SendNegativeResponse(self, req, err);
+            }
+            if (ISO14229_PERIODIC_NIL == iso14229PeriodicFind(sched, periodicDataIds[i]) &&
+                NULL == memchr(periodicDataIds, periodicDataIds[i], i)) { // counted once
+                nNew++;
+            }
+        }
+        if (sched->nScheduled + nNew > ISO14229_MAX_PERIODIC_DIDS) {
+            return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+        }
 
-    if (suppressPosRspMsgIndicationBitIsSet(req->buf[0])) {
-        return;
+        if (0 == sched->nScheduled) {
+            sched->nextTick = iso14229UserGetms() + ISO14229_PERIODIC_TICK_MS;
+        }
+
+        for (uint16_t i = 0; i < nPeriodicDataIds; i++) {
+            uint8_t idx = iso14229PeriodicFind(sched, periodicDataIds[i]);
+            if (ISO14229_PERIODIC_NIL != idx) {
+                iso14229PeriodicUnschedule(sched, idx);
+            } else {
+                for (idx = 0; sched->entries[idx].transmissionMode; idx++)
+                    ;
+                sched->entries[idx].periodicDataId = periodicDataIds[i];
+                sched->nScheduled++;
+            }
+            sched->entries[idx].transmissionMode = transmissionMode;
+            // The first message goes out on the next tick
+            iso14229PeriodicSchedule(sched, idx, 0);
+        }
+        break;
+    }
+    default:
+        return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
     }
 
-    response->diagSessionType = diagSessionType;
+    iso14229SendResponse(self, req, sizeof(ReadDataByPeriodicIdentifierResponse));
+}
 
-    // ISO14229-1-2013: Table 29
-    // resolution: 1ms
-    response->P2 = Iso14229htons(self->cfg->p2_ms);
-    // resolution: 10ms
-    response->P2star = Iso14229htons(self->cfg->p2_star_ms / 10);
+// ISO14229-1:2013 Table C.1: dynamically defined data identifiers
+#define DYNAMIC_DID_FIRST 0xF200
+#define DYNAMIC_DID_LAST 0xF3FF
 
-    iso14229SendResponse(self, req, sizeof(DiagnosticSessionControlResponse));
+static inline bool isDynamicallyDefinableDID(const uint16_t dataId) {
+    return dataId >= DYNAMIC_DID_FIRST && dataId <= DYNAMIC_DID_LAST;
 }
 
 /**
- * @brief 0x11 ECUReset
+ * @brief Resolves `len` bytes of an already defined dynamic DID starting at
+ * `position` into gather list entries so that definitions never chain.
  *
- * @param self
- * @param data
- * @param size
+ * @return number of entries written to out, or -1 if out is too small or the
+ * range is outside of the source data record
  */
-void iso14229ECUReset(Iso14229Instance *self, const Iso14229ServiceRequest *req) {
-    ECUResetResponse *response = GET_RESPONSE_VIEW(self, ecuReset);
-    uint8_t resetType = 0;
-    if (req->size < 1) {
-        iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
-        return;
+static int iso14229FlattenDynamicDID(const Iso14229Instance *self, const Iso14229DynamicDID *src,
+                                     uint16_t position, uint16_t len, Iso14229DynamicDIDEntry *out,
+                                     const int outSize) {
+    int n = 0;
+    if (position + len > src->size) {
+        return -1;
+    }
+    for (uint16_t i = 0; i < src->nEntries && len > 0; i++) {
+        const Iso14229DynamicDIDEntry *e = &self->dynamicDIDs.arena[src->firstEntry + i];
+        if (position >= e->len) {
+            position -= e->len;
+            continue;
+        }
+        if (n >= outSize) {
+            return -1;
+        }
+        out[n].src = e->src + position;
+        out[n].len = MIN(len, e->len - position);
+        len -= out[n].len;
+        position = 0;
+        n++;
     }
+    return n;
+}
 
-    resetType = req->buf[0] & 0x3F;
+// A dynamically defined data record must fit in a single RDBI response
+#define DYNAMIC_DID_MAX_SIZE                                                                       \
+    (ISO14229_TPORT_SEND_BUFSIZE - offsetof(Iso14229PositiveResponse, type) - sizeof(uint16_t))
 
-    if (kHardReset == resetType) {
-        if (self->ecu_reset_requested) {
-            ;
-        } else {
-            self->ecu_reset_100ms_timer = iso14229UserGetms() + 100;
+/**
+ * @brief Appends gather list entries to `dataId`, defining it if necessary.
+ * The arena is kept contiguous per DID so reads remain a single pass.
+ */
+static enum Iso14229ResponseCodeEnum
+iso14229AppendDynamicDID(Iso14229Instance *self, const uint16_t dataId,
+                         const Iso14229DynamicDIDEntry *entries, const uint16_t nEntries) {
+    Iso14229DynamicDIDTable *table = &self->dynamicDIDs;
+    Iso14229DynamicDID *did = iso14229FindDynamicDID(self, dataId);
+    uint32_t addedSize = 0;
+
+    for (uint16_t i = 0; i < nEntries; i++) {
+        addedSize += entries[i].len;
+        if (addedSize > DYNAMIC_DID_MAX_SIZE) {
+            return kRequestOutOfRange;
         }
-        self->ecu_reset_requested = true;
     }
 
-    response->resetType = resetType;
-    response->powerDownTime = 0;
+    if (table->nEntries + nEntries > ISO14229_DYNAMIC_DID_ARENA_SIZE) {
+        return kRequestOutOfRange;
+    }
 
-    iso14229SendResponse(self, req, sizeof(ECUResetResponse));
+    if (NULL == did) {
+        if (table->nDIDs >= ISO14229_MAX_DYNAMIC_DIDS) {
+            return kRequestOutOfRange;
+        }
+        did = &table->dids[table->nDIDs++];
+        did->dataId = dataId;
+        did->firstEntry = table->nEntries;
+        did->nEntries = 0;
+        did->size = 0;
+    }
+
+    if ((uint32_t)did->size + addedSize > DYNAMIC_DID_MAX_SIZE) {
+        return kRequestOutOfRange;
+    }
+
+    // Make room at the end of this DID's gather list
+    const uint16_t insertAt = did->firstEntry + did->nEntries;
+    memmove(&table->arena[insertAt + nEntries], &table->arena[insertAt],
+            (table->nEntries - insertAt) * sizeof(Iso14229DynamicDIDEntry));
+    for (uint8_t i = 0; i < table->nDIDs; i++) {
+        if (&table->dids[i] != did && table->dids[i].firstEntry >= insertAt) {
+            table->dids[i].firstEntry += nEntries;
+        }
+    }
+
+    memcpy(&table->arena[insertAt], entries, nEntries * sizeof(Iso14229DynamicDIDEntry));
+    table->nEntries += nEntries;
+    did->nEntries += nEntries;
+    did->size += addedSize;
+    return kPositiveResponse;
 }
 
-typedef struct {
-    uint16_t dataIdentifier;
-} ReadDataByIdentifierRequest;
+static void iso14229RemoveDynamicDID(Iso14229Instance *self, Iso14229DynamicDID *did) {
+    Iso14229DynamicDIDTable *table = &self->dynamicDIDs;
+    const uint16_t first = did->firstEntry;
+    const uint16_t n = did->nEntries;
+
+    memmove(&table->arena[first], &table->arena[first + n],
+            (table->nEntries - first - n) * sizeof(Iso14229DynamicDIDEntry));
+    table->nEntries -= n;
+
+    *did = table->dids[--table->nDIDs];
+    for (uint8_t i = 0; i < table->nDIDs; i++) {
+        if (table->dids[i].firstEntry > first) {
+            table->dids[i].firstEntry -= n;
+        }
+    }
+}
 
 /**
- * @brief 0x22 ReadDataByIdentifier
+ * @brief 0x2C DynamicallyDefineDataIdentifier
  *
  * @param self
  * @param data
  * @param size
  */
-void iso14229ReadDataByIdentifier(Iso14229Instance *self, const Iso14229ServiceRequest *req) {
-    ReadDataByIdentifierResponse *response = GET_RESPONSE_VIEW(self, readDataByIdentifier);
-    uint8_t numDIDs = req->size / sizeof(ReadDataByIdentifierRequest);
-    uint8_t *data_location = NULL;
-    uint16_t dataRecordSize = 0;
-    uint16_t responseLength = 0;
+void iso14229DynamicallyDefineDataIdentifier(Iso14229Instance *self,
+                                             const Iso14229ServiceRequest *req) {
+    DynamicallyDefineDataIdentifierResponse *response =
+        GET_RESPONSE_VIEW(self, dynamicallyDefineDataIdentifier);
+    Iso14229DynamicDIDEntry entries[ISO14229_DYNAMIC_DID_ARENA_SIZE];
+    uint16_t nEntries = 0;
+    enum Iso14229ResponseCodeEnum err = kPositiveResponse;
     uint16_t dataId = 0;
-    enum Iso14229ResponseCodeEnum rdbi_response;
 
-    if (NULL == self->cfg->userRDBIHandler) {
-        return iso14229SendNegativeResponse(self, req, kServiceNotSupported);
-    }
+    const uint8_t definitionType = req->buf[0] & 0x7F;
+    response->definitionType = definitionType;
 
-    if (req->size % sizeof(ReadDataByIdentifierRequest) != 0) {
-        return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+    if (kClearDynamicallyDefinedDataIdentifier == definitionType) {
+        if (1 == req->size) {
+            iso14229ClearDynamicDIDs(self);
+            iso14229UserInvalidateCache(self);
+            return iso14229SendResponse(self, req, sizeof(response->definitionType));
+        } else if (3 != req->size) {
+            return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+        }
+        dataId = iso14229LoadBE16(req->buf + 1);
+        if (!isDynamicallyDefinableDID(dataId)) {
+            return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+        }
+        Iso14229DynamicDID *did = iso14229FindDynamicDID(self, dataId);
+        if (NULL != did) {
+            iso14229RemoveDynamicDID(self, did);
+        }
+        iso14229UserInvalidateCachedDID(self, dataId);
+        response->dynamicallyDefinedDataIdentifier = Iso14229htons(dataId);
+        return iso14229SendResponse(self, req, sizeof(DynamicallyDefineDataIdentifierResponse));
     }
 
-    if (0 == numDIDs) {
+    if (req->size < 3) {
         return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
     }
+    dataId = iso14229LoadBE16(req->buf + 1);
+
+    switch (definitionType) {
+    case kDefineByIdentifier: {
+        // sourceDataIdentifier (2), positionInSourceDataRecord (1), memorySize (1)
+        const uint8_t recordLen = 4;
+        if (req->size < 3 + recordLen || (req->size - 3) % recordLen != 0) {
+            return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+        }
+        if (!isDynamicallyDefinableDID(dataId)) {
+            return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+        }
+        for (const uint8_t *rec = req->buf + 3; rec < req->buf + req->size; rec += recordLen) {
+            const uint16_t sourceId = iso14229LoadBE16(rec);
+            const uint8_t position = rec[2];
+            const uint8_t memorySize = rec[3];
+            if (0 == position || 0 == memorySize) {
+                return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+            }
 
-    for (int i = 0; i < numDIDs; i++) {
-        // TODO: make this safe
-        dataId = Iso14229ntohs(*((uint16_t *)req->buf + i));
-
-        rdbi_response = self->cfg->userRDBIHandler(dataId, &data_location, &dataRecordSize);
-        if (kPositiveResponse == rdbi_response) {
-            // TODO: make this safe: ensure that the offset doesn't exceed the
-            // response buffer
-            uint8_t *offset = ((uint8_t *)response) + responseLength;
+            // The source must be readable by 0x22 in this session
+            err = iso14229CheckAccess(self, kSID_READ_DATA_BY_IDENTIFIER,
+                                      kAccessRuleDataIdentifier, sourceId);
+            if (kPositiveResponse != err) {
+                return iso14229SendNegativeResponse(self, req, err);
+            }
 
-            *(uint16_t *)(offset) = Iso14229htons(dataId);
-            memcpy(offset + sizeof(uint16_t), data_location, dataRecordSize);
+            const Iso14229DynamicDID *source = iso14229FindDynamicDID(self, sourceId);
+            if (NULL != source) {
+                int n = iso14229FlattenDynamicDID(self, source, position - 1, memorySize,
+                                                  &entries[nEntries], ARRAY_SZ(entries) - nEntries);
+                if (n < 0) {
+                    return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+                }
+                nEntries += n;
+                continue;
+            }
 
-            responseLength += sizeof(uint16_t) + dataRecordSize;
-        } else {
-            iso14229SendNegativeResponse(self, req, rdbi_response);
-            return;
+            if (nEntries >= ARRAY_SZ(entries)) {
+                return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+            }
+            uint8_t *data_location = NULL;
+            uint16_t dataRecordSize = 0;
+            // Resolved as iso14229ReadDID does, so a written value is read from the shadow
+            const Iso14229WriteBackDID *wb = iso14229FindWriteBackDID(self, sourceId);
+            if (NULL != wb) {
+                data_location = wb->shadow;
+                dataRecordSize = wb->size;
+            } else if (NULL == self->cfg->userRDBIHandler) {
+                return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+            } else {
+                err = self->cfg->userRDBIHandler(sourceId, &data_location, &dataRecordSize);
+                if (kPositiveResponse != err) {
+                    return iso14229SendNegativeResponse(self, req, err);
+                }
+            }
+            if (position - 1 + memorySize > dataRecordSize) {
+                return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+            }
+            entries[nEntries].src = data_location + position - 1;
+            entries[nEntries].len = memorySize;
+            nEntries++;
+        }
+        break;
+    }
+    case kDefineByMemoryAddress: {
+        if (req->size < 4) {
+            return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
         }
+        uint8_t memoryAddressLength, memorySizeLength;
+        if (!iso14229DecodeAddressAndLengthFormat(req->buf[3], &memoryAddressLength,
+                                                  &memorySizeLength)) {
+            return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+        }
+        const uint8_t recordLen = memorySizeLength + memoryAddressLength;
+        if (req->size < 4 + recordLen || (req->size - 4) % recordLen != 0) {
+            return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+        }
+        if (!isDynamicallyDefinableDID(dataId) || NULL == self->cfg->userMemoryReadCheck) {
+            return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+        }
+        for (const uint8_t *rec = req->buf + 4; rec < req->buf + req->size; rec += recordLen) {
+            const uint64_t address = iso14229DecodeBigEndian(rec, memoryAddressLength);
+            const uint64_t memorySize =
+                iso14229DecodeBigEndian(rec + memoryAddressLength, memorySizeLength);
+            // The gather list reads this memory directly
+            if (address > UINTPTR_MAX || 0 == memorySize || memorySize > DYNAMIC_DID_MAX_SIZE ||
+                nEntries >= ARRAY_SZ(entries)) {
+                return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+            }
+            const uint8_t *memoryAddress = (const uint8_t *)(uintptr_t)address;
+            err = self->cfg->userMemoryReadCheck(memoryAddress, memorySize);
+            if (kPositiveResponse != err) {
+                return iso14229SendNegativeResponse(self, req, err);
+            }
+            entries[nEntries].src = memoryAddress;
+            entries[nEntries].len = memorySize;
+            nEntries++;
+        }
+        break;
+    }
+    default:
+        return iso14229SendNegativeResponse(self, req, kSubFunctionNotSupported);
     }
 
-    iso14229SendResponse(self, req, sizeof(ReadDataByIdentifierResponse) + responseLength);
-}
+    err = iso14229AppendDynamicDID(self, dataId, entries, nEntries);
+    if (kPositiveResponse != err) {
+        return iso14229SendNegativeResponse(self, req, err);
+    }
+    iso14229UserInvalidateCachedDID(self, dataId);
 
-typedef struct {
-    uint8_t controlType;
-    uint8_t communicationType;
-    uint16_t nodeIdentificationNumber;
-} CommunicationControlRequest;
+    response->dynamicallyDefinedDataIdentifier = Iso14229htons(dataId);
+    iso14229SendResponse(self, req, sizeof(DynamicallyDefineDataIdentifierResponse));
+}
 
 /**
- * @brief 0x28 CommunicationControl
+ * @brief 0x2E WriteDataByIdentifier
  *
  * @param self
  * @param data
  * @param size
  */
-void iso14229CommunicationControl(Iso14229Instance *self, const Iso14229ServiceRequest *req) {
-    CommunicationControlResponse *response = GET_RESPONSE_VIEW(self, communicationControl);
-    CommunicationControlRequest *request = (CommunicationControlRequest *)req->buf;
+void iso14229WriteDataByIdentifier(Iso14229Instance *self, const Iso14229ServiceRequest *req) {
+    WriteDataByIdentifierResponse *response = GET_RESPONSE_VIEW(self, writeDataByIdentifier);
+    const uint8_t *dataRecord = req->buf + sizeof(uint16_t);
+    enum Iso14229ResponseCodeEnum wdbi_response;
+
+    // The dataRecord holds at least one byte, see iso14229MinRequestLength
+    const uint16_t dataId = iso14229LoadBE16(req->buf);
+    const uint16_t dataLen = req->size - sizeof(uint16_t);
+
+    response->dataId = Iso14229htons(dataId);
 
-    if (req->size < sizeof(CommunicationControlRequest)) {
-        iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+    wdbi_response = iso14229CheckAccess(self, req->sid, kAccessRuleDataIdentifier, dataId);
+    if (kPositiveResponse != wdbi_response) {
+        iso14229SendNegativeResponse(self, req, wdbi_response);
         return;
     }
-    if (request->communicationType > kDisableRxAndTx) {
-        iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+
+    const Iso14229WriteBackDID *wb = iso14229FindWriteBackDID(self, dataId);
+    if (NULL != wb) {
+        const Iso14229WriteBackConfig *wbCfg = self->cfg->writeBack;
+        if (dataLen != wb->size) {
+            return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+        }
+        if (NULL != wbCfg->userWriteCheck) {
+            wdbi_response = wbCfg->userWriteCheck(dataId, dataRecord, dataLen);
+            if (kPositiveResponse != wdbi_response) {
+                return iso14229SendNegativeResponse(self, req, wdbi_response);
+            }
+        }
+        memcpy(wb->shadow, dataRecord, dataLen);
+        BITMAP_SET(self->writeBack.dirty, wb - wbCfg->dids);
+        if (!self->writeBack.pending) {
+            self->writeBack.pending = true;
+            self->writeBack.flushTimer = iso14229UserGetms() + wbCfg->nvmWriteDelay_ms;
+        }
+    } else if (NULL != self->cfg->userWDBIHandler) {
+        wdbi_response = self->cfg->userWDBIHandler(dataId, dataRecord, dataLen);
+        if (kPositiveResponse != wdbi_response) {
+            iso14229SendNegativeResponse(self, req, wdbi_response);
+            return;
+        }
+    } else {
+        iso14229SendNegativeResponse(self, req, kServiceNotSupported);
         return;
     }
-    response->controlType = request->communicationType;
-    iso14229SendResponse(self, req, sizeof(CommunicationControlResponse));
+
+    iso14229UserInvalidateCachedDID(self, dataId);
+    iso14229SendResponse(self, req, sizeof(WriteDataByIdentifierResponse));
 }
 
-typedef struct {
-    uint16_t dataIdentifier;
-    uint8_t dataRecord[];
-} WriteDataByIdentifierRequest;
+static const Iso14229IOControl *iso14229FindIOControl(const Iso14229Instance *self,
+                                                      const uint16_t dataId) {
+    uint16_t lo = 0, hi = self->persistent.nRegisteredIOControls;
+    while (lo < hi) {
+        const uint16_t mid = lo + (hi - lo) / 2;
+        const uint16_t midId = self->persistent.ioControls[mid]->dataId;
+        if (midId == dataId) {
+            return self->persistent.ioControls[mid];
+        } else if (midId < dataId) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+static void iso14229IOControlReturnAll(Iso14229Instance *self) {
+    for (uint16_t i = 0; i < self->persistent.nRegisteredIOControls; i++) {
+        *self->persistent.ioControls[i]->active = self->persistent.ioControls[i]->ecuValue;
+    }
+}
 
 /**
- * @brief 0x2E WriteDataByIdentifier
+ * @brief 0x2F InputOutputControlByIdentifier
  *
  * @param self
  * @param data
  * @param size
  */
-void iso14229WriteDataByIdentifier(Iso14229Instance *self, const Iso14229ServiceRequest *req) {
-    WriteDataByIdentifierResponse *response = GET_RESPONSE_VIEW(self, writeDataByIdentifier);
-    WriteDataByIdentifierRequest *request = (WriteDataByIdentifierRequest *)req->buf;
+void iso14229InputOutputControlByIdentifier(Iso14229Instance *self,
+                                            const Iso14229ServiceRequest *req) {
+    InputOutputControlByIdentifierResponse *response =
+        GET_RESPONSE_VIEW(self, inputOutputControlByIdentifier);
+    enum Iso14229ResponseCodeEnum err;
 
-    uint16_t dataLen = 0;
-    uint16_t dataId = 0;
-    enum Iso14229ResponseCodeEnum wdbi_response;
+    // Overrides are returned to the ECU when the default session is entered,
+    // so they cannot be made in it
+    if (kDiagModeDefault == self->diag_mode) {
+        return iso14229SendNegativeResponse(self, req, kServiceNotSupportedInActiveSession);
+    }
 
-    /* Must contain at least one byte */
-    if (req->size < sizeof(uint16_t) + 1) {
-        iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
-        return;
+    // dataIdentifier, inputOutputControlParameter, controlState
+    const uint16_t dataId = iso14229LoadBE16(req->buf);
+    const uint8_t parameter = req->buf[2];
+    const uint8_t *controlState = req->buf + 3;
+    const uint16_t controlStateLen = req->size - 3;
+
+    const Iso14229IOControl *ioc = iso14229FindIOControl(self, dataId);
+    if (NULL == ioc) {
+        return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
     }
 
-    dataId = Iso14229ntohs(request->dataIdentifier);
-    dataLen = req->size - offsetof(WriteDataByIdentifierRequest, dataRecord);
+    err = iso14229CheckAccess(self, req->sid, kAccessRuleDataIdentifier, dataId);
+    if (kPositiveResponse != err) {
+        return iso14229SendNegativeResponse(self, req, err);
+    }
 
-    response->dataId = Iso14229htons(dataId);
+    if (parameter > kShortTermAdjustment ||
+        !(ioc->controlParameters & ISO14229_IO_CONTROL_PARAMETER(parameter))) {
+        return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+    }
 
-    if (NULL != self->cfg->userWDBIHandler) {
-        wdbi_response = self->cfg->userWDBIHandler(dataId, request->dataRecord, dataLen);
-        if (kPositiveResponse != wdbi_response) {
-            iso14229SendNegativeResponse(self, req, wdbi_response);
-            return;
+    // ASSUMPTION: each data identifier is a single signal, so the request
+    // carries no controlEnableMaskRecord
+    if (controlStateLen != (kShortTermAdjustment == parameter ? ioc->size : 0)) {
+        return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+    }
+
+    switch (parameter) {
+    case kReturnControlToECU:
+        *ioc->active = ioc->ecuValue;
+        break;
+    case kResetToDefault:
+        memcpy(ioc->override, ioc->defaultValue, ioc->size);
+        *ioc->active = ioc->override;
+        break;
+    case kFreezeCurrentState:
+        memmove(ioc->override, *ioc->active, ioc->size);
+        *ioc->active = ioc->override;
+        break;
+    case kShortTermAdjustment:
+        if (NULL == ioc->adjustMask) {
+            memcpy(ioc->override, controlState, ioc->size);
+        } else {
+            const uint8_t *current = *ioc->active;
+            for (uint16_t i = 0; i < ioc->size; i++) {
+                ioc->override[i] = (current[i] & ~ioc->adjustMask[i]) |
+                                   (controlState[i] & ioc->adjustMask[i]);
+            }
         }
-    } else {
-        iso14229SendNegativeResponse(self, req, kServiceNotSupported);
-        return;
+        *ioc->active = ioc->override;
+        break;
     }
 
-    iso14229SendResponse(self, req, sizeof(WriteDataByIdentifierResponse));
+    iso14229UserInvalidateCachedDID(self, dataId);
+
+    // controlStatusRecord: the state the signal is now in
+    response->dataId = Iso14229htons(dataId);
+    response->inputOutputControlParameter = parameter;
+    memcpy(response->controlState, *ioc->active, ioc->size);
+    iso14229SendResponse(self, req,
+                         sizeof(InputOutputControlByIdentifierResponse) + ioc->size);
 }
 
 enum RoutineControlTypeEnum {
@@ -276,11 +2086,8 @@ enum RoutineControlTypeEnum {
     kRequestRoutineResults = 3,
 };
 
-typedef struct {
-    uint8_t routineControlType;
-    uint16_t routineIdentifier;
-    uint8_t routineControlOptionRecord[];
-} __attribute__((packed)) RoutineControlRequest;
+// routineControlType, routineIdentifier
+#define ROUTINE_CONTROL_REQUEST_LEN 3
 
 /**
  * @brief 0x31 RoutineControl
@@ -291,24 +2098,19 @@ typedef struct {
  */
 void iso14229RoutineControl(Iso14229Instance *self, const Iso14229ServiceRequest *req) {
     RoutineControlResponse *response = GET_RESPONSE_VIEW(self, routineControl);
-    RoutineControlRequest *request = (RoutineControlRequest *)req->buf;
     enum Iso14229ResponseCodeEnum responseCode = kPositiveResponse;
-    uint16_t routineIdentifier = Iso14229ntohs(request->routineIdentifier);
-
-    if (req->size < sizeof(RoutineControlRequest)) {
-        return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
-    }
+    const uint16_t routineIdentifier = iso14229LoadBE16(req->buf + 1);
 
     const Iso14229Routine *routine = NULL;
-    for (uint16_t i = 0; i < self->nRegisteredRoutines; i++) {
-        if (self->routines[i]->routineIdentifier == routineIdentifier) {
-            routine = self->routines[i];
+    for (uint16_t i = 0; i < self->persistent.nRegisteredRoutines; i++) {
+        if (self->persistent.routines[i]->routineIdentifier == routineIdentifier) {
+            routine = self->persistent.routines[i];
         }
     }
 
-    // The subfunction corresponding to this routineIdentifier
+    // ISO14229-1:2013: an unknown routineIdentifier is out of range
     if (routine == NULL) {
-        iso14229SendNegativeResponse(self, req, kSubFunctionNotSupported);
+        iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
         return;
     }
 
@@ -316,15 +2118,16 @@ void iso14229RoutineControl(Iso14229Instance *self, const Iso14229ServiceRequest
     uint16_t statusRecordLength = 0;
 
     Iso14229RoutineControlArgs args = {
-        .optionRecord = request->routineControlOptionRecord,
-        .optionRecordLength = offsetof(RoutineControlRequest, routineControlOptionRecord),
+        .optionRecord = req->buf + ROUTINE_CONTROL_REQUEST_LEN,
+        .optionRecordLength = req->size - ROUTINE_CONTROL_REQUEST_LEN,
         .statusRecord = response->routineStatusRecord,
         .statusRecordBufferSize =
             ISO14229_TPORT_SEND_BUFSIZE - offsetof(RoutineControlResponse, routineStatusRecord),
         .statusRecordLength = &statusRecordLength,
     };
 
-    switch (request->routineControlType) {
+    const uint8_t routineControlType = req->buf[0] & 0x7F;
+    switch (routineControlType) {
     case kStartRoutine:
         if (NULL != routine->startRoutine) {
             responseCode = routine->startRoutine(routine->userCtx, &args);
@@ -350,7 +2153,7 @@ void iso14229RoutineControl(Iso14229Instance *self, const Iso14229ServiceRequest
         }
         break;
     default:
-        iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+        iso14229SendNegativeResponse(self, req, kSubFunctionNotSupported);
         return;
     }
 
@@ -359,22 +2162,19 @@ void iso14229RoutineControl(Iso14229Instance *self, const Iso14229ServiceRequest
     }
 
     if (kPositiveResponse != responseCode) {
-        iso14229SendNegativeResponse(self, req, responseCode);
+        return iso14229SendNegativeResponse(self, req, responseCode);
     }
 
-    response->routineControlType = request->routineControlType;
+    response->routineControlType = routineControlType;
     response->routineIdentifier = Iso14229htons(routineIdentifier);
     response->routineInfo = 0;
 
     iso14229SendResponse(self, req, sizeof(RoutineControlResponse) + statusRecordLength);
 }
 
-typedef struct {
-    uint8_t dataFormatIdentifier;
-    uint8_t addressAndLengthFormatIdentifier;
-    uint32_t memoryAddress;
-    uint32_t memorySize;
-} __attribute__((packed)) RequestDownloadRequest;
+// dataFormatIdentifier, addressAndLengthFormatIdentifier, then the
+// memoryAddress and memorySize with lengths given by the latter
+#define REQUEST_DOWNLOAD_REQUEST_LEN 2
 
 /**
  * @brief 0x34 RequestDownload
@@ -385,39 +2185,74 @@ typedef struct {
  */
 void iso14229RequestDownload(Iso14229Instance *self, const Iso14229ServiceRequest *const req) {
     RequestDownloadResponse *response = GET_RESPONSE_VIEW(self, requestDownload);
-    RequestDownloadRequest *request = (RequestDownloadRequest *)req->buf;
+    const uint8_t dataFormatIdentifier = req->buf[0];
+    const uint8_t *memoryAddressAndSize = req->buf + REQUEST_DOWNLOAD_REQUEST_LEN;
 
-    const Iso14229DownloadHandler *handler = NULL;
+    Iso14229DownloadHandler *handler = NULL;
     enum Iso14229ResponseCodeEnum err;
     uint16_t maxNumberOfBlockLength = 0;
-    void *memoryAddress = NULL;
-    uint32_t memorySize = 0;
+    uint8_t memoryAddressLength, memorySizeLength;
 
-    if (req->size < sizeof(RequestDownloadRequest)) {
-        return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+    if (!iso14229DecodeAddressAndLengthFormat(req->buf[1], &memoryAddressLength,
+                                              &memorySizeLength)) {
+        return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
     }
 
-    uint8_t memorySizeLength = (request->addressAndLengthFormatIdentifier & 0xF0) >> 4;
-    uint8_t memoryAddressLength = request->addressAndLengthFormatIdentifier & 0x0F;
-
-    // ASSUMPTION: This server implementation only supports 32 bit memory
-    // addressing
-    if (memorySizeLength != sizeof(uint32_t) || memoryAddressLength != sizeof(uint32_t)) {
-        return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+    if (req->size != REQUEST_DOWNLOAD_REQUEST_LEN + memoryAddressLength + memorySizeLength) {
+        return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
     }
 
-    memoryAddress = (void *)((size_t)Iso14229ntohl(request->memoryAddress));
-    memorySize = Iso14229ntohl(request->memorySize);
+    const uint64_t memoryAddress =
+        iso14229DecodeBigEndian(memoryAddressAndSize, memoryAddressLength);
+    const uint64_t memorySize =
+        iso14229DecodeBigEndian(memoryAddressAndSize + memoryAddressLength, memorySizeLength);
 
     // TODO: not yet implemented multiple Upload/Download handlers
     // This will need some documented heuristic for determining the correct
     // handler, probably a map of {memoryAddress: handler}
-    if (self->nRegisteredDownloadHandlers < 1) {
+    if (self->persistent.nRegisteredDownloadHandlers < 1) {
         return iso14229SendNegativeResponse(self, req, kUploadDownloadNotAccepted);
     }
-    handler = self->downloadHandlers[0];
+    handler = self->persistent.downloadHandlers[0];
+
+    // ISO14229-1:2013 Table 394: dataFormatIdentifier high nibble is the
+    // compressionMethod, low nibble the encryptingMethod
+    const Iso14229Decompressor *decompressor = NULL;
+    const uint8_t compressionMethod = dataFormatIdentifier >> 4;
+    if (compressionMethod) {
+        for (uint8_t i = 0; i < handler->cfg->nDecompressors; i++) {
+            if (handler->cfg->decompressors[i].compressionMethod == compressionMethod) {
+                decompressor = &handler->cfg->decompressors[i];
+                break;
+            }
+        }
+        if (NULL == decompressor) {
+            return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+        }
+    }
+
+    const Iso14229Cipher *cipher = NULL;
+    const uint8_t encryptingMethod = dataFormatIdentifier & 0x0F;
+    if (encryptingMethod) {
+        for (uint8_t i = 0; i < handler->cfg->nCiphers; i++) {
+            if (handler->cfg->ciphers[i].encryptingMethod == encryptingMethod) {
+                cipher = &handler->cfg->ciphers[i];
+                break;
+            }
+        }
+        if (NULL == cipher) {
+            return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+        }
+    }
+
+    // Before onRequest, which the application may use to start erasing or
+    // allocating, so that it never has to be undone
+    if ((NULL != decompressor && 0 != decompressor->init(decompressor->ctx)) ||
+        (NULL != cipher && 0 != cipher->init(cipher->ctx))) {
+        return iso14229SendNegativeResponse(self, req, kConditionsNotCorrect);
+    }
 
-    err = handler->cfg->onRequest(handler->cfg->userCtx, request->dataFormatIdentifier,
+    err = handler->cfg->onRequest(handler->cfg->userCtx, dataFormatIdentifier,
                                   memoryAddress, memorySize, &maxNumberOfBlockLength);
 
     if (err != kPositiveResponse) {
@@ -429,6 +2264,13 @@ void iso14229RequestDownload(Iso14229Instance *self, const Iso14229ServiceReques
         return iso14229SendNegativeResponse(self, req, kGeneralProgrammingFailure);
     }
 
+    // A download that was abandoned without 0x37 leaves its counter, last
+    // block and IV behind
+    iso14229DownloadHandlerInit(handler);
+    handler->decompressor = decompressor;
+    handler->cipher = cipher;
+    handler->isActive = true;
+
     // ISO-14229-1:2013 Table 401:
     // ASSUMPTION: use fixed size of maxNumberOfBlockLength in RequestDownload
     // response: 2 bytes
@@ -451,63 +2293,113 @@ data-parameters present in the TransferData request message.
     iso14229SendResponse(self, req, sizeof(RequestDownloadResponse));
 }
 
-typedef struct {
-    uint8_t blockSequenceCounter;
-    uint8_t data[];
-} __attribute__((packed)) TransferDataRequest;
-
-static inline int blockSequenceNumberIsBad(const uint8_t block_counter,
-                                           const Iso14229DownloadHandler *handler) {
-    if (block_counter != handler->blockSequenceCounter) {
-        return 1;
-    }
-    return 0;
+/**
+ * @brief Iso14229TransferSink in front of onTransfer that hashes what the
+ * application is given, i.e. the image after decryption and decompression
+ */
+typedef struct {
+    const Iso14229DownloadHandlerConfig *cfg;
+    uint32_t imageHash;
+} Iso14229ImageSink;
+
+static enum Iso14229ResponseCodeEnum iso14229ImageSinkWrite(void *sinkCtx, const uint8_t *data,
+                                                            uint32_t len) {
+    Iso14229ImageSink *sink = (Iso14229ImageSink *)sinkCtx;
+    sink->imageHash = iso14229FNV1a(sink->imageHash, data, len);
+    // Only writable without a decompressor, see onTransfer
+    return sink->cfg->onTransfer(sink->cfg->userCtx, (uint8_t *)data, len);
 }
 
 /**
  * @brief 0x36 TransferData
  *
+ * ISO14229-1:2013 allows a client that lost the positive response to
+ * repeat the last block. The repeat is recognized by its blockSequenceCounter,
+ * length and hash, and answered positively without writing it again. The
+ * counter wraps from 0xFF to 0x00.
+ *
  * @param self
  * @param data
  * @param size
  */
 void iso14229TransferData(Iso14229Instance *self, const Iso14229ServiceRequest *req) {
     TransferDataResponse *response = GET_RESPONSE_VIEW(self, transferData);
-    TransferDataRequest *request = (TransferDataRequest *)req->buf;
     Iso14229DownloadHandler *handler = NULL;
     enum Iso14229ResponseCodeEnum err;
 
-    uint16_t request_data_len = req->size - offsetof(TransferDataRequest, data);
+    if (self->persistent.nRegisteredDownloadHandlers < 1) {
+        return iso14229SendNegativeResponse(self, req, kUploadDownloadNotAccepted);
+    }
+
+    handler = self->persistent.downloadHandlers[0];
 
-    if (req->size < sizeof(TransferDataRequest)) {
-        err = kIncorrectMessageLengthOrInvalidFormat;
-        goto fail;
+    if (!handler->isActive) {
+        return iso14229SendNegativeResponse(self, req, kRequestSequenceError);
     }
 
-    if (self->nRegisteredDownloadHandlers < 1) {
-        err = kUploadDownloadNotAccepted;
-        goto fail;
+    const uint8_t counter = req->buf[0];
+    // transferRequestParameterRecord
+    uint8_t *data = (uint8_t *)req->buf + 1;
+    const uint16_t request_data_len = req->size - 1;
+    uint16_t data_len = request_data_len;
+    // Hashed before decryption, which works in place
+    const uint32_t hash = iso14229FNV1a(ISO14229_FNV1A_INIT, data, request_data_len);
+
+    if (counter != handler->blockSequenceCounter) {
+        if (handler->hasLastBlock && counter == (uint8_t)(handler->blockSequenceCounter - 1) &&
+            request_data_len == handler->lastBlockLen && hash == handler->lastBlockHash) {
+            response->blockSequenceCounter = counter;
+            return iso14229SendResponse(self, req, sizeof(TransferDataResponse));
+        }
+        // Nothing was written: the client can still send the expected block
+        return iso14229SendNegativeResponse(self, req, kWrongBlockSequenceCounter);
     }
 
-    handler = self->downloadHandlers[0];
+    const Iso14229Cipher *cipher = handler->cipher;
+    // The stream starts with the initialization vector, which is not image data
+    if (NULL != cipher && handler->ivReceived < cipher->ivLength) {
+        const uint16_t n = MIN(data_len, cipher->ivLength - handler->ivReceived);
+        memcpy(handler->iv + handler->ivReceived, data, n);
+        handler->ivReceived += n;
+        data += n;
+        data_len -= n;
+        if (handler->ivReceived == cipher->ivLength &&
+            0 != cipher->setIV(cipher->ctx, handler->iv)) {
+            err = kRequestOutOfRange;
+            goto fail;
+        }
+    }
 
-    if (blockSequenceNumberIsBad(request->blockSequenceCounter, handler)) {
-        err = kRequestSequenceError;
+    // Decrypt in the receive buffer: encrypted data is never copied
+    if (NULL != cipher && 0 != cipher->decrypt(cipher->ctx, data, data_len)) {
+        err = kGeneralProgrammingFailure;
         goto fail;
-    } else {
-        handler->blockSequenceCounter++;
     }
 
-    err = handler->cfg->onTransfer(handler->cfg->userCtx, request->data, request_data_len);
+    Iso14229ImageSink sink = {.cfg = handler->cfg, .imageHash = handler->results.imageHash};
+    if (NULL != handler->decompressor) {
+        err = handler->decompressor->decompress(handler->decompressor->ctx, data, data_len,
+                                                iso14229ImageSinkWrite, &sink);
+    } else {
+        err = iso14229ImageSinkWrite(&sink, data, data_len);
+    }
     if (err != kPositiveResponse) {
         goto fail;
     }
 
-    response->blockSequenceCounter = request->blockSequenceCounter;
+    handler->blockSequenceCounter++;
+    handler->hasLastBlock = true;
+    handler->lastBlockLen = request_data_len;
+    handler->lastBlockHash = hash;
+    handler->results.blocksWritten++;
+    handler->results.imageHash = sink.imageHash;
+
+    response->blockSequenceCounter = counter;
 
     return iso14229SendResponse(self, req, sizeof(TransferDataResponse));
 
-// There's been an error. Reinitialize the handler to clear out its state
+// The block may have been partially written. Reinitialize the handler to
+// clear out its state
 fail:
     iso14229DownloadHandlerInit(handler);
     return iso14229SendNegativeResponse(self, req, err);
@@ -524,10 +2416,23 @@ void iso14229RequestTransferExit(Iso14229Instance *self, const Iso14229ServiceRe
     Iso14229DownloadHandler *handler = NULL;
     enum Iso14229ResponseCodeEnum err;
 
-    if (self->nRegisteredDownloadHandlers < 1) {
+    if (self->persistent.nRegisteredDownloadHandlers < 1) {
         return iso14229SendNegativeResponse(self, req, kUploadDownloadNotAccepted);
     }
-    handler = self->downloadHandlers[0];
+    handler = self->persistent.downloadHandlers[0];
+
+    if (!handler->isActive) {
+        return iso14229SendNegativeResponse(self, req, kRequestSequenceError);
+    }
+
+    // A truncated compressed stream, or one that ended inside the IV, means
+    // the image is incomplete
+    if ((NULL != handler->cipher && handler->ivReceived < handler->cipher->ivLength) ||
+        (NULL != handler->decompressor &&
+         0 != handler->decompressor->finish(handler->decompressor->ctx))) {
+        iso14229DownloadHandlerInit(handler);
+        return iso14229SendNegativeResponse(self, req, kGeneralProgrammingFailure);
+    }
 
     err = handler->cfg->onExit(handler->cfg->userCtx);
 
@@ -540,10 +2445,6 @@ void iso14229RequestTransferExit(Iso14229Instance *self, const Iso14229ServiceRe
     iso14229SendResponse(self, req, sizeof(RequestTransferExitResponse));
 }
 
-typedef struct {
-    uint8_t zeroSubFunction;
-} TesterPresentRequest;
-
 /**
  * @brief 0x3E TesterPresent
  *
@@ -553,18 +2454,495 @@ typedef struct {
  */
 void iso14229TesterPresent(Iso14229Instance *self, const Iso14229ServiceRequest *req) {
     TesterPresentResponse *response = GET_RESPONSE_VIEW(self, testerPresent);
-    TesterPresentRequest *request = (TesterPresentRequest *)req->buf;
 
-    if (req->size < 1) {
-        iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
-        return;
+    if (0 != (req->buf[0] & 0x7F)) {
+        return iso14229SendNegativeResponse(self, req, kSubFunctionNotSupported);
     }
 
-    self->s3_session_timeout_timer = iso14229UserGetms() + self->cfg->s3_ms;
-    response->zeroSubFunction = request->zeroSubFunction & 0x3F;
+    response->zeroSubFunction = 0;
     iso14229SendResponse(self, req, sizeof(TesterPresentResponse));
 }
 
+/**
+ * @brief 0x85 ControlDTCSetting
+ *
+ * @param self
+ * @param data
+ * @param size
+ */
+void iso14229ControlDTCSetting(Iso14229Instance *self, const Iso14229ServiceRequest *req) {
+    ControlDTCSettingResponse *response = GET_RESPONSE_VIEW(self, controlDTCSetting);
+    Iso14229DTCStore *store = &self->persistent.dtcStore;
+
+    const uint8_t DTCSettingType = req->buf[0] & 0x7F;
+    switch (DTCSettingType) {
+    case kDTCSettingOn:
+        store->settingOff = false;
+        break;
+    case kDTCSettingOff:
+        store->settingOff = true;
+        store->queueLen = 0;
+        break;
+    default:
+        return iso14229SendNegativeResponse(self, req, kSubFunctionNotSupported);
+    }
+
+    response->DTCSettingType = DTCSettingType;
+    iso14229SendResponse(self, req, sizeof(ControlDTCSettingResponse));
+}
+
+static inline uint16_t iso14229ROEDataId(const Iso14229ROEEvent *ev) {
+    return iso14229LoadBE16(ev->eventTypeRecord);
+}
+
+/**
+ * @brief Extracts the value located by the onComparisonOfValues localization:
+ * bit 15 signed, bits 14-10 length in bits (0: 32), bits 9-0 position of
+ * the first bit, counted from the most significant bit of the data record.
+ * @return 0 on success, -1 if the value lies outside the data record
+ */
+static int iso14229ROEExtractValue(const uint8_t *record, const uint16_t len,
+                                   const uint16_t localization, int64_t *value) {
+    const uint8_t nBits = ((localization >> 10) & 0x1F) ? ((localization >> 10) & 0x1F) : 32;
+    const uint16_t first = localization & 0x3FF;
+    uint64_t raw = 0;
+
+    if (first + nBits > len * 8) {
+        return -1;
+    }
+    for (uint16_t bit = first; bit < first + nBits; bit++) {
+        raw = (raw << 1) | ((record[bit / 8] >> (7 - bit % 8)) & 1);
+    }
+    if ((localization & 0x8000) && (raw >> (nBits - 1))) {
+        raw |= ~(uint64_t)0 << nBits;
+    }
+    *value = (int64_t)raw;
+    return 0;
+}
+
+/**
+ * @brief Evaluates the comparison of an onComparisonOfValues event
+ *
+ * @param ev
+ * @param value
+ * @param met set if the condition holds
+ * @param cleared set if the condition has cleared by at least the hysteresis
+ */
+static void iso14229ROECompare(const Iso14229ROEEvent *ev, const int64_t value, bool *met,
+                               bool *cleared) {
+    const uint8_t *rec = ev->eventTypeRecord;
+    const uint32_t rawRef = iso14229DecodeBigEndian(rec + 3, 4);
+    const bool isSigned = rec[8] & 0x80;
+    const int64_t ref = isSigned ? (int64_t)(int32_t)rawRef : (int64_t)rawRef;
+    // hysteresisValue is a percentage of the reference value
+    const int64_t hyst = (ref < 0 ? -ref : ref) * rec[7] / 100;
+    const int64_t dist = value < ref ? ref - value : value - ref;
+
+    switch (rec[2]) {
+    case kROELessThan:
+        *met = value < ref;
+        *cleared = value >= ref + hyst;
+        break;
+    case kROELargerThan:
+        *met = value > ref;
+        *cleared = value <= ref - hyst;
+        break;
+    case kROEEqual:
+        *met = value == ref;
+        *cleared = dist > hyst;
+        break;
+    case kROENotEqual:
+    default:
+        *met = value != ref;
+        *cleared = dist <= hyst;
+        break;
+    }
+}
+
+/**
+ * @brief Reads the data identifier watched by `ev` into the idle response
+ * buffer and compares it with the previous sample
+ * @return true if the event occurred
+ */
+static bool iso14229ROESample(Iso14229Instance *self, Iso14229ROEEvent *ev) {
+    uint8_t *scratch = self->tport_send.buf.raw;
+    uint16_t len = 0;
+    bool occurred = false;
+
+    // e.g. a dynamically defined DID that has since been cleared
+    if (kPositiveResponse != iso14229ReadDID(self, iso14229ROEDataId(ev), scratch,
+                                             ISO14229_TPORT_SEND_BUFSIZE, &len)) {
+        return false;
+    }
+
+    switch (ev->eventType) {
+    case kOnChangeOfDataIdentifier: {
+        // Only the hash is kept, so a change that collides goes unnoticed
+        const uint32_t hash = iso14229FNV1a(ISO14229_FNV1A_INIT, scratch, len);
+        occurred = ev->sampled && hash != ev->hash;
+        ev->hash = hash;
+        break;
+    }
+    case kOnComparisonOfValues: {
+        int64_t value = 0;
+        bool met = false, cleared = false;
+        if (0 != iso14229ROEExtractValue(scratch, len, iso14229LoadBE16(ev->eventTypeRecord + 8),
+                                         &value)) {
+            return false;
+        }
+        iso14229ROECompare(ev, value, &met, &cleared);
+        if (!ev->sampled) {
+            // A condition that already holds when the events are started is
+            // not an event
+            ev->armed = !met;
+        } else if (ev->armed && met) {
+            occurred = true;
+            ev->armed = false;
+        } else if (!ev->armed && cleared) {
+            ev->armed = true;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    ev->sampled = true;
+    return occurred;
+}
+
+/**
+ * @brief Runs serviceToRespondToRecord as if it had been requested. The
+ * response is sent from iso14229UserPoll without waiting for P2.
+ */
+static void iso14229ROERespond(Iso14229Instance *self, const Iso14229ROEEvent *ev) {
+    const Iso14229ServiceRequest req = {
+        .sid = ev->serviceToRespondToRecord[0],
+        .buf = ev->serviceToRespondToRecord + 1,
+        .size = ev->serviceToRespondToRecordLen - 1,
+    };
+
+    iso14229Dispatch(self, &req);
+    if (self->tport_send.pending && 0x7F == self->tport_send.buf.negResponse.negResponseSid) {
+        self->tport_send.pending = false;
+        self->tport_send.buf_len_used = 0;
+        return;
+    }
+    self->p2_timer = iso14229UserGetms() - 1;
+}
+
+/**
+ * @brief Samples the started events every ISO14229_ROE_SAMPLE_MS and sends
+ * the response of one occurred event per call. Both use the response buffer,
+ * so nothing happens while a response is pending.
+ */
+static void iso14229ResponseOnEventPoll(Iso14229Instance *self) {
+    Iso14229ResponseOnEvent *roe = &self->roe;
+    const uint32_t now = iso14229UserGetms();
+
+    if (!roe->started || self->tport_send.pending) {
+        return;
+    }
+
+    if (!Iso14229TimeAfter(roe->nextSample, now)) {
+        roe->nextSample = now + ISO14229_ROE_SAMPLE_MS;
+        for (uint8_t i = 0; i < ISO14229_MAX_ROE_EVENTS; i++) {
+            Iso14229ROEEvent *ev = &roe->events[i];
+            if (ev->eventType && iso14229ROESample(self, ev)) {
+                ev->triggered = true;
+            }
+        }
+    }
+
+    if (self->overloaded || ISOTP_SEND_STATUS_INPROGRESS == self->cfg->phys_link->send_status) {
+        return;
+    }
+    for (uint8_t i = 0; i < ISO14229_MAX_ROE_EVENTS; i++) {
+        Iso14229ROEEvent *ev = &roe->events[i];
+        if (ev->triggered) {
+            ev->triggered = false;
+            return iso14229ROERespond(self, ev);
+        }
+    }
+}
+
+/**
+ * @brief 0x86 ResponseOnEvent, reportActivatedEvents
+ */
+static void iso14229ROEReportActivatedEvents(Iso14229Instance *self,
+                                             const Iso14229ServiceRequest *req) {
+    ResponseOnEventResponse *response = GET_RESPONSE_VIEW(self, responseOnEvent);
+    const Iso14229ResponseOnEvent *roe = &self->roe;
+    // eventType, numberOfActivatedEvents
+    uint16_t responseLength = 2;
+    uint8_t *dst = &response->numberOfIdentifiedEvents + 1;
+
+    response->eventType = kReportActivatedEvents;
+    response->numberOfIdentifiedEvents = 0;
+    for (uint8_t i = 0; roe->started && i < ISO14229_MAX_ROE_EVENTS; i++) {
+        const Iso14229ROEEvent *ev = &roe->events[i];
+        if (0 == ev->eventType) {
+            continue;
+        }
+        const uint16_t len = 2 + ev->eventTypeRecordLen + ev->serviceToRespondToRecordLen;
+        if (1 + responseLength + len > ISO14229_TPORT_SEND_BUFSIZE) {
+            return iso14229SendNegativeResponse(self, req, kResponseTooLong);
+        }
+        *dst++ = ev->eventType;
+        *dst++ = ev->eventWindowTime;
+        memcpy(dst, ev->eventTypeRecord, ev->eventTypeRecordLen);
+        dst += ev->eventTypeRecordLen;
+        memcpy(dst, ev->serviceToRespondToRecord, ev->serviceToRespondToRecordLen);
+        dst += ev->serviceToRespondToRecordLen;
+        responseLength += len;
+        response->numberOfIdentifiedEvents++;
+    }
+    iso14229SendResponse(self, req, responseLength);
+}
+
+/**
+ * @brief 0x86 ResponseOnEvent
+ *
+ * @param self
+ * @param data
+ * @param size
+ */
+void iso14229ResponseOnEvent(Iso14229Instance *self, const Iso14229ServiceRequest *req) {
+    ResponseOnEventResponse *response = GET_RESPONSE_VIEW(self, responseOnEvent);
+    Iso14229ResponseOnEvent *roe = &self->roe;
+    uint8_t eventTypeRecordLen = 0;
+
+    const uint8_t eventType = req->buf[0] & 0x7F;
+
+    // ASSUMPTION: events are kept in RAM. storeEvent is not supported.
+    if (eventType & ISO14229_ROE_STORE_EVENT) {
+        return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+    }
+
+    switch (eventType) {
+    case kReportActivatedEvents:
+        if (req->size != 1) {
+            return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+        }
+        return iso14229ROEReportActivatedEvents(self, req);
+    case kStopResponseOnEvent:
+    case kStartResponseOnEvent:
+    case kClearResponseOnEvent:
+        if (req->size != 2) {
+            return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+        }
+        if (kStartResponseOnEvent == eventType) {
+            bool any = false;
+            for (uint8_t i = 0; i < ISO14229_MAX_ROE_EVENTS; i++) {
+                any |= 0 != roe->events[i].eventType;
+                roe->events[i].sampled = false;
+                roe->events[i].triggered = false;
+            }
+            if (!any) {
+                return iso14229SendNegativeResponse(self, req, kRequestSequenceError);
+            }
+            roe->started = true;
+            roe->nextSample = iso14229UserGetms();
+        } else if (kStopResponseOnEvent == eventType) {
+            roe->started = false;
+        } else {
+            memset(roe, 0, sizeof(*roe));
+        }
+        response->eventType = eventType;
+        response->numberOfIdentifiedEvents = 0;
+        response->eventWindowTime = req->buf[1];
+        return iso14229SendResponse(self, req, sizeof(ResponseOnEventResponse));
+    case kOnChangeOfDataIdentifier:
+        eventTypeRecordLen = 2;
+        break;
+    case kOnComparisonOfValues:
+        eventTypeRecordLen = ISO14229_ROE_EVENT_TYPE_RECORD_LEN;
+        break;
+    default:
+        return iso14229SendNegativeResponse(self, req, kSubFunctionNotSupported);
+    }
+
+    // eventType, eventWindowTime, eventTypeRecord, serviceToRespondToRecord
+    if (req->size < 2 + eventTypeRecordLen + 1) {
+        return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+    }
+
+    const uint8_t eventWindowTime = req->buf[1];
+    const uint8_t *eventTypeRecord = req->buf + 2;
+    const uint8_t *serviceToRespondToRecord = eventTypeRecord + eventTypeRecordLen;
+    const uint16_t serviceToRespondToRecordLen = req->size - 2 - eventTypeRecordLen;
+    const uint16_t dataId = iso14229LoadBE16(eventTypeRecord);
+    const uint8_t sid = serviceToRespondToRecord[0];
+    const uint8_t idx = ISO14229_SID_INDEX(sid);
+    uint16_t len = 0;
+    enum Iso14229ResponseCodeEnum err;
+
+    // ASSUMPTION: events stay set up until cleared. Finite windows are not
+    // supported.
+    if (ISO14229_ROE_INFINITE_TIME_TO_RESPONSE != eventWindowTime) {
+        return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+    }
+
+    if (serviceToRespondToRecordLen > ISO14229_ROE_MAX_SERVICE_RECORD_LEN ||
+        !ISO14229_SID_IS_REQUEST(sid) || kSID_RESPONSE_ON_EVENT == sid ||
+        !(self->persistent.enabledServices[idx / 32] & (1UL << (idx % 32)))) {
+        return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+    }
+
+    if (kOnComparisonOfValues == eventType) {
+        const uint8_t comparisonLogic = eventTypeRecord[2];
+        if (comparisonLogic < kROELessThan || comparisonLogic > kROENotEqual ||
+            eventTypeRecord[7] > 100) {
+            return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+        }
+    }
+
+    // The watched data identifier is read like 0x22
+    err = iso14229CheckAccess(self, kSID_READ_DATA_BY_IDENTIFIER, kAccessRuleDataIdentifier,
+                              dataId);
+    if (kPositiveResponse != err) {
+        return iso14229SendNegativeResponse(self, req, err);
+    }
+    // The response buffer is free until the response is written
+    err = iso14229ReadDID(self, dataId, self->tport_send.buf.raw, ISO14229_TPORT_SEND_BUFSIZE,
+                          &len);
+    if (kResponseTooLong == err) {
+        err = kRequestOutOfRange;
+    }
+    if (kPositiveResponse != err) {
+        return iso14229SendNegativeResponse(self, req, err);
+    }
+
+    // Setting up an event of the same type on the same data identifier
+    // replaces it
+    Iso14229ROEEvent *ev = NULL;
+    for (uint8_t i = 0; i < ISO14229_MAX_ROE_EVENTS; i++) {
+        Iso14229ROEEvent *e = &roe->events[i];
+        if (e->eventType == eventType && iso14229ROEDataId(e) == dataId) {
+            ev = e;
+            break;
+        }
+        if (NULL == ev && 0 == e->eventType) {
+            ev = e;
+        }
+    }
+    if (NULL == ev) {
+        return iso14229SendNegativeResponse(self, req, kRequestOutOfRange);
+    }
+
+    memset(ev, 0, sizeof(*ev));
+    ev->eventType = eventType;
+    ev->eventWindowTime = eventWindowTime;
+    memcpy(ev->eventTypeRecord, eventTypeRecord, eventTypeRecordLen);
+    ev->eventTypeRecordLen = eventTypeRecordLen;
+    memcpy(ev->serviceToRespondToRecord, serviceToRespondToRecord, serviceToRespondToRecordLen);
+    ev->serviceToRespondToRecordLen = serviceToRespondToRecordLen;
+
+    response->eventType = eventType;
+    response->numberOfIdentifiedEvents = 0;
+    response->eventWindowTime = eventWindowTime;
+    memcpy(response->eventTypeRecord, eventTypeRecord, req->size - 2);
+    iso14229SendResponse(self, req, sizeof(ResponseOnEventResponse) + req->size - 2);
+}
+
+static uint32_t iso14229LinkControlFixedBaudrate(const uint8_t modeIdentifier) {
+    switch (modeIdentifier) {
+    case kLinkControlPC9600Baud:
+        return 9600;
+    case kLinkControlPC19200Baud:
+        return 19200;
+    case kLinkControlPC38400Baud:
+        return 38400;
+    case kLinkControlPC57600Baud:
+        return 57600;
+    case kLinkControlPC115200Baud:
+        return 115200;
+    case kLinkControlCAN125000Baud:
+        return 125000;
+    case kLinkControlCAN250000Baud:
+        return 250000;
+    case kLinkControlCAN500000Baud:
+        return 500000;
+    case kLinkControlCAN1000000Baud:
+        return 1000000;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief 0x87 LinkControl
+ *
+ * @param self
+ * @param data
+ * @param size
+ */
+void iso14229LinkControl(Iso14229Instance *self, const Iso14229ServiceRequest *req) {
+    LinkControlResponse *response = GET_RESPONSE_VIEW(self, linkControl);
+    const Iso14229ServerConfig *cfg = self->cfg;
+    uint8_t modeIdentifier = 0;
+    uint32_t baudrate = 0;
+
+    if (NULL == cfg->userLinkControlVerify || NULL == cfg->userLinkControlTransition) {
+        return iso14229SendNegativeResponse(self, req, kServiceNotSupported);
+    }
+
+    const uint8_t linkControlType = req->buf[0] & 0x7F;
+    switch (linkControlType) {
+    case kVerifyModeTransitionWithFixedParameter:
+        if (req->size != 2) {
+            return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+        }
+        modeIdentifier = req->buf[1];
+        baudrate = iso14229LinkControlFixedBaudrate(modeIdentifier);
+        break;
+    case kVerifyModeTransitionWithSpecificParameter:
+        if (req->size != 4) {
+            return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+        }
+        baudrate = iso14229LoadBE24(req->buf + 1);
+        break;
+    case kTransitionMode:
+        if (req->size != 1) {
+            return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+        }
+        // ISO14229-1:2013 Figure 18: transitionMode must follow a verify
+        if (!self->linkControl.verified) {
+            return iso14229SendNegativeResponse(self, req, kRequestSequenceError);
+        }
+        self->linkControl.verified = false;
+        self->linkControl.transitionRequested = true;
+        break;
+    default:
+        return iso14229SendNegativeResponse(self, req, kSubFunctionNotSupported);
+    }
+
+    if (kTransitionMode != linkControlType) {
+        enum Iso14229ResponseCodeEnum err = cfg->userLinkControlVerify(modeIdentifier, baudrate);
+        if (kPositiveResponse != err) {
+            self->linkControl.verified = false;
+            return iso14229SendNegativeResponse(self, req, err);
+        }
+        self->linkControl.verified = true;
+        self->linkControl.modeIdentifier = modeIdentifier;
+        self->linkControl.baudrate = baudrate;
+    }
+
+    response->linkControlType = linkControlType;
+    iso14229SendResponse(self, req, sizeof(LinkControlResponse));
+}
+
+/**
+ * @brief Changes the link mode once the response to transitionMode has left.
+ */
+static void iso14229LinkControlPoll(Iso14229Instance *self) {
+    if (!self->linkControl.transitionRequested || !iso14229ResponseSent(self)) {
+        return;
+    }
+    self->linkControl.transitionRequested = false;
+    self->cfg->userLinkControlTransition(self->linkControl.modeIdentifier,
+                                         self->linkControl.baudrate);
+}
+
 uint32_t isotp_user_get_ms() { return iso14229UserGetms(); }
 
 void isotp_user_debug(const char *message, ...) {
@@ -578,31 +2956,229 @@ int isotp_user_send_can(const uint32_t arbitration_id, const uint8_t *data, cons
     return iso14229UserSendCAN(arbitration_id, data, size);
 }
 
+static inline const Iso14229Service *iso14229ServiceTable(const Iso14229Instance *self) {
+#if ISO14229_DEFAULT_SERVICE_TABLE
+    return self->cfg->serviceTable ? self->cfg->serviceTable : iso14229DefaultServiceTable;
+#else
+    return self->cfg->serviceTable;
+#endif
+}
+
+/**
+ * @brief ISO14229-1:2013 Table 2: services with a subfunction parameter, the
+ * only ones that can carry a suppressPosRspMsgIndicationBit
+ */
+static bool iso14229ServiceHasSubFunction(const uint8_t sid) {
+    switch (sid) {
+    case kSID_DIAGNOSTIC_SESSION_CONTROL:
+    case kSID_ECU_RESET:
+    case kSID_READ_DTC_INFORMATION:
+    case kSID_SECURITY_ACCESS:
+    case kSID_COMMUNICATION_CONTROL:
+    case 0x29: // Authentication
+    case kSID_DYNAMICALLY_DEFINE_DATA_IDENTIFIER:
+    case kSID_ROUTINE_CONTROL:
+    case kSID_TESTER_PRESENT:
+    case 0x83: // AccessTimingParameter
+    case 0x84: // SecuredDataTransmission
+    case kSID_CONTROL_DTC_SETTING:
+    case kSID_RESPONSE_ON_EVENT:
+    case kSID_LINK_CONTROL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Shortest request each built-in service can parse, SID excluded. A
+ * request shorter than this is answered with kIncorrectMessageLengthOrInvalidFormat
+ * before the handler runs, so handlers only check the fields that follow.
+ */
+static const uint8_t iso14229MinRequestLength[ISO14229_MAX_DIAGNOSTIC_SERVICES] = {
+    [ISO14229_SID_INDEX(kSID_DIAGNOSTIC_SESSION_CONTROL)] = 1,
+    [ISO14229_SID_INDEX(kSID_ECU_RESET)] = 1,
+    [ISO14229_SID_INDEX(kSID_CLEAR_DIAGNOSTIC_INFORMATION)] = 3, // groupOfDTC
+    [ISO14229_SID_INDEX(kSID_READ_DTC_INFORMATION)] = 1,
+    [ISO14229_SID_INDEX(kSID_READ_DATA_BY_IDENTIFIER)] = 2, // one dataId
+    [ISO14229_SID_INDEX(kSID_SECURITY_ACCESS)] = 1,
+    [ISO14229_SID_INDEX(kSID_COMMUNICATION_CONTROL)] = 1,
+    [ISO14229_SID_INDEX(kSID_READ_DATA_BY_PERIODIC_IDENTIFIER)] = 1,
+    [ISO14229_SID_INDEX(kSID_DYNAMICALLY_DEFINE_DATA_IDENTIFIER)] = 1,
+    [ISO14229_SID_INDEX(kSID_WRITE_DATA_BY_IDENTIFIER)] = 3, // dataId, one byte of dataRecord
+    [ISO14229_SID_INDEX(kSID_INPUT_OUTPUT_CONTROL_BY_IDENTIFIER)] = 3, // dataId, ioControlParameter
+    [ISO14229_SID_INDEX(kSID_ROUTINE_CONTROL)] = ROUTINE_CONTROL_REQUEST_LEN,
+    [ISO14229_SID_INDEX(kSID_REQUEST_DOWNLOAD)] = REQUEST_DOWNLOAD_REQUEST_LEN,
+    [ISO14229_SID_INDEX(kSID_TRANSFER_DATA)] = 1, // blockSequenceCounter
+    [ISO14229_SID_INDEX(kSID_TESTER_PRESENT)] = 1,
+    [ISO14229_SID_INDEX(kSID_CONTROL_DTC_SETTING)] = 1,
+    [ISO14229_SID_INDEX(kSID_RESPONSE_ON_EVENT)] = 1,
+    [ISO14229_SID_INDEX(kSID_LINK_CONTROL)] = 1,
+};
+
+/**
+ * @brief Call the service matching the SID, else reply that the service is
+ * unsupported or not allowed
+ */
+static void iso14229Dispatch(Iso14229Instance *self, const Iso14229ServiceRequest *req) {
+    // The answer to a pending 0x27 sendKey is still to come
+    if (self->security.verifyPending) {
+        return iso14229SendNegativeResponse(self, req, kBusyRepeatRequest);
+    }
+
+    // TesterPresent is cheap and keeps the session alive until the load drops
+    if (self->overloaded && kSID_TESTER_PRESENT != req->sid) {
+        return iso14229SendNegativeResponse(self, req, kBusyRepeatRequest);
+    }
+
+    if (!ISO14229_SID_IS_REQUEST(req->sid)) {
+        return iso14229SendNegativeResponse(self, req, kServiceNotSupported);
+    }
+
+    const uint8_t idx = ISO14229_SID_INDEX(req->sid);
+    const uint8_t word = idx / 32;
+    const uint32_t bit = 1UL << (idx % 32);
+
+    if (!(self->persistent.enabledServices[word] & self->access.sessionServices[word] &
+          self->access.securityServices[word] & bit)) {
+        // ISO14229-1:2013 Figure 5 order of checks
+        if (!(self->persistent.enabledServices[word] & bit)) {
+            return iso14229SendNegativeResponse(self, req, kServiceNotSupported);
+        }
+        if (!(self->access.sessionServices[word] & bit)) {
+            return iso14229SendNegativeResponse(self, req, kServiceNotSupportedInActiveSession);
+        }
+        return iso14229SendNegativeResponse(self, req, kSecurityAccessDenied);
+    }
+
+    // ISO14229-1:2013 Figure 5: the length is checked before the subfunction
+    if (req->size < iso14229MinRequestLength[idx]) {
+        return iso14229SendNegativeResponse(self, req, kIncorrectMessageLengthOrInvalidFormat);
+    }
+
+    if ((self->access.refinedServices[word] & bit) && req->size >= 1) {
+        enum Iso14229ResponseCodeEnum err =
+            iso14229CheckAccess(self, req->sid, kAccessRuleSubFunction, req->buf[0] & 0x7F);
+        if (kPositiveResponse != err) {
+            return iso14229SendNegativeResponse(self, req, err);
+        }
+    }
+
+    iso14229ServiceTable(self)[idx](self, req);
+}
+
+/**
+ * @brief Records the response to a download request in the handler's
+ * Iso14229DownloadResults
+ *
+ * @return true if the response must be dropped: a multicast download request
+ * received on the functional link
+ */
+static bool iso14229DownloadRecordResult(Iso14229Instance *self,
+                                         const Iso14229ServiceRequest *req) {
+    if (self->persistent.nRegisteredDownloadHandlers < 1) {
+        return false;
+    }
+    Iso14229DownloadHandler *handler = self->persistent.downloadHandlers[0];
+    Iso14229DownloadResults *results = &handler->results;
+    const TportSend *tport = &self->tport_send;
+    uint8_t code = kPositiveResponse;
+    if (tport->pending && 0x7F == tport->buf.negResponse.negResponseSid) {
+        code = tport->buf.negResponse.responseCode;
+    }
+
+    switch (req->sid) {
+    case kSID_REQUEST_DOWNLOAD:
+        memset(results, 0, sizeof(*results));
+        results->requestDownloadCode = code;
+        results->imageHash = ISO14229_FNV1A_INIT;
+        break;
+    case kSID_TRANSFER_DATA:
+        if (kPositiveResponse != code && 0 == results->firstRejectCode) {
+            results->firstRejectCode = code;
+            results->firstRejectedBlock = results->blocksReceived;
+        }
+        results->blocksReceived++;
+        break;
+    case kSID_REQUEST_TRANSFER_EXIT:
+        results->transferExited = true;
+        results->transferExitCode = code;
+        break;
+    default:
+        return false;
+    }
+    return req->functional && handler->cfg->functional;
+}
+
 /**
- * @brief Call the service matching the SID in buf, else reply that the service
- * is unsupported
+ * @brief Call the service matching the SID in buf, then drop responses that
+ * must not be sent:
+ *  - positive responses to requests with the suppressPosRspMsgIndicationBit
+ *  - ISO14229-1:2013 7.5: NRCs 0x11, 0x12, 0x31, 0x7E and 0x7F to functionally
+ * addressed requests
+ * NRC 0x78 is never dropped: the client must be told to wait.
+ *  - any response to a multicast download request, see
+ * Iso14229DownloadHandlerConfig.functional
  *
  * @param self
  * @param buf   incoming data from ISO-TP layer
  * @param size  size of buf
+ * @param functional true if buf was received on the functional link
  */
-void iso14229CallRequestedService(Iso14229Instance *self, const uint8_t *buf, const uint16_t size) {
+void iso14229CallRequestedService(Iso14229Instance *self, const uint8_t *buf, const uint16_t size,
+                                  const bool functional) {
     Iso14229ServiceRequest req = {0};
+    TportSend *tport = &self->tport_send;
 
     // The buffer size must be at least 1, the size of the SID byte
     if (NULL == buf || size < 1) {
         return;
     }
-    req.sid = buf[0];
-    req.buf = buf + 1;
+    req.sid = buf[0];
+    req.buf = buf + 1;
+
+    req.size = size - 1;
+    req.functional = functional;
+
+    // Any request keeps a non-default session alive, not only TesterPresent
+    self->s3_session_timeout_timer = iso14229UserGetms() + self->cfg->s3_ms;
+
+    if (iso14229CacheSend(self, buf, size)) {
+        return;
+    }
+
+    iso14229Dispatch(self, &req);
+
+    if (iso14229DownloadRecordResult(self, &req)) {
+        tport->pending = false;
+    }
+
+    if (!tport->pending) {
+        tport->buf_len_used = 0;
+        return;
+    }
 
-    req.size = size - 1;
+    if (0x7F == tport->buf.negResponse.negResponseSid) {
+        switch (tport->buf.negResponse.responseCode) {
+        case kServiceNotSupported:
+        case kSubFunctionNotSupported:
+        case kRequestOutOfRange:
+        case kSubFunctionNotSupportedInActiveSession:
+        case kServiceNotSupportedInActiveSession:
+            if (functional) {
+                tport->pending = false;
+            }
+            break;
+        default:
+            break;
+        }
+    } else if (req.size >= 1 && iso14229ServiceHasSubFunction(req.sid) &&
+               suppressPosRspMsgIndicationBitIsSet(req.buf[0])) {
+        tport->pending = false;
+    }
 
-    void (*service)() = self->services[req.sid];
-    if (NULL != service) {
-        service(self, &req);
-    } else {
-        iso14229SendNegativeResponse(self, &req, kServiceNotSupported);
+    if (!tport->pending) {
+        tport->buf_len_used = 0;
     }
 }
 
@@ -610,13 +3186,15 @@ void iso14229CallRequestedService(Iso14229Instance *self, const uint8_t *buf, co
 //                             Public Functions
 // ========================================================================
 
-int iso14229UserInit(Iso14229Instance *self, const Iso14229ServerConfig *const cfg) {
-    if (NULL == self || NULL == cfg) {
-        return -1;
-    }
-
-    memset(self, 0, sizeof(Iso14229Instance));
-    self->cfg = cfg;
+/**
+ * @brief Starts the server from a zeroed state, keeping the registrations and
+ * the DTC memory that precede `security` in Iso14229Instance
+ *
+ * @param self
+ * @return int 0 on success
+ */
+static int iso14229Start(Iso14229Instance *self) {
+    const Iso14229ServerConfig *cfg = self->cfg;
 
     // Initialize p2_timer to an already past time, otherwise the server's
     // response to incoming messages will be delayed.
@@ -628,6 +3206,43 @@ int iso14229UserInit(Iso14229Instance *self, const Iso14229ServerConfig *const c
     self->tport_send.pending = false;
     self->tport_send.buf_len_used = 0;
 
+    self->persistent.dtcStore.cfg = cfg->dtcStore;
+
+    if (NULL != cfg->securityAccess) {
+        const Iso14229SecurityAccessConfig *sa = cfg->securityAccess;
+        if (NULL == sa->userGenerateSeed || NULL == sa->userVerifyKeyStart ||
+            sa->seedLength > ISO14229_SECURITY_MAX_SEED_LEN) {
+            return -1;
+        }
+        iso14229SecurityInit(self);
+    }
+
+    if (0 != iso14229AccessInit(self)) {
+        return -1;
+    }
+
+    if (NULL != cfg->writeBack) {
+        const Iso14229WriteBackConfig *wb = cfg->writeBack;
+        if (wb->nDIDs > ISO14229_MAX_WRITE_BACK_DIDS || (wb->nDIDs && NULL == wb->dids)) {
+            return -1;
+        }
+        for (uint16_t i = 1; i < wb->nDIDs; i++) {
+            if (wb->dids[i - 1].dataId >= wb->dids[i].dataId) {
+                return -1;
+            }
+        }
+    }
+
+    if (NULL != cfg->overload) {
+        const Iso14229OverloadConfig *ol = cfg->overload;
+        if (ol->queueDepth.low > ol->queueDepth.high ||
+            ol->pendingWork.low > ol->pendingWork.high || ol->backlog.low > ol->backlog.high) {
+            return -1;
+        }
+    }
+
+    iso14229SetDiagnosticSession(self, kDiagModeDefault);
+
     if (NULL != cfg->middleware) {
         if (NULL == cfg->middleware->initFunc || NULL == cfg->middleware->pollFunc ||
             NULL == cfg->middleware->self) {
@@ -642,6 +3257,122 @@ int iso14229UserInit(Iso14229Instance *self, const Iso14229ServerConfig *const c
     return 0;
 }
 
+int iso14229UserInit(Iso14229Instance *self, const Iso14229ServerConfig *const cfg) {
+    if (NULL == self || NULL == cfg) {
+        return -1;
+    }
+#if !ISO14229_DEFAULT_SERVICE_TABLE
+    if (NULL == cfg->serviceTable) {
+        return -1;
+    }
+#endif
+
+    memset(self, 0, sizeof(Iso14229Instance));
+    self->cfg = cfg;
+    return iso14229Start(self);
+}
+
+static inline bool iso14229LoadHigh(const Iso14229LoadThreshold *threshold, const uint32_t load) {
+    return threshold->high && load >= threshold->high;
+}
+
+static inline bool iso14229LoadLow(const Iso14229LoadThreshold *threshold, const uint32_t load) {
+    return !threshold->high || load <= threshold->low;
+}
+
+/**
+ * @brief Updates `overloaded` with hysteresis between the high and low
+ * thresholds so that a load hovering around one threshold does not toggle it
+ */
+static void iso14229OverloadPoll(Iso14229Instance *self) {
+    const Iso14229OverloadConfig *cfg = self->cfg->overload;
+    if (NULL == cfg) {
+        return;
+    }
+
+    const uint32_t queueDepth = self->persistent.dtcStore.queueLen;
+    uint32_t pendingWork = self->security.verifyPending + self->linkControl.transitionRequested;
+    for (uint8_t i = 0; i < ISO14229_MAX_ROE_EVENTS; i++) {
+        pendingWork += self->roe.events[i].triggered;
+    }
+    if (NULL != cfg->userGetPendingWork) {
+        pendingWork += cfg->userGetPendingWork();
+    }
+    const uint32_t backlog = NULL != cfg->userGetBacklog ? cfg->userGetBacklog() : 0;
+
+    if (self->overloaded) {
+        self->overloaded = !(iso14229LoadLow(&cfg->queueDepth, queueDepth) &&
+                             iso14229LoadLow(&cfg->pendingWork, pendingWork) &&
+                             iso14229LoadLow(&cfg->backlog, backlog));
+    } else {
+        self->overloaded = iso14229LoadHigh(&cfg->queueDepth, queueDepth) ||
+                           iso14229LoadHigh(&cfg->pendingWork, pendingWork) ||
+                           iso14229LoadHigh(&cfg->backlog, backlog);
+    }
+}
+
+/**
+ * @brief 0x11 keyOffOnReset and softReset: restarts the server in place, as
+ * iso14229UserInit would, without a hardware reset. Registered services,
+ * routines, I/O controls and download handlers are kept, as is the DTC
+ * memory. The ISO-TP links are reinitialized and the middleware is
+ * initialized again, so middleware registrations must be idempotent.
+ *
+ * @return int 0, or -1 if the server could not be restarted
+ */
+static int iso14229SoftReset(Iso14229Instance *self) {
+    const Iso14229ServerConfig *cfg = self->cfg;
+    const uint8_t resetType = self->ecu_reset_type;
+    const uint8_t pollStep = self->poll.step;
+    IsoTpLink *links[] = {cfg->phys_link, cfg->func_link};
+
+    for (uint8_t i = 0; i < ARRAY_SZ(links); i++) {
+        IsoTpLink *link = links[i];
+        isotp_init_link(link, link->send_arbitration_id, link->send_buffer, link->send_buf_size,
+                        link->receive_buffer, link->receive_buf_size);
+    }
+
+    iso14229SecurityCancelVerify(self);
+    // the DTC memory outlives a reset, pending test results do not
+    self->persistent.dtcStore.queueHead = 0;
+    self->persistent.dtcStore.queueLen = 0;
+
+    memset(&self->security, 0, sizeof(self->security));
+    memset(&self->access, 0, sizeof(self->access));
+    memset(&self->dynamicDIDs, 0, sizeof(self->dynamicDIDs));
+    memset(&self->periodic, 0, sizeof(self->periodic));
+    memset(&self->roe, 0, sizeof(self->roe));
+    memset(&self->linkControl, 0, sizeof(self->linkControl));
+    iso14229ResetCommunication(self);
+    self->overloaded = false;
+    // Data identifiers the flush before the reset could not write stay dirty
+    // and are retried after nvmWriteDelay_ms
+    memset(&self->poll, 0, sizeof(self->poll));
+    self->diag_mode = 0;
+    self->ecu_reset_requested = false;
+    self->ecu_reset_type = 0;
+    self->p2_timer = 0;
+    self->s3_session_timeout_timer = 0;
+    memset(&self->tport_send, 0, sizeof(self->tport_send));
+
+    for (uint16_t i = 0; i < self->persistent.nRegisteredDownloadHandlers; i++) {
+        iso14229DownloadHandlerInit(self->persistent.downloadHandlers[i]);
+    }
+    iso14229UserInvalidateCache(self);
+
+    if (0 != iso14229Start(self)) {
+        ISO14229USERDEBUG("soft reset: restart failed");
+        return -1;
+    }
+    // iso14229PollStep moves on from the step that was running
+    self->poll.step = pollStep;
+
+    if (cfg->userSoftReset) {
+        cfg->userSoftReset(resetType);
+    }
+    return 0;
+}
+
 /**
  * @brief ISO14229-1-2013 Figure 4
  *
@@ -649,10 +3380,26 @@ int iso14229UserInit(Iso14229Instance *self, const Iso14229ServerConfig *const c
  * @return int
  */
 int iso14229StateMachine(Iso14229Instance *self) {
-    if (self->ecu_reset_requested &&
-        (Iso14229TimeAfter(iso14229UserGetms(), self->ecu_reset_100ms_timer))) {
+    // S3: a client that stops sending requests leaves the non-default session
+    if (kDiagModeDefault != self->diag_mode &&
+        Iso14229TimeAfter(iso14229UserGetms(), self->s3_session_timeout_timer)) {
+        iso14229SetDiagnosticSession(self, kDiagModeDefault);
+    }
+
+    if (!self->ecu_reset_requested) {
+        return 0;
+    }
+    // The positive response goes out before the reset
+    if (!iso14229ResponseSent(self)) {
+        return 0;
+    }
+    iso14229WriteBackFlush(self);
+    if (kHardReset == self->ecu_reset_type) {
         self->cfg->userHardReset();
         self->ecu_reset_requested = false;
+    } else if (0 != iso14229SoftReset(self)) {
+        // The server is in no state to carry on, the ECU has to start over
+        self->cfg->userHardReset();
     }
     return 0;
 }
@@ -669,32 +3416,46 @@ void iso14229IsoTpReceive(Iso14229Instance *self) {
     /* Note: passing (NULL, 0) to isotp_receive avoids a redundant copy. */
     if (ISOTP_RET_OK == isotp_receive(cfg->phys_link, NULL, 0, &out_size)) {
         iso14229CallRequestedService(self, cfg->phys_link->receive_buffer,
-                                     cfg->phys_link->receive_size);
+                                     cfg->phys_link->receive_size, false);
         self->p2_timer = iso14229UserGetms() + self->cfg->p2_ms;
         return;
     }
 
     if (ISOTP_RET_OK == isotp_receive(cfg->func_link, NULL, 0, &out_size)) {
         iso14229CallRequestedService(self, cfg->func_link->receive_buffer,
-                                     cfg->func_link->receive_size);
+                                     cfg->func_link->receive_size, true);
         self->p2_timer = iso14229UserGetms() + self->cfg->p2_ms;
         return;
     }
 }
 
-void iso14229UserPoll(Iso14229Instance *self) {
-    const Iso14229ServerConfig *cfg = self->cfg;
-
-    // Poll the ISO-TP links first to prepare available incoming data, if any.
-    isotp_poll(cfg->phys_link);
-    isotp_poll(cfg->func_link);
-
-    iso14229StateMachine(self);
+/**
+ * @brief iso14229UserPoll runs these steps in order. A step may need several
+ * calls to finish its work for the round, which lets iso14229UserPollBudget
+ * stop between any two calls. User callbacks run to completion inside a
+ * step.
+ */
+enum Iso14229PollStep {
+    kPollLinks,
+    kPollStateMachine,
+    kPollPeriodic,
+    kPollDTC,
+    kPollWriteBack,
+    kPollSecurityAccess,
+    kPollLinkControl,
+    kPollResponseOnEvent,
+    kPollMiddleware,
+    kPollOverload,
+    kPollTransport,
+    kPollNumSteps,
+};
 
-    // Run middleware if installed
-    if (NULL != cfg->middleware) {
-        cfg->middleware->pollFunc(cfg->middleware->self, self);
-    }
+/**
+ * @brief Sends the pending response once P2 has elapsed, else processes the
+ * next incoming request
+ */
+static void iso14229PollTransport(Iso14229Instance *self) {
+    const Iso14229ServerConfig *cfg = self->cfg;
 
     if (true == self->tport_send.pending) {
         /* Only send if the server P2 time has elapsed. Otherwise, return
@@ -715,6 +3476,200 @@ void iso14229UserPoll(Iso14229Instance *self) {
     }
 }
 
+/**
+ * @brief Runs the current step once
+ * @return true if the step has finished the round
+ */
+static bool iso14229PollStep(Iso14229Instance *self) {
+    const Iso14229ServerConfig *cfg = self->cfg;
+    bool done = true;
+
+    switch (self->poll.step) {
+    case kPollLinks:
+        // Poll the ISO-TP links first to prepare available incoming data, if any.
+        isotp_poll(cfg->phys_link);
+        isotp_poll(cfg->func_link);
+        self->poll.dtcBudget = ISO14229_DTC_POLL_BUDGET;
+        break;
+    case kPollStateMachine:
+        iso14229StateMachine(self);
+        break;
+    case kPollPeriodic:
+        done = iso14229PeriodicPoll(self);
+        break;
+    case kPollDTC:
+        done = iso14229DTCPoll(self);
+        break;
+    case kPollWriteBack:
+        iso14229WriteBackPoll(self);
+        break;
+    case kPollSecurityAccess:
+        iso14229SecurityAccessPoll(self);
+        break;
+    case kPollLinkControl:
+        iso14229LinkControlPoll(self);
+        break;
+    case kPollResponseOnEvent:
+        iso14229ResponseOnEventPoll(self);
+        break;
+    case kPollMiddleware:
+        // Run middleware if installed
+        if (NULL != cfg->middleware) {
+            cfg->middleware->pollFunc(cfg->middleware->self, self);
+        }
+        break;
+    case kPollOverload:
+        iso14229OverloadPoll(self);
+        break;
+    case kPollTransport:
+    default:
+        iso14229PollTransport(self);
+        break;
+    }
+
+    if (done) {
+        self->poll.step = (self->poll.step + 1) % kPollNumSteps;
+        return true;
+    }
+    return false;
+}
+
+void iso14229UserPoll(Iso14229Instance *self) {
+    // Finishes the round left unfinished by iso14229UserPollBudget, if any
+    do {
+        while (!iso14229PollStep(self))
+            ;
+    } while (kPollLinks != self->poll.step);
+}
+
+int iso14229UserPollBudget(Iso14229Instance *self, const uint32_t budget) {
+    if (NULL == self->cfg->userGetUs) {
+        iso14229UserPoll(self);
+        return 0;
+    }
+
+    const uint32_t start = self->cfg->userGetUs();
+    do {
+        iso14229PollStep(self);
+        if (kPollLinks == self->poll.step) {
+            return 0;
+        }
+    } while (self->cfg->userGetUs() - start < budget);
+    return 1;
+}
+
+/**
+ * @brief Lowers `*earliest` to the time left until `due`, the first
+ * millisecond at which the poll acts
+ */
+static void iso14229Deadline(uint32_t *earliest, const uint32_t now, const uint32_t due) {
+    const uint32_t remaining = Iso14229TimeAfter(due, now) ? due - now : 0;
+    if (remaining < *earliest) {
+        *earliest = remaining;
+    }
+}
+
+/**
+ * @brief isotp_poll acts once a timer has been passed, hence the + 1
+ */
+static void iso14229IsoTpDeadline(const IsoTpLink *link, uint32_t *earliest, const uint32_t now) {
+    if (ISOTP_SEND_STATUS_INPROGRESS == link->send_status) {
+        if (ISOTP_INVALID_BS == link->send_bs_remain || link->send_bs_remain > 0) {
+            iso14229Deadline(earliest, now, 0 == link->send_st_min ? now : link->send_timer_st + 1);
+        }
+        iso14229Deadline(earliest, now, link->send_timer_bs + 1);
+    }
+    if (ISOTP_RECEIVE_STATUS_INPROGRESS == link->receive_status) {
+        iso14229Deadline(earliest, now, link->receive_timer_cr + 1);
+    } else if (ISOTP_RECEIVE_STATUS_FULL == link->receive_status) {
+        *earliest = 0;
+    }
+}
+
+uint32_t iso14229UserNextDeadline(Iso14229Instance *self) {
+    const Iso14229ServerConfig *cfg = self->cfg;
+    const uint32_t now = iso14229UserGetms();
+    uint32_t earliest = ISO14229_NO_DEADLINE;
+
+    // A round left open by iso14229UserPollBudget
+    if (kPollLinks != self->poll.step) {
+        return 0;
+    }
+
+    iso14229IsoTpDeadline(cfg->phys_link, &earliest, now);
+    iso14229IsoTpDeadline(cfg->func_link, &earliest, now);
+
+    if (self->tport_send.pending) {
+        iso14229Deadline(&earliest, now, self->p2_timer + 1);
+    }
+    if (kDiagModeDefault != self->diag_mode) {
+        iso14229Deadline(&earliest, now, self->s3_session_timeout_timer + 1);
+    }
+    if (self->ecu_reset_requested && iso14229ResponseSent(self)) {
+        earliest = 0;
+    }
+
+    if (self->periodic.nScheduled) {
+        iso14229Deadline(&earliest, now, self->periodic.nextTick);
+    }
+
+    if (NULL != self->persistent.dtcStore.cfg) {
+        if (self->persistent.dtcStore.queueLen) {
+            earliest = 0;
+        } else if (self->persistent.dtcStore.dirty) {
+            iso14229Deadline(&earliest, now, self->persistent.dtcStore.nvmWriteTimer + 1);
+        }
+    }
+
+    if (self->writeBack.pending) {
+        iso14229Deadline(&earliest, now, self->writeBack.flushTimer + 1);
+    }
+
+    if (NULL != cfg->securityAccess) {
+        // iso14229SecurityAccessPoll refills the seed pool one seed per poll
+        if (self->security.seedPoolCount < ISO14229_SECURITY_SEED_POOL_SIZE) {
+            if (self->security.seedRetryActive) {
+                iso14229Deadline(&earliest, now, self->security.seedRetryTimer + 1);
+            } else {
+                earliest = 0;
+            }
+        }
+        if (self->security.verifyPending && !self->tport_send.pending) {
+            earliest = 0; // userVerifyKeyPoll
+        }
+        if (self->security.delayActive) {
+            iso14229Deadline(&earliest, now, self->security.delayTimer + 1);
+        }
+    }
+
+    // Otherwise waiting on the response or the ISO-TP transmission above
+    if (self->linkControl.transitionRequested && iso14229ResponseSent(self)) {
+        earliest = 0;
+    }
+
+    // Otherwise waiting on the response or the ISO-TP transmission above
+    if (self->roe.started && iso14229ResponseSent(self)) {
+        iso14229Deadline(&earliest, now, self->roe.nextSample);
+        for (uint8_t i = 0; i < ISO14229_MAX_ROE_EVENTS; i++) {
+            if (self->roe.events[i].triggered && !self->overloaded) {
+                earliest = 0;
+            }
+        }
+    }
+
+    if (NULL != cfg->middleware) {
+        Iso14229UserMiddleware *mw = cfg->middleware;
+        if (NULL != mw->nextDeadlineFunc) {
+            const uint32_t mwDeadline = mw->nextDeadlineFunc(mw->self, self);
+            if (mwDeadline < earliest) {
+                earliest = mwDeadline;
+            }
+        }
+    }
+
+    return earliest;
+}
+
 void iso14229UserReceiveCAN(Iso14229Instance *self, const uint32_t arbitration_id,
                             const uint8_t *data, const uint8_t size) {
     if (arbitration_id == self->cfg->phys_recv_id) {
@@ -727,65 +3682,268 @@ void iso14229UserReceiveCAN(Iso14229Instance *self, const uint32_t arbitration_i
 }
 
 int iso14229UserRegisterRoutine(Iso14229Instance *self, const Iso14229Routine *routine) {
-    if ((self->nRegisteredRoutines >= ISO14229_USER_DEFINED_MAX_ROUTINES) || (routine == NULL) ||
-        (routine->startRoutine == NULL)) {
+    if ((routine == NULL) || (routine->startRoutine == NULL)) {
+        return -1;
+    }
+
+    for (uint16_t i = 0; i < self->persistent.nRegisteredRoutines; i++) {
+        if (self->persistent.routines[i] == routine) {
+            return 0;
+        }
+    }
+
+    if (self->persistent.nRegisteredRoutines >= ISO14229_USER_DEFINED_MAX_ROUTINES) {
+        return -1;
+    }
+
+    self->persistent.routines[self->persistent.nRegisteredRoutines] = routine;
+    self->persistent.nRegisteredRoutines++;
+    return 0;
+}
+
+int iso14229UserRegisterIOControl(Iso14229Instance *self, const Iso14229IOControl *ioc) {
+    if ((NULL == ioc) || (NULL == ioc->ecuValue) || (NULL == ioc->override) ||
+        (NULL == ioc->active) || (0 == ioc->size) ||
+        (NULL == ioc->defaultValue &&
+         (ioc->controlParameters & ISO14229_IO_CONTROL_PARAMETER(kResetToDefault)))) {
+        return -1;
+    }
+
+    // The controlStatusRecord must fit in the response
+    if (offsetof(Iso14229PositiveResponse, type) + sizeof(InputOutputControlByIdentifierResponse) +
+            ioc->size >
+        ISO14229_TPORT_SEND_BUFSIZE) {
         return -1;
     }
 
-    self->routines[self->nRegisteredRoutines] = routine;
-    self->nRegisteredRoutines++;
+    const Iso14229IOControl *registered = iso14229FindIOControl(self, ioc->dataId);
+    if (NULL != registered) {
+        if (registered != ioc) {
+            return -1;
+        }
+        *ioc->active = ioc->ecuValue;
+        return 0;
+    }
+
+    if (self->persistent.nRegisteredIOControls >= ISO14229_MAX_IO_CONTROLS) {
+        return -1;
+    }
+
+    // Insertion keeps ioControls sorted for iso14229FindIOControl
+    uint16_t i = self->persistent.nRegisteredIOControls;
+    for (; i > 0 && self->persistent.ioControls[i - 1]->dataId > ioc->dataId; i--) {
+        self->persistent.ioControls[i] = self->persistent.ioControls[i - 1];
+    }
+    self->persistent.ioControls[i] = ioc;
+    self->persistent.nRegisteredIOControls++;
+    *ioc->active = ioc->ecuValue;
     return 0;
 }
 
 static inline void iso14229DownloadHandlerInit(Iso14229DownloadHandler *handler) {
     handler->isActive = false;
     handler->blockSequenceCounter = 1;
+    handler->hasLastBlock = false;
+    handler->decompressor = NULL;
+    handler->cipher = NULL;
+    handler->ivReceived = 0;
+}
+
+enum Iso14229ResponseCodeEnum iso14229DownloadResultsRoutine(void *userCtx,
+                                                             Iso14229RoutineControlArgs *args) {
+    const Iso14229DownloadHandler *handler = (const Iso14229DownloadHandler *)userCtx;
+    const Iso14229DownloadResults *results = &handler->results;
+    uint8_t *rec = args->statusRecord;
+
+    if (args->statusRecordBufferSize < ISO14229_DOWNLOAD_RESULTS_LEN) {
+        return kResponseTooLong;
+    }
+    rec[0] = results->requestDownloadCode;
+    rec[1] = results->firstRejectCode;
+    rec[2] = results->transferExited;
+    rec[3] = results->transferExitCode;
+    const uint32_t words[] = {results->blocksReceived, results->blocksWritten,
+                              results->firstRejectedBlock, results->imageHash};
+    for (uint8_t i = 0; i < ARRAY_SZ(words); i++) {
+        const uint32_t word = Iso14229htonl(words[i]);
+        memcpy(rec + 4 + 4 * i, &word, sizeof(word));
+    }
+    *args->statusRecordLength = ISO14229_DOWNLOAD_RESULTS_LEN;
+    return kPositiveResponse;
 }
 
 int iso14229UserRegisterDownloadHandler(Iso14229Instance *self, Iso14229DownloadHandler *handler,
                                         Iso14229DownloadHandlerConfig *cfg) {
-    if ((self->nRegisteredDownloadHandlers >= ISO14229_USER_DEFINED_MAX_DOWNLOAD_HANDLERS) ||
-        handler == NULL || cfg->onRequest == NULL || cfg->onTransfer == NULL ||
+    if (handler == NULL || cfg->onRequest == NULL || cfg->onTransfer == NULL ||
         cfg->onExit == NULL) {
         return -1;
     }
+    for (uint8_t i = 0; i < cfg->nCiphers; i++) {
+        const Iso14229Cipher *cipher = &cfg->ciphers[i];
+        if (cipher->ivLength > ISO14229_MAX_CIPHER_IV_LEN ||
+            (cipher->ivLength && NULL == cipher->setIV)) {
+            return -1;
+        }
+    }
+
+    for (uint16_t i = 0; i < self->persistent.nRegisteredDownloadHandlers; i++) {
+        if (self->persistent.downloadHandlers[i] == handler) {
+            handler->cfg = cfg;
+            iso14229DownloadHandlerInit(handler);
+            return 0;
+        }
+    }
+
+    if (self->persistent.nRegisteredDownloadHandlers >=
+        ISO14229_USER_DEFINED_MAX_DOWNLOAD_HANDLERS) {
+        return -1;
+    }
 
     handler->cfg = cfg;
     iso14229DownloadHandlerInit(handler);
 
-    self->downloadHandlers[self->nRegisteredDownloadHandlers] = handler;
-    self->nRegisteredDownloadHandlers++;
+    self->persistent.downloadHandlers[self->persistent.nRegisteredDownloadHandlers] = handler;
+    self->persistent.nRegisteredDownloadHandlers++;
     return 0;
 }
 
-typedef struct {
-    enum Iso14229DiagnosticServiceIdEnum sid;
-    void *funcptr;
-} ServiceMap;
-
-static const ServiceMap serviceMap[] = {
-    {.sid = kSID_DIAGNOSTIC_SESSION_CONTROL, .funcptr = iso14229DiagnosticSessionControl},
-    {.sid = kSID_ECU_RESET, .funcptr = iso14229ECUReset},
-    {.sid = kSID_READ_DATA_BY_IDENTIFIER, .funcptr = iso14229ReadDataByIdentifier},
-    {.sid = kSID_COMMUNICATION_CONTROL, .funcptr = iso14229CommunicationControl},
-    {.sid = kSID_WRITE_DATA_BY_IDENTIFIER, .funcptr = iso14229WriteDataByIdentifier},
-    {.sid = kSID_ROUTINE_CONTROL, .funcptr = iso14229RoutineControl},
-    {.sid = kSID_REQUEST_DOWNLOAD, .funcptr = iso14229RequestDownload},
-    {.sid = kSID_TRANSFER_DATA, .funcptr = iso14229TransferData},
-    {.sid = kSID_REQUEST_TRANSFER_EXIT, .funcptr = iso14229RequestTransferExit},
-    {.sid = kSID_TESTER_PRESENT, .funcptr = iso14229TesterPresent},
-};
+int iso14229UserAddDTC(Iso14229Instance *self, const uint32_t dtc) {
+    Iso14229DTCStore *store = &self->persistent.dtcStore;
+    if (NULL == store->cfg || store->count >= store->cfg->capacity) {
+        return -1;
+    }
 
-int iso14229UserEnableService(Iso14229Instance *self, enum Iso14229DiagnosticServiceIdEnum sid) {
-    for (int i = 0; i < ARRAY_SZ(serviceMap); i++) {
-        if (serviceMap[i].sid == sid) {
-            if (self->services[sid] == NULL) {
-                self->services[sid] = serviceMap[i].funcptr;
-                return 0;
-            } else {
-                return -2;
+    const Iso14229DTCStoreConfig *cfg = store->cfg;
+    uint16_t pos = iso14229DTCLowerBound(store, dtc);
+    if (pos < store->count && iso14229DTCAt(cfg, cfg->sortedIndex[pos]) == dtc) {
+        return -2;
+    }
+
+    const uint16_t dtcIndex = store->count;
+    iso14229StoreBE24(cfg->dtcs + 3 * dtcIndex, dtc);
+    cfg->statuses[dtcIndex] = 0;
+
+    memmove(&cfg->sortedIndex[pos + 1], &cfg->sortedIndex[pos],
+            (store->count - pos) * sizeof(cfg->sortedIndex[0]));
+    cfg->sortedIndex[pos] = dtcIndex;
+    store->count++;
+    return dtcIndex;
+}
+
+int iso14229UserReportDTCResults(Iso14229Instance *self, const Iso14229DTCReport *reports,
+                                 const uint16_t n) {
+    Iso14229DTCStore *store = &self->persistent.dtcStore;
+    uint16_t i = 0;
+
+    if (NULL == store->cfg) {
+        return 0;
+    }
+    if (store->settingOff) {
+        return n;
+    }
+
+    for (; i < n && store->queueLen < ISO14229_DTC_REPORT_QUEUE_SIZE; i++) {
+        store->queue[(store->queueHead + store->queueLen) % ISO14229_DTC_REPORT_QUEUE_SIZE] =
+            reports[i];
+        store->queueLen++;
+    }
+    return i;
+}
+
+void iso14229UserDTCOperationCycle(Iso14229Instance *self) {
+    Iso14229DTCStore *store = &self->persistent.dtcStore;
+    if (NULL == store->cfg || store->settingOff) {
+        return;
+    }
+    const Iso14229DTCStoreConfig *cfg = store->cfg;
+
+    // Results reported during the cycle that is ending belong to it
+    iso14229DTCProcessQueue(store, ISO14229_DTC_REPORT_QUEUE_SIZE);
+
+    for (uint16_t i = 0; i < store->count; i++) {
+        uint8_t status = cfg->statuses[i];
+        const bool completed =
+            !(status & ISO14229_DTC_STATUS_TEST_NOT_COMPLETED_THIS_OPERATION_CYCLE);
+        const bool failed = status & ISO14229_DTC_STATUS_TEST_FAILED_THIS_OPERATION_CYCLE;
+
+        if (completed && !failed) {
+            status &= ~ISO14229_DTC_STATUS_PENDING_DTC;
+            if ((status & ISO14229_DTC_STATUS_CONFIRMED_DTC) && NULL != cfg->agingCounters &&
+                cfg->agingThreshold && ++cfg->agingCounters[i] >= cfg->agingThreshold) {
+                status &= ~ISO14229_DTC_STATUS_CONFIRMED_DTC;
+                cfg->agingCounters[i] = 0;
             }
         }
+        status &= ~ISO14229_DTC_STATUS_TEST_FAILED_THIS_OPERATION_CYCLE;
+        status |= ISO14229_DTC_STATUS_TEST_NOT_COMPLETED_THIS_OPERATION_CYCLE;
+
+        if (status != cfg->statuses[i]) {
+            cfg->statuses[i] = status;
+            iso14229DTCMarkDirty(store, i, i);
+        }
+    }
+}
+
+int iso14229UserFindDTC(const Iso14229Instance *self, const uint32_t dtc) {
+    const Iso14229DTCStore *store = &self->persistent.dtcStore;
+    if (NULL == store->cfg) {
+        return -1;
+    }
+    uint16_t pos = iso14229DTCLowerBound(store, dtc);
+    if (pos < store->count && iso14229DTCAt(store->cfg, store->cfg->sortedIndex[pos]) == dtc) {
+        return store->cfg->sortedIndex[pos];
     }
     return -1;
 }
+
+bool iso14229UserCommunicationEnabled(const Iso14229Instance *self,
+                                      const enum Iso14229CommunicationMessageType messageType,
+                                      const bool tx) {
+    for (uint8_t i = 0; i < 2; i++) {
+        if (messageType & (1 << i)) {
+            if (tx ? self->communication[i].txDisabled : self->communication[i].rxDisabled) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+#if ISO14229_DEFAULT_SERVICE_TABLE
+const Iso14229Service iso14229DefaultServiceTable[ISO14229_MAX_DIAGNOSTIC_SERVICES] = {
+    [ISO14229_SID_INDEX(kSID_DIAGNOSTIC_SESSION_CONTROL)] = iso14229DiagnosticSessionControl,
+    [ISO14229_SID_INDEX(kSID_ECU_RESET)] = iso14229ECUReset,
+    [ISO14229_SID_INDEX(kSID_CLEAR_DIAGNOSTIC_INFORMATION)] = iso14229ClearDiagnosticInformation,
+    [ISO14229_SID_INDEX(kSID_READ_DTC_INFORMATION)] = iso14229ReadDTCInformation,
+    [ISO14229_SID_INDEX(kSID_READ_DATA_BY_IDENTIFIER)] = iso14229ReadDataByIdentifier,
+    [ISO14229_SID_INDEX(kSID_SECURITY_ACCESS)] = iso14229SecurityAccess,
+    [ISO14229_SID_INDEX(kSID_COMMUNICATION_CONTROL)] = iso14229CommunicationControl,
+    [ISO14229_SID_INDEX(kSID_READ_DATA_BY_PERIODIC_IDENTIFIER)] =
+        iso14229ReadDataByPeriodicIdentifier,
+    [ISO14229_SID_INDEX(kSID_DYNAMICALLY_DEFINE_DATA_IDENTIFIER)] =
+        iso14229DynamicallyDefineDataIdentifier,
+    [ISO14229_SID_INDEX(kSID_WRITE_DATA_BY_IDENTIFIER)] = iso14229WriteDataByIdentifier,
+    [ISO14229_SID_INDEX(kSID_INPUT_OUTPUT_CONTROL_BY_IDENTIFIER)] =
+        iso14229InputOutputControlByIdentifier,
+    [ISO14229_SID_INDEX(kSID_ROUTINE_CONTROL)] = iso14229RoutineControl,
+    [ISO14229_SID_INDEX(kSID_REQUEST_DOWNLOAD)] = iso14229RequestDownload,
+    [ISO14229_SID_INDEX(kSID_TRANSFER_DATA)] = iso14229TransferData,
+    [ISO14229_SID_INDEX(kSID_REQUEST_TRANSFER_EXIT)] = iso14229RequestTransferExit,
+    [ISO14229_SID_INDEX(kSID_TESTER_PRESENT)] = iso14229TesterPresent,
+    [ISO14229_SID_INDEX(kSID_CONTROL_DTC_SETTING)] = iso14229ControlDTCSetting,
+    [ISO14229_SID_INDEX(kSID_RESPONSE_ON_EVENT)] = iso14229ResponseOnEvent,
+    [ISO14229_SID_INDEX(kSID_LINK_CONTROL)] = iso14229LinkControl,
+};
+#endif
+
+int iso14229UserEnableService(Iso14229Instance *self, enum Iso14229DiagnosticServiceIdEnum sid) {
+    const uint8_t idx = ISO14229_SID_INDEX(sid);
+    if (!ISO14229_SID_IS_REQUEST(sid) || NULL == iso14229ServiceTable(self)[idx]) {
+        return -1;
+    }
+    if (self->persistent.enabledServices[idx / 32] & (1UL << (idx % 32))) {
+        return -2;
+    }
+    self->persistent.enabledServices[idx / 32] |= 1UL << (idx % 32);
+    return 0;
+}
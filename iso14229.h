@@ -3,33 +3,53 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include "iso14229_config.h"
 #include "isotp/isotp.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /* returns true if `a` is after `b` */
 #define Iso14229TimeAfter(a, b) ((int32_t)((int32_t)(b) - (int32_t)(a)) < 0)
 
+/* iso14229UserNextDeadline: nothing is scheduled */
+#define ISO14229_NO_DEADLINE UINT32_MAX
+
 /**
  * @defgroup ISO14229Standardized ISO14229 Mandated Step
  * @defgroup ISO14229Optional ISO14229 Optional/Recommended Step
  * @defgroup ISO14229MfgSpecific ISO14229 Manufacturer Specific Step
  */
 
-// ISO-14229-1:2013 Table 2
-#define ISO14229_MAX_DIAGNOSTIC_SERVICES 0x7F
+// ISO-14229-1:2013 Table 2: request SIDs occupy 0x00-0x3F and 0x80-0xBF. Bit
+// 6 marks a response SID and is dropped to form a dense service index.
+#define ISO14229_MAX_DIAGNOSTIC_SERVICES 0x80
+#define ISO14229_SID_IS_REQUEST(sid) (0 == ((sid)&0x40))
+#define ISO14229_SID_INDEX(sid) ((((sid)&0x80) >> 1) | ((sid)&0x3F))
 
 enum Iso14229DiagnosticServiceIdEnum {
     // ISO 14229-1 service requests
     kSID_DIAGNOSTIC_SESSION_CONTROL = 0x10,
     kSID_ECU_RESET = 0x11,
+    kSID_CLEAR_DIAGNOSTIC_INFORMATION = 0x14,
+    kSID_READ_DTC_INFORMATION = 0x19,
     kSID_READ_DATA_BY_IDENTIFIER = 0x22,
+    kSID_SECURITY_ACCESS = 0x27,
     kSID_COMMUNICATION_CONTROL = 0x28,
+    kSID_READ_DATA_BY_PERIODIC_IDENTIFIER = 0x2A,
+    kSID_DYNAMICALLY_DEFINE_DATA_IDENTIFIER = 0x2C,
     kSID_WRITE_DATA_BY_IDENTIFIER = 0x2E,
+    kSID_INPUT_OUTPUT_CONTROL_BY_IDENTIFIER = 0x2F,
     kSID_ROUTINE_CONTROL = 0x31,
     kSID_REQUEST_DOWNLOAD = 0x34,
     kSID_TRANSFER_DATA = 0x36,
     kSID_REQUEST_TRANSFER_EXIT = 0x37,
     kSID_TESTER_PRESENT = 0x3E,
+    kSID_CONTROL_DTC_SETTING = 0x85,
+    kSID_RESPONSE_ON_EVENT = 0x86,
+    kSID_LINK_CONTROL = 0x87,
     // ...
 };
 
@@ -103,13 +123,64 @@ typedef struct {
     uint8_t powerDownTime;
 } __attribute__((packed)) ECUResetResponse;
 
+typedef struct {
+} __attribute__((packed)) ClearDiagnosticInformationResponse;
+
+// ISO14229-1:2013 Table D.14: groupOfDTC
+#define ISO14229_GROUP_OF_ALL_DTCS 0xFFFFFF
+
+// ISO14229-1:2013 D.2: statusOfDTC bits
+#define ISO14229_DTC_STATUS_TEST_FAILED 0x01
+#define ISO14229_DTC_STATUS_TEST_FAILED_THIS_OPERATION_CYCLE 0x02
+#define ISO14229_DTC_STATUS_PENDING_DTC 0x04
+#define ISO14229_DTC_STATUS_CONFIRMED_DTC 0x08
+#define ISO14229_DTC_STATUS_TEST_NOT_COMPLETED_SINCE_LAST_CLEAR 0x10
+#define ISO14229_DTC_STATUS_TEST_FAILED_SINCE_LAST_CLEAR 0x20
+#define ISO14229_DTC_STATUS_TEST_NOT_COMPLETED_THIS_OPERATION_CYCLE 0x40
+#define ISO14229_DTC_STATUS_WARNING_INDICATOR_REQUESTED 0x80
+
+enum Iso14229ReadDTCInformationReportType {
+    kReportNumberOfDTCByStatusMask = 0x01,
+    kReportDTCByStatusMask = 0x02,
+    kReportDTCSnapshotRecordByDTCNumber = 0x04,
+    kReportDTCExtDataRecordByDTCNumber = 0x06,
+    kReportSupportedDTC = 0x0A,
+};
+
+// ISO14229-1:2013 Table D.1: DTCFormatIdentifier
+#define ISO14229_DTC_FORMAT_ISO14229_1 0x01
+
+typedef struct {
+    uint8_t reportType;
+    uint8_t data[];
+} __attribute__((packed)) ReadDTCInformationResponse;
+
+typedef struct {
+    uint8_t securityAccessType;
+    uint8_t securitySeed[];
+} __attribute__((packed)) SecurityAccessResponse;
+
 enum Iso1422CommunicationControlType {
     kEnableRxAndTx = 0,
     kEnableRxAndDisableTx = 1,
     kDisableRxAndEnableTx = 2,
     kDisableRxAndTx = 3,
+    kEnableRxAndDisableTxWithEnhancedAddressInformation = 4,
+    kEnableRxAndTxWithEnhancedAddressInformation = 5,
 };
 
+// ISO14229-1:2013 Table B.1: bits 1-0 of communicationType
+enum Iso14229CommunicationMessageType {
+    kNormalCommunicationMessages = 1,
+    kNetworkManagementCommunicationMessages = 2,
+    kNormalAndNetworkManagementCommunicationMessages = 3,
+};
+
+// ISO14229-1:2013 Table B.1: bits 7-4 of communicationType. 0x1-0xE select
+// a specific subnet.
+#define ISO14229_COMM_SUBNET_ALL 0x0
+#define ISO14229_COMM_SUBNET_RECEIVING 0xF
+
 typedef struct {
     uint8_t controlType;
 } __attribute__((packed)) CommunicationControlResponse;
@@ -117,10 +188,45 @@ typedef struct {
 typedef struct {
 } __attribute__((packed)) ReadDataByIdentifierResponse;
 
+enum Iso14229PeriodicTransmissionMode {
+    kSendAtSlowRate = 1,
+    kSendAtMediumRate = 2,
+    kSendAtFastRate = 3,
+    kStopSending = 4,
+};
+
+typedef struct {
+} __attribute__((packed)) ReadDataByPeriodicIdentifierResponse;
+
+enum Iso14229DynamicallyDefineDataIdentifierType {
+    kDefineByIdentifier = 1,
+    kDefineByMemoryAddress = 2,
+    kClearDynamicallyDefinedDataIdentifier = 3,
+};
+
+typedef struct {
+    uint8_t definitionType;
+    uint16_t dynamicallyDefinedDataIdentifier;
+} __attribute__((packed)) DynamicallyDefineDataIdentifierResponse;
+
 typedef struct {
     uint16_t dataId;
 } __attribute__((packed)) WriteDataByIdentifierResponse;
 
+// ISO14229-1:2013 inputOutputControlParameter
+enum Iso14229InputOutputControlParameter {
+    kReturnControlToECU = 0x00,
+    kResetToDefault = 0x01,
+    kFreezeCurrentState = 0x02,
+    kShortTermAdjustment = 0x03,
+};
+
+typedef struct {
+    uint16_t dataId;
+    uint8_t inputOutputControlParameter;
+    uint8_t controlState[];
+} __attribute__((packed)) InputOutputControlByIdentifierResponse;
+
 typedef struct {
     uint8_t routineControlType;
     uint16_t routineIdentifier;
@@ -146,6 +252,72 @@ typedef struct {
     uint8_t zeroSubFunction;
 } __attribute__((packed)) TesterPresentResponse;
 
+enum Iso14229DTCSettingType {
+    kDTCSettingOn = 1,
+    kDTCSettingOff = 2,
+};
+
+typedef struct {
+    uint8_t DTCSettingType;
+} __attribute__((packed)) ControlDTCSettingResponse;
+
+// ISO14229-1:2013 ResponseOnEvent eventType
+enum Iso14229ResponseOnEventType {
+    kStopResponseOnEvent = 0x00,
+    kOnDTCStatusChange = 0x01,
+    kOnTimerInterrupt = 0x02,
+    kOnChangeOfDataIdentifier = 0x03,
+    kReportActivatedEvents = 0x04,
+    kStartResponseOnEvent = 0x05,
+    kClearResponseOnEvent = 0x06,
+    kOnComparisonOfValues = 0x07,
+};
+
+// bit 6 of eventType: storeEvent (set) or doNotStoreEvent (clear)
+#define ISO14229_ROE_STORE_EVENT 0x40
+
+// ISO14229-1:2013 ResponseOnEvent eventWindowTime
+#define ISO14229_ROE_INFINITE_TIME_TO_RESPONSE 0x02
+
+// ISO14229-1:2013 ResponseOnEvent comparisonLogic
+enum Iso14229ROEComparisonLogic {
+    kROELessThan = 0x01,
+    kROELargerThan = 0x02,
+    kROEEqual = 0x03,
+    kROENotEqual = 0x04,
+};
+
+typedef struct {
+    uint8_t eventType;
+    uint8_t numberOfIdentifiedEvents;
+    uint8_t eventWindowTime;
+    uint8_t eventTypeRecord[]; // followed by serviceToRespondToRecord
+} __attribute__((packed)) ResponseOnEventResponse;
+
+enum Iso14229LinkControlType {
+    kVerifyModeTransitionWithFixedParameter = 0x01,
+    kVerifyModeTransitionWithSpecificParameter = 0x02,
+    kTransitionMode = 0x03,
+};
+
+// ISO14229-1:2013 Table B.3 linkControlModeIdentifier
+enum Iso14229LinkControlModeIdentifier {
+    kLinkControlPC9600Baud = 0x01,
+    kLinkControlPC19200Baud = 0x02,
+    kLinkControlPC38400Baud = 0x03,
+    kLinkControlPC57600Baud = 0x04,
+    kLinkControlPC115200Baud = 0x05,
+    kLinkControlCAN125000Baud = 0x10,
+    kLinkControlCAN250000Baud = 0x11,
+    kLinkControlCAN500000Baud = 0x12,
+    kLinkControlCAN1000000Baud = 0x13,
+    kLinkControlProgrammingSetup = 0x20,
+};
+
+typedef struct {
+    uint8_t linkControlType;
+} __attribute__((packed)) LinkControlResponse;
+
 typedef struct {
     const uint8_t *optionRecord;
     const uint16_t optionRecordLength;
@@ -166,6 +338,29 @@ typedef struct Iso14229Routine {
     void *userCtx; // Pointer to user data
 } Iso14229Routine;
 
+/**
+ * @brief A signal controllable with 0x2F InputOutputControlByIdentifier. The
+ * application reads the signal through `*active`, which points either to its
+ * own value or to the tester's override, so an override takes effect as soon
+ * as the request has been processed.
+ */
+typedef struct {
+    uint16_t dataId;
+    uint16_t size;               // size of the signal in bytes
+    const uint8_t *ecuValue;     // the value computed by the application
+    const uint8_t *defaultValue; // resetToDefault. NULL: not supported
+    uint8_t *override;           // size bytes written by all parameters but returnControlToECU
+    const uint8_t **active;      // *active is ecuValue or override
+    // bit n set: inputOutputControlParameter n is supported
+    uint8_t controlParameters;
+    // bits that shortTermAdjustment may change, the others keep their
+    // current value. NULL: all bits
+    const uint8_t *adjustMask;
+} Iso14229IOControl;
+
+#define ISO14229_IO_CONTROL_PARAMETER(p) (1 << (p))
+#define ISO14229_ALL_IO_CONTROL_PARAMETERS 0x0F
+
 typedef struct Iso14229Instance Iso14229Instance;
 
 /*
@@ -175,6 +370,7 @@ typedef struct {
     const uint8_t *buf; // service data
     uint16_t size;      // size of service data (not including service ID)
     uint8_t sid;        // the service ID
+    bool functional;    // received on the functional link
 } Iso14229ServiceRequest;
 
 typedef void (*Iso14229Service)(Iso14229Instance *self, const Iso14229ServiceRequest *req);
@@ -188,14 +384,23 @@ typedef struct {
 union Iso14229AllResponseTypes {
     DiagnosticSessionControlResponse diagnosticSessionControl;
     ECUResetResponse ecuReset;
+    ClearDiagnosticInformationResponse clearDiagnosticInformation;
+    ReadDTCInformationResponse readDTCInformation;
+    SecurityAccessResponse securityAccess;
     CommunicationControlResponse communicationControl;
     ReadDataByIdentifierResponse readDataByIdentifier;
+    ReadDataByPeriodicIdentifierResponse readDataByPeriodicIdentifier;
+    DynamicallyDefineDataIdentifierResponse dynamicallyDefineDataIdentifier;
     WriteDataByIdentifierResponse writeDataByIdentifier;
+    InputOutputControlByIdentifierResponse inputOutputControlByIdentifier;
     RoutineControlResponse routineControl;
     RequestDownloadResponse requestDownload;
     TransferDataResponse transferData;
     RequestTransferExitResponse requestTransferExit;
     TesterPresentResponse testerPresent;
+    ControlDTCSettingResponse controlDTCSetting;
+    ResponseOnEventResponse responseOnEvent;
+    LinkControlResponse linkControl;
 };
 
 typedef struct {
@@ -203,6 +408,117 @@ typedef struct {
     union Iso14229AllResponseTypes type;
 } Iso14229PositiveResponse;
 
+#define ISO14229_CACHE_TTL_UNTIL_INVALIDATED 0
+
+/**
+ * @brief A 0x22 ReadDataByIdentifier data identifier whose responses may be
+ * cached
+ */
+typedef struct {
+    uint16_t dataId;
+    uint32_t ttl_ms; // ISO14229_CACHE_TTL_UNTIL_INVALIDATED: no expiry
+} Iso14229CacheRule;
+
+typedef struct {
+    uint8_t key[ISO14229_RESPONSE_CACHE_KEY_LEN]; // the request, SID included
+    uint8_t keyLen;                                // 0: unused
+    uint16_t responseLen;
+    bool expires;
+    uint32_t expiry;
+    uint32_t lastUsed;
+} Iso14229CacheEntry;
+
+/**
+ * @brief Cache of encoded 0x22 ReadDataByIdentifier responses keyed by the
+ * request bytes. A request is cached if each of its data identifiers has a
+ * rule and expires with the shortest TTL among them. A cached response is
+ * handed to the ISO-TP layer as soon as the request arrives, without calling
+ * userRDBIHandler or waiting for P2. Entries are invalidated by 0x2E, 0x2F
+ * and 0x2C on their data identifiers, by any session or security level
+ * change, and by iso14229UserInvalidateCache/iso14229UserInvalidateCachedDID
+ * for data that changes behind the server's back. The least recently used
+ * entry is replaced when the cache is full. All arrays are provided by the
+ * user.
+ */
+typedef struct {
+    const Iso14229CacheRule *rules; // sorted by dataId
+    uint16_t nRules;
+    Iso14229CacheEntry *entries;
+    uint8_t *responses;    // nEntries * responseSize bytes
+    uint16_t responseSize; // largest response that can be cached, SID included
+    uint8_t nEntries;
+} Iso14229ResponseCacheConfig;
+
+/**
+ * @brief A data identifier written through Iso14229WriteBackConfig
+ */
+typedef struct {
+    uint16_t dataId;
+    uint16_t size;    // 0x2E requests must carry exactly this many bytes
+    uint8_t *shadow;  // size bytes of RAM holding the current value
+    uint32_t nvmAddr; // passed through to userNvmWrite
+} Iso14229WriteBackDID;
+
+/**
+ * @brief Write-back layer for 0x2E WriteDataByIdentifier. A write to one of
+ * these data identifiers only updates its RAM shadow, and 0x22 reads the
+ * shadow back. Dirty data identifiers are written to NVM together no sooner
+ * than nvmWriteDelay_ms after the first unsaved write, so repeated writes to
+ * a data identifier cost one NVM write. Pending writes are flushed
+ * immediately when a non-default session ends and before 0x11 ECUReset calls
+ * userHardReset. Other data identifiers are passed to userWDBIHandler.
+ * Shadows must be loaded from NVM by the user before iso14229UserInit.
+ */
+typedef struct {
+    const Iso14229WriteBackDID *dids; // sorted by dataId
+    uint16_t nDIDs;                   // <= ISO14229_MAX_WRITE_BACK_DIDS
+    uint16_t nvmWriteDelay_ms;
+
+    /**
+     * @brief rejects a write before it reaches the shadow. Same permitted
+     * responses as userWDBIHandler. Optional.
+     */
+    enum Iso14229ResponseCodeEnum (*userWriteCheck)(uint16_t dataId, const uint8_t *data,
+                                                    uint16_t len);
+
+    /**
+     * @brief writes `did->shadow` to NVM. Return 0 on success, otherwise the
+     * data identifier stays dirty and is retried after another
+     * nvmWriteDelay_ms. NULL if the shadows are themselves mapped onto NVM.
+     */
+    int (*userNvmWrite)(const Iso14229WriteBackDID *did);
+
+    /**
+     * @brief commits the writes of one flush, e.g. msync. Optional.
+     */
+    int (*userNvmSync)(void);
+} Iso14229WriteBackConfig;
+
+typedef struct {
+    uint32_t high; // overloaded from this load on. 0: this load is not monitored
+    uint32_t low;  // recovered at or below this load
+} Iso14229LoadThreshold;
+
+/**
+ * @brief Overload protection. The server becomes overloaded when any load
+ * reaches its high threshold and recovers once every load is back at or below
+ * its low threshold. While overloaded, requests other than 0x3E TesterPresent
+ * are answered with 0x21 busyRepeatRequest without being processed, and
+ * 0x86 ResponseOnEvent responses are held back.
+ */
+typedef struct {
+    // DTC test results waiting to be processed by iso14229UserPoll
+    Iso14229LoadThreshold queueDepth;
+    // asynchronous operations in progress: 0x27 key verification, 0x87
+    // transition, 0x86 responses due, plus userGetPendingWork
+    Iso14229LoadThreshold pendingWork;
+    // userGetBacklog, e.g. bytes not yet written to flash
+    Iso14229LoadThreshold backlog;
+
+    uint32_t (*userGetPendingWork)(void); // Optional
+    uint32_t (*userGetBacklog)(void);     // Optional
+} Iso14229OverloadConfig;
+
 typedef struct {
     uint16_t buf_len_used;
     bool pending;
@@ -213,6 +529,89 @@ typedef struct {
     } buf;
 } TportSend;
 
+/**
+ * @brief receives the decompressed data of 0x36 TransferData. `data` may be
+ * the decompressor's history, so it is read-only.
+ */
+typedef enum Iso14229ResponseCodeEnum (*Iso14229TransferSink)(void *sinkCtx,
+                                                              const uint8_t *data, uint32_t len);
+
+/**
+ * @brief Streaming decompressor for 0x36 TransferData. Selected by the
+ * compressionMethod in the high nibble of the dataFormatIdentifier sent with
+ * 0x34 RequestDownload. The memorySize of the request is the size after
+ * decompression.
+ */
+typedef struct {
+    uint8_t compressionMethod; // 0x1-0xF, vehicle manufacturer specific
+
+    /**
+     * @brief prepares for a new stream. Called by 0x34 RequestDownload
+     * before onRequest. A failure is answered with conditionsNotCorrect
+     * @return 0 on success
+     */
+    int (*init)(void *ctx);
+
+    /**
+     * @brief decompresses one block of TransferData. All of `data` must be
+     * consumed and the output passed to `sink` before returning. Permitted
+     * responses:
+     *  0x00 positiveResponse
+     *  0x31 requestOutOfRange: the data cannot be decompressed
+     *  any response returned by `sink`
+     */
+    enum Iso14229ResponseCodeEnum (*decompress)(void *ctx, const uint8_t *data, uint32_t len,
+                                                Iso14229TransferSink sink, void *sinkCtx);
+
+    /**
+     * @brief called by 0x37 RequestTransferExit
+     * @return 0 if the stream ended completely
+     */
+    int (*finish)(void *ctx);
+
+    void *ctx;
+} Iso14229Decompressor;
+
+/**
+ * @brief Streaming decryption for 0x36 TransferData. Selected by the
+ * encryptingMethod in the low nibble of the dataFormatIdentifier sent with
+ * 0x34 RequestDownload. Runs before the decompressor.
+ */
+typedef struct {
+    uint8_t encryptingMethod; // 0x1-0xF, vehicle manufacturer specific
+
+    /**
+     * @brief prepares for a new stream. Called by 0x34 RequestDownload
+     * before onRequest. A failure is answered with conditionsNotCorrect
+     * @return 0 on success
+     */
+    int (*init)(void *ctx);
+
+    /**
+     * @brief length of the initialization vector sent ahead of the
+     * ciphertext, at most ISO14229_MAX_CIPHER_IV_LEN. 0: none. The IV is
+     * taken from the start of the transfer stream, passed to setIV and not
+     * decrypted.
+     */
+    uint8_t ivLength;
+
+    /**
+     * @brief called once the IV of a download has been received
+     * @return 0 on success. Otherwise the download is aborted with 0x31
+     * requestOutOfRange, e.g. for an IV that was used before.
+     */
+    int (*setIV)(void *ctx, const uint8_t *iv);
+
+    /**
+     * @brief decrypts one block of TransferData in place. The cipher state
+     * (e.g. the CTR keystream position) carries over to the next block.
+     * @return 0 on success
+     */
+    int (*decrypt)(void *ctx, uint8_t *data, uint32_t len);
+
+    void *ctx;
+} Iso14229Cipher;
+
 /**
  * @brief User-Defined handler for 0x34 RequestDownload, 0x36 TransferData, and
  * 0x37 RequestTransferExit
@@ -221,19 +620,70 @@ typedef struct {
 typedef struct {
     /**
      * @brief
+     * @param memoryAddress memoryAddress of the request, 1 to 8 bytes long
+     * @param memorySize memorySize of the request, 1 to 8 bytes long
      * @param maxNumberOfBlockLength maximum chunk size that the client can
      * accept in bytes
      * @return one of [kPositiveResponse, kRequestOutOfRange]
      */
     enum Iso14229ResponseCodeEnum (*onRequest)(void *userCtx, const uint8_t dataFormatIdentifier,
-                                               const void *memoryAddress, const size_t memorySize,
+                                               const uint64_t memoryAddress,
+                                               const uint64_t memorySize,
                                                uint16_t *maxNumberOfBlockLength);
+    /**
+     * @brief receives the image data of 0x36 TransferData. Without a
+     * decompressor `data` is the receive buffer and may be modified in place.
+     * With one it is the decompressor's history and must not be modified.
+     */
     enum Iso14229ResponseCodeEnum (*onTransfer)(void *userCtx, uint8_t *data, uint32_t len);
     enum Iso14229ResponseCodeEnum (*onExit)(void *userCtx);
 
     void *userCtx;
+
+    /**
+     * @brief supported compression methods. Optional. Downloads with
+     * compressionMethod 0 are passed to onTransfer unchanged.
+     */
+    const Iso14229Decompressor *decompressors;
+    uint8_t nDecompressors;
+
+    /**
+     * @brief supported encrypting methods. Optional. Downloads with
+     * encryptingMethod 0 are not decrypted.
+     */
+    const Iso14229Cipher *ciphers;
+    uint8_t nCiphers;
+
+    /**
+     * @brief multicast programming of identical ECUs. 0x34, 0x36 and 0x37
+     * received on the functional link are processed without sending any
+     * response, positive or negative. The client collects the outcome
+     * afterwards with physical addressing through
+     * iso14229DownloadResultsRoutine.
+     * @note every server answers the FirstFrame with a FlowControl, so the
+     * client must pace the ConsecutiveFrames for the slowest of them.
+     */
+    bool functional;
 } Iso14229DownloadHandlerConfig;
 
+/**
+ * @brief Outcome of the last download, kept after it ends. Reset by 0x34
+ * RequestDownload.
+ */
+typedef struct {
+    uint8_t requestDownloadCode; // response code of 0x34 RequestDownload
+    uint8_t firstRejectCode;     // response code of the first rejected 0x36, 0: none
+    bool transferExited;         // 0x37 RequestTransferExit was received
+    uint8_t transferExitCode;    // response code of 0x37 RequestTransferExit
+    uint32_t blocksReceived;     // 0x36 requests, repeats and rejected blocks included
+    uint32_t blocksWritten;      // blocks passed to onTransfer
+    uint32_t firstRejectedBlock; // index of the first rejected 0x36 among blocksReceived
+    uint32_t imageHash;          // 32 bit FNV-1a of the data passed to onTransfer
+} Iso14229DownloadResults;
+
+// length of the status record written by iso14229DownloadResultsRoutine
+#define ISO14229_DOWNLOAD_RESULTS_LEN 20
+
 typedef struct {
     const Iso14229DownloadHandlerConfig *cfg;
 
@@ -247,8 +697,320 @@ typedef struct {
      * transfer is active
      */
     bool isActive;
+
+    // the last block written, to recognize a repeat after a lost response
+    bool hasLastBlock;
+    uint16_t lastBlockLen;
+    uint32_t lastBlockHash;
+
+    Iso14229DownloadResults results;
+
+    // decompressor selected by RequestDownload, NULL if uncompressed
+    const Iso14229Decompressor *decompressor;
+
+    // cipher selected by RequestDownload, NULL if unencrypted
+    const Iso14229Cipher *cipher;
+    uint8_t iv[ISO14229_MAX_CIPHER_IV_LEN];
+    uint8_t ivReceived; // bytes of cipher->ivLength received so far
 } Iso14229DownloadHandler;
 
+/**
+ * @brief One element of a 0x2C dynamically defined data identifier's gather
+ * list. The source offset (positionInSourceDataRecord or memoryAddress) is
+ * resolved when the definition is made, so reading the DID is a copy loop.
+ */
+typedef struct {
+    const uint8_t *src;
+    uint16_t len;
+} Iso14229DynamicDIDEntry;
+
+typedef struct {
+    uint16_t dataId;
+    uint16_t firstEntry; // index of the first gather list entry in the arena
+    uint16_t nEntries;
+    uint16_t size; // total data record size in bytes
+} Iso14229DynamicDID;
+
+/**
+ * @brief 0x2C DynamicallyDefineDataIdentifier definitions. The gather lists
+ * of all DIDs share one arena, stored contiguously in definition order.
+ */
+typedef struct {
+    Iso14229DynamicDID dids[ISO14229_MAX_DYNAMIC_DIDS];
+    uint8_t nDIDs;
+    Iso14229DynamicDIDEntry arena[ISO14229_DYNAMIC_DID_ARENA_SIZE];
+    uint16_t nEntries;
+} Iso14229DynamicDIDTable;
+
+// onComparisonOfValues: DID, comparisonLogic, comparisonRefValue,
+// hysteresisValue, localization
+#define ISO14229_ROE_EVENT_TYPE_RECORD_LEN 10
+
+/**
+ * @brief An event set up by 0x86 ResponseOnEvent. The data identifier is
+ * sampled from iso14229UserPoll while events are started.
+ */
+typedef struct {
+    uint8_t eventType; // 0: unused
+    uint8_t eventWindowTime;
+    uint8_t eventTypeRecord[ISO14229_ROE_EVENT_TYPE_RECORD_LEN];
+    uint8_t eventTypeRecordLen;
+    uint8_t serviceToRespondToRecord[ISO14229_ROE_MAX_SERVICE_RECORD_LEN];
+    uint8_t serviceToRespondToRecordLen;
+    bool sampled;    // a reference sample has been taken since the events were started
+    bool armed;      // onComparisonOfValues: the condition has cleared since the last event
+    bool triggered;  // the response to serviceToRespondToRecord is due
+    uint32_t hash;   // onChangeOfDataIdentifier: FNV-1a hash of the last data record
+} Iso14229ROEEvent;
+
+typedef struct {
+    Iso14229ROEEvent events[ISO14229_MAX_ROE_EVENTS];
+    bool started;
+    uint32_t nextSample;
+} Iso14229ResponseOnEvent;
+
+#define ISO14229_PERIODIC_NIL 0xFF
+
+/**
+ * @brief A periodic data identifier scheduled by 0x2A
+ * ReadDataByPeriodicIdentifier
+ */
+typedef struct {
+    uint8_t periodicDataId; // low byte of the 0xF2xx data identifier
+    uint8_t transmissionMode;
+    uint8_t next;    // next entry in the same wheel slot or ISO14229_PERIODIC_NIL
+    uint16_t rounds; // wheel revolutions left before this entry is due
+} Iso14229PeriodicDID;
+
+/**
+ * @brief hashed timer wheel. Each slot is a singly linked list of entries.
+ */
+typedef struct {
+    Iso14229PeriodicDID entries[ISO14229_MAX_PERIODIC_DIDS];
+    uint8_t slots[ISO14229_PERIODIC_WHEEL_SLOTS]; // list heads
+    uint8_t cursor;                               // slot of the last processed tick
+    uint8_t nScheduled;
+    uint32_t nextTick; // time at which the slot after `cursor` is due
+} Iso14229PeriodicScheduler;
+
+/**
+ * @brief Storage for the DTC store used by 0x19 ReadDTCInformation. All
+ * arrays are provided by the user and hold `capacity` DTCs as a struct of
+ * arrays so that status mask queries scan a dense byte array.
+ */
+typedef struct {
+    uint8_t *dtcs;         // 3 bytes per DTC, big-endian, in insertion order
+    uint8_t *statuses;     // statusOfDTC, one byte per DTC
+    uint16_t *sortedIndex; // DTC indices ordered by DTC number for lookups
+    uint16_t capacity;
+
+    uint8_t statusAvailabilityMask; // status bits supported by this server
+
+    /**
+     * @brief user-provided 0x19 0x04 reportDTCSnapshotRecordByDTCNumber
+     * handler. Writes the DTCSnapshotRecordNumber/DTCSnapshotRecord pairs
+     * matching `recordNumber` (0xFF: all) for the DTC at `dtcIndex`. Permitted
+     * responses:
+     *  0x00 positiveResponse
+     *  0x14 responseTooLong
+     *  0x31 requestOutOfRange
+     * @note if NULL, the report type is not supported
+     */
+    enum Iso14229ResponseCodeEnum (*userReadSnapshotRecord)(uint16_t dtcIndex,
+                                                            uint8_t recordNumber, uint8_t *buf,
+                                                            uint16_t bufSize, uint16_t *len);
+
+    /**
+     * @brief user-provided 0x19 0x06 reportDTCExtDataRecordByDTCNumber
+     * handler. Same contract as userReadSnapshotRecord with
+     * DTCExtDataRecordNumber/DTCExtDataRecord pairs.
+     */
+    enum Iso14229ResponseCodeEnum (*userReadExtDataRecord)(uint16_t dtcIndex,
+                                                           uint8_t recordNumber, uint8_t *buf,
+                                                           uint16_t bufSize, uint16_t *len);
+
+    /**
+     * @brief Debouncing (ISO14229-1:2013 Figure D.4). Each DTC has a fault
+     * detection counter in [-128, 127]. PREFAILED/PREPASSED results move it by
+     * prefailedStep/prepassedStep, FAILED/PASSED results move it to the limit.
+     * testFailed is set at 127 and cleared at -128. Optional: if NULL, or if
+     * a step is 0, every result is final.
+     */
+    int8_t *faultDetectionCounters;
+    uint8_t prefailedStep;
+    uint8_t prepassedStep;
+
+    /**
+     * @brief Aging: confirmedDTC is cleared after agingThreshold operation
+     * cycles that completed without a failure. Optional: if NULL or if
+     * agingThreshold is 0, confirmed DTCs don't age.
+     */
+    uint8_t *agingCounters;
+    uint8_t agingThreshold;
+
+    /**
+     * @brief called by 0x14 ClearDiagnosticInformation so the user can erase
+     * snapshot and extended data. dtcIndex is -1 when all DTCs are cleared.
+     * Optional.
+     */
+    void (*userOnDTCCleared)(int dtcIndex);
+
+    /**
+     * @brief write-behind persistence of statusOfDTC. Status changes are
+     * coalesced and written as a single range no sooner than
+     * nvmWriteDelay_ms after the first unsaved change. Return 0 on success,
+     * otherwise the write is retried after another nvmWriteDelay_ms.
+     * Optional.
+     */
+    int (*userNvmWriteStatuses)(uint16_t firstDtcIndex, const uint8_t *statuses, uint16_t n);
+    uint16_t nvmWriteDelay_ms;
+} Iso14229DTCStoreConfig;
+
+enum Iso14229DTCTestResult {
+    kDTCTestPassed = 0,
+    kDTCTestFailed,
+    kDTCTestPrePassed,
+    kDTCTestPreFailed,
+};
+
+typedef struct {
+    uint16_t dtcIndex;
+    uint8_t result; // enum Iso14229DTCTestResult
+} Iso14229DTCReport;
+
+typedef struct {
+    const Iso14229DTCStoreConfig *cfg;
+    uint16_t count;
+
+    // test results waiting to be processed by iso14229UserPoll
+    Iso14229DTCReport queue[ISO14229_DTC_REPORT_QUEUE_SIZE];
+    uint16_t queueHead;
+    uint16_t queueLen;
+
+    bool settingOff; // 0x85 ControlDTCSetting
+
+    // statuses in [dirtyFirst, dirtyLast] are not yet persisted
+    bool dirty;
+    uint16_t dirtyFirst;
+    uint16_t dirtyLast;
+    uint32_t nvmWriteTimer;
+} Iso14229DTCStore;
+
+/**
+ * @brief 0x27 SecurityAccess configuration. Security level n is unlocked by
+ * requestSeed (securityAccessType 2n-1) followed by sendKey (2n).
+ */
+typedef struct {
+    uint32_t supportedLevels; // bit n set: level n is supported (n in [1, 31])
+    uint8_t seedLength;       // <= ISO14229_SECURITY_MAX_SEED_LEN
+    uint8_t maxAttempts;      // failed sendKey attempts that start the delay timer
+    uint32_t delay_ms;        // requiredTimeDelay after maxAttempts failures
+
+    /**
+     * @brief fills `seed` with `len` random bytes. Called from iso14229UserPoll
+     * to keep the seed pool full, and from requestSeed if the pool is empty.
+     * @return 0 on success
+     */
+    int (*userGenerateSeed)(uint8_t *seed, uint8_t len);
+
+    /**
+     * @brief starts verifying `key` against `seed` for `level`. Permitted
+     * responses:
+     *  0x00 positiveResponse: the key is valid
+     *  0x35 invalidKey
+     *  0x78 requestCorrectlyReceived_ResponsePending: verification continues
+     * in userVerifyKeyPoll. seed and key remain valid until it completes.
+     */
+    enum Iso14229ResponseCodeEnum (*userVerifyKeyStart)(uint8_t level, const uint8_t *seed,
+                                                        uint8_t seedLen, const uint8_t *key,
+                                                        uint16_t keyLen);
+
+    /**
+     * @brief called from iso14229UserPoll while a verification started by
+     * userVerifyKeyStart is pending. Same permitted responses. Optional if
+     * userVerifyKeyStart never returns 0x78.
+     */
+    enum Iso14229ResponseCodeEnum (*userVerifyKeyPoll)();
+
+    /**
+     * @brief called when a pending verification is abandoned because the
+     * session changed (e.g. on S3 timeout) or the server was reset.
+     * userVerifyKeyPoll is not called again for it. Optional.
+     */
+    void (*userVerifyKeyCancel)();
+
+    /**
+     * @brief persist and restore the failed attempt counter so that resetting
+     * the ECU doesn't bypass the required time delay. Optional.
+     */
+    void (*userSaveFailedAttempts)(uint8_t failedAttempts);
+    uint8_t (*userLoadFailedAttempts)();
+} Iso14229SecurityAccessConfig;
+
+typedef struct {
+    uint8_t level;     // unlocked security level, 0: locked
+    uint8_t seedLevel; // level for which `seed` was sent, 0: none
+    uint8_t seed[ISO14229_SECURITY_MAX_SEED_LEN];
+    uint8_t key[ISO14229_SECURITY_MAX_KEY_LEN];
+    uint16_t keyLen;
+    bool verifyPending;
+    uint32_t responsePendingTimer; // when to repeat NRC 0x78 during verification
+
+    uint8_t failedAttempts;
+    bool delayActive;
+    uint32_t delayTimer;
+
+    uint8_t seedPool[ISO14229_SECURITY_SEED_POOL_SIZE][ISO14229_SECURITY_MAX_SEED_LEN];
+    uint8_t seedPoolCount;
+    bool seedRetryActive; // the last refill failed, wait for seedRetryTimer
+    uint32_t seedRetryTimer;
+} Iso14229SecurityAccess;
+
+enum Iso14229AccessRuleType {
+    kAccessRuleService = 0,    // the whole service
+    kAccessRuleSubFunction,    // one subfunction of the service
+    kAccessRuleDataIdentifier, // one data identifier read or written by the service
+};
+
+// diagSessionType 0x00-0x1F. Sessions above that are only allowed by
+// ISO14229_ALL_SESSIONS
+#define ISO14229_MAX_MASKED_SESSION 0x1F
+#define ISO14229_SESSION_MASK(diagSessionType) (1UL << (diagSessionType))
+#define ISO14229_ALL_SESSIONS 0xFFFFFFFFUL
+#define ISO14229_SECURITY_MASK(level) (1UL << (level))
+#define ISO14229_ALL_SECURITY_LEVELS 0xFFFFFFFFUL
+
+/**
+ * @brief Restricts a service, subfunction or data identifier to some
+ * diagnostic sessions and security levels. Anything without a rule is
+ * allowed everywhere.
+ *
+ * Session masks cover sessions 0x00-0x1F. In a session above 0x1F, only
+ * rules with ISO14229_ALL_SESSIONS grant access.
+ */
+typedef struct {
+    uint8_t sid;
+    uint8_t type; // enum Iso14229AccessRuleType
+    uint16_t id;  // subFunction (without the suppressPosRspMsgIndicationBit) or
+                  // dataIdentifier. Unused for kAccessRuleService
+    uint32_t sessions;       // ISO14229_SESSION_MASK of the allowed sessions
+    uint32_t securityLevels; // ISO14229_SECURITY_MASK of the unlocked levels that
+                             // grant access. Include level 0 for access while locked
+} Iso14229AccessRule;
+
+/**
+ * @brief Access rules compiled for the active session and security level.
+ * Service bitmaps are indexed by ISO14229_SID_INDEX, rule bitmaps by the
+ * position in Iso14229ServerConfig.accessRules.
+ */
+typedef struct {
+    uint32_t sessionServices[ISO14229_MAX_DIAGNOSTIC_SERVICES / 32];
+    uint32_t securityServices[ISO14229_MAX_DIAGNOSTIC_SERVICES / 32];
+    uint32_t refinedServices[ISO14229_MAX_DIAGNOSTIC_SERVICES / 32]; // have finer rules
+    uint32_t sessionRules[(ISO14229_MAX_ACCESS_RULES + 31) / 32];
+    uint32_t securityRules[(ISO14229_MAX_ACCESS_RULES + 31) / 32];
+} Iso14229AccessState;
+
 /**
  * @brief UserMiddleware: an interface for extending iso14299
  * @note See appsoftware.h and bootsoftware.h for examples
@@ -281,6 +1043,14 @@ typedef struct {
      * the iso14229 instance
      */
     int (*pollFunc)(void *self, struct Iso14229Instance *iso14229);
+
+    /**
+     * @brief milliseconds until pollFunc next has work to do, or
+     * ISO14229_NO_DEADLINE. Optional: without it the middleware adds no
+     * deadline and pollFunc only runs when the server is polled for another
+     * reason.
+     */
+    uint32_t (*nextDeadlineFunc)(void *self, struct Iso14229Instance *iso14229);
 } Iso14229UserMiddleware;
 
 typedef struct {
@@ -297,6 +1067,8 @@ typedef struct {
      *  0x22 conditionsNotCorrect
      *  0x31 requestOutOfRange
      *  0x33 securityAccessDenied
+     * @note ASSUMPTION: `*data_location` points to storage that outlives the
+     * call. 0x2C DynamicallyDefineDataIdentifier keeps pointers into it.
      */
     enum Iso14229ResponseCodeEnum (*userRDBIHandler)(uint16_t dataId, uint8_t **data_location,
                                                      uint16_t *len);
@@ -314,10 +1086,82 @@ typedef struct {
                                                      uint16_t len);
 
     /**
-     * @brief user-provided function to reset the ECU
+     * @brief user-provided check for 0x2C defineByMemoryAddress. Permitted
+     * responses:
+     *  0x00 positiveResponse: the client may read [memoryAddress,
+     * memoryAddress + memorySize)
+     *  0x31 requestOutOfRange
+     *  0x33 securityAccessDenied
+     * @note if NULL, defineByMemoryAddress is rejected with requestOutOfRange
+     */
+    enum Iso14229ResponseCodeEnum (*userMemoryReadCheck)(const void *memoryAddress,
+                                                         size_t memorySize);
+
+    /**
+     * @brief user-provided function to reset the ECU, called after 0x11
+     * hardReset once the positive response has been handed to the CAN driver.
+     * The last frame may still be waiting in the CAN controller, so wait for
+     * it to go out before resetting.
      */
     void (*userHardReset)();
 
+    /**
+     * @brief user-provided function called after 0x11 keyOffOnReset or
+     * softReset has restarted the server, to restart the application.
+     * Optional: the server restarts itself either way, once the positive
+     * response has been handed to the CAN driver.
+     */
+    void (*userSoftReset)(uint8_t resetType);
+
+    /**
+     * @brief free-running microsecond counter for iso14229UserPollBudget. A
+     * cycle counter works too, the budget is then given in cycles. Optional.
+     */
+    uint32_t (*userGetUs)(void);
+
+    /**
+     * @brief user-provided check for 0x87 LinkControl verifyModeTransition.
+     * `modeIdentifier` is 0 for verifyModeTransitionWithSpecificParameter.
+     * `baudrate` is 0 if `modeIdentifier` is not a standard baud rate (e.g.
+     * programming setup or a vehicle-manufacturer specific CAN FD rate).
+     * Permitted responses:
+     *  0x00 positiveResponse: the link can transition to this mode
+     *  0x22 conditionsNotCorrect
+     *  0x31 requestOutOfRange
+     * @note 0x87 LinkControl is not supported if NULL
+     */
+    enum Iso14229ResponseCodeEnum (*userLinkControlVerify)(uint8_t modeIdentifier,
+                                                           uint32_t baudrate);
+
+    /**
+     * @brief user-provided function that reconfigures the link to the mode
+     * previously accepted by userLinkControlVerify. Called from
+     * iso14229UserPoll once the positive response to transitionMode has been
+     * handed to the CAN driver. Frames still queued in the controller must
+     * be flushed before the bit rate is changed.
+     */
+    void (*userLinkControlTransition)(uint8_t modeIdentifier, uint32_t baudrate);
+
+    /**
+     * @brief user-provided hook for 0x28 CommunicationControl, called before
+     * the request takes effect. `communicationType` is passed as received:
+     * message type in bits 1-0, subnet in bits 7-4. `nodeIdentificationNumber`
+     * is 0 unless `controlType` carries enhanced address information.
+     * Permitted responses:
+     *  0x00 positiveResponse
+     *  0x22 conditionsNotCorrect
+     *  0x31 requestOutOfRange
+     * Also called with kEnableRxAndTx when the default session is entered
+     * while communication is disabled; the response is then ignored.
+     * @note Optional. If NULL, only requests for this network
+     * (ISO14229_COMM_SUBNET_ALL or ISO14229_COMM_SUBNET_RECEIVING) without
+     * enhanced address information are supported. The application reads
+     * the result with iso14229UserCommunicationEnabled.
+     */
+    enum Iso14229ResponseCodeEnum (*userCommunicationControl)(uint8_t controlType,
+                                                              uint8_t communicationType,
+                                                              uint16_t nodeIdentificationNumber);
+
     /**
      * @brief Server time constants (milliseconds)
      */
@@ -327,7 +1171,62 @@ typedef struct {
                          // server for the activated diagnostic session.
     uint16_t s3_ms;      // Session timeout
 
+    /**
+     * @brief 0x2A ReadDataByPeriodicIdentifier. Periodic messages are sent
+     * as single CAN frames with this arbitration ID. The first byte is the
+     * periodicDataIdentifier followed by up to 7 bytes of data.
+     */
+    uint16_t periodic_send_id;
+    uint16_t periodic_slow_ms;   // 0: ISO14229_PERIODIC_SLOW_MS
+    uint16_t periodic_medium_ms; // 0: ISO14229_PERIODIC_MEDIUM_MS
+    uint16_t periodic_fast_ms;   // 0: ISO14229_PERIODIC_FAST_MS
+
     Iso14229UserMiddleware *middleware;
+
+    /**
+     * @brief service handlers indexed by ISO14229_SID_INDEX(sid). Read-only
+     * and shareable between instances. NULL: iso14229DefaultServiceTable, or
+     * rejected by iso14229UserInit when ISO14229_DEFAULT_SERVICE_TABLE is 0
+     */
+    const Iso14229Service *serviceTable;
+
+    /**
+     * @brief DTC store for 0x19 ReadDTCInformation. Optional.
+     */
+    const Iso14229DTCStoreConfig *dtcStore;
+
+    /**
+     * @brief 0x22 ReadDataByIdentifier response cache. Optional.
+     */
+    const Iso14229ResponseCacheConfig *responseCache;
+
+    /**
+     * @brief 0x2E WriteDataByIdentifier write-back to NVM. Optional.
+     */
+    const Iso14229WriteBackConfig *writeBack;
+
+    /**
+     * @brief 0x21 busyRepeatRequest load shedding. Optional.
+     */
+    const Iso14229OverloadConfig *overload;
+
+    /**
+     * @brief 0x27 SecurityAccess. Optional.
+     */
+    const Iso14229SecurityAccessConfig *securityAccess;
+
+    /**
+     * @brief session and security level requirements checked before
+     * dispatch. Optional. Must be sorted by sid, then type, then id.
+     * Violations are answered with:
+     *  service: 0x7F serviceNotSupportedInActiveSession, 0x33 securityAccessDenied
+     *  subfunction: 0x7E subFunctionNotSupportedInActiveSession, 0x33
+     *  data identifier: 0x31 requestOutOfRange, 0x33
+     * Data identifier rules of 0x22 also apply to the sources of 0x2C and to
+     * 0x2A.
+     */
+    const Iso14229AccessRule *accessRules;
+    uint16_t nAccessRules;
 } Iso14229ServerConfig;
 
 /**
@@ -337,24 +1236,83 @@ typedef struct {
 typedef struct Iso14229Instance {
     const Iso14229ServerConfig *cfg;
 
-    Iso14229Service services[ISO14229_MAX_DIAGNOSTIC_SERVICES];
-    const Iso14229Routine *routines[ISO14229_USER_DEFINED_MAX_ROUTINES]; // 0x31 RoutineControl
-    uint16_t nRegisteredRoutines;
-
-    Iso14229DownloadHandler *downloadHandlers[ISO14229_USER_DEFINED_MAX_DOWNLOAD_HANDLERS];
-    uint16_t nRegisteredDownloadHandlers;
+    // Kept by a 0x11 softReset or keyOffOnReset, except the DTC test results
+    // still queued. Everything else is reset.
+    struct {
+        // bit ISO14229_SID_INDEX(sid) set: sid is enabled in cfg->serviceTable
+        uint32_t enabledServices[ISO14229_MAX_DIAGNOSTIC_SERVICES / 32];
+        const Iso14229Routine *routines[ISO14229_USER_DEFINED_MAX_ROUTINES]; // 0x31
+        uint16_t nRegisteredRoutines;
+
+        // 0x2F InputOutputControlByIdentifier, sorted by dataId. Control
+        // returns to the ECU when the default session is entered.
+        const Iso14229IOControl *ioControls[ISO14229_MAX_IO_CONTROLS];
+        uint16_t nRegisteredIOControls;
+
+        Iso14229DownloadHandler *downloadHandlers[ISO14229_USER_DEFINED_MAX_DOWNLOAD_HANDLERS];
+        uint16_t nRegisteredDownloadHandlers;
+
+        Iso14229DTCStore dtcStore;
+    } persistent;
+
+    // 0x27 SecurityAccess. Relocked on every session change.
+    Iso14229SecurityAccess security;
+
+    // recompiled whenever the session or security level changes
+    Iso14229AccessState access;
+
+    // 0x2C DynamicallyDefineDataIdentifier. Cleared when the default session
+    // is entered or an unlocked security level is relocked.
+    Iso14229DynamicDIDTable dynamicDIDs;
+
+    // 0x2A ReadDataByPeriodicIdentifier. Stopped like dynamicDIDs.
+    Iso14229PeriodicScheduler periodic;
+
+    // 0x86 ResponseOnEvent. Cleared like dynamicDIDs.
+    Iso14229ResponseOnEvent roe;
+
+    // 0x87 LinkControl
+    struct {
+        bool verified;
+        bool transitionRequested;
+        uint8_t modeIdentifier;
+        uint32_t baudrate;
+    } linkControl;
+
+    // 0x28 CommunicationControl on this network, indexed by message type - 1
+    // (normal, network management). Enabled again when the default session
+    // is entered.
+    struct {
+        bool rxDisabled;
+        bool txDisabled;
+    } communication[2];
+
+    bool overloaded; // see Iso14229OverloadConfig
+
+    // Iso14229WriteBackConfig data identifiers not yet written to NVM
+    struct {
+        uint32_t dirty[(ISO14229_MAX_WRITE_BACK_DIDS + 31) / 32];
+        bool pending;
+        uint32_t flushTimer;
+    } writeBack;
+
+    // iso14229UserPollBudget resumes from here
+    struct {
+        uint8_t step;
+        uint16_t dtcBudget; // DTC test results left to process this round
+    } poll;
 
     enum Iso14229DiagnosticModeEnum diag_mode;
     bool ecu_reset_requested;
-    uint32_t ecu_reset_100ms_timer;    // for delaying resetting until a response
-                                       // has been sent to the client
+    uint8_t ecu_reset_type;            // enum Iso14229ECUResetResetType
     uint32_t p2_timer;                 // for rate limiting server responses
     uint32_t s3_session_timeout_timer; // for knowing when the diagnostic
                                        // session has timed out
     TportSend tport_send;
 } Iso14229Instance;
 
-void iso14229CallRequestedService(Iso14229Instance *inst, const uint8_t *buf, const uint16_t size);
+void iso14229CallRequestedService(Iso14229Instance *inst, const uint8_t *buf, const uint16_t size,
+                                  const bool functional);
 
 // ========================================================================
 //                              User Functions
@@ -377,6 +1335,32 @@ int iso14229UserInit(Iso14229Instance *self, const Iso14229ServerConfig *cfg);
  */
 void iso14229UserPoll(Iso14229Instance *inst);
 
+/**
+ * @brief Like iso14229UserPoll, but returns once `budget` units of
+ * Iso14229ServerConfig.userGetUs have elapsed. The next call resumes where
+ * this one stopped. The budget is checked between steps, so a step that runs
+ * a user callback (RDBI/WDBI handlers, routines, download handlers,
+ * middleware pollFunc) can overrun it by the duration of that callback.
+ * Without userGetUs this is iso14229UserPoll.
+ *
+ * @param self
+ * @param budget
+ * @return int 0: the poll round is complete, 1: the budget ran out
+ */
+int iso14229UserPollBudget(Iso14229Instance *inst, uint32_t budget);
+
+/**
+ * @brief Time until iso14229UserPoll next has work to do: the earliest of the
+ * P2, S3 and ECU reset timers, the ISO-TP STmin, N_Bs and N_Cr timers, the
+ * service timers and the middleware's nextDeadlineFunc. A host may sleep
+ * this long or until the next CAN frame arrives, whichever comes first.
+ *
+ * @param self
+ * @return uint32_t milliseconds, 0: poll now, ISO14229_NO_DEADLINE: wait for
+ * a CAN frame
+ */
+uint32_t iso14229UserNextDeadline(Iso14229Instance *inst);
+
 /**
  * @brief Pass receieved CAN frames to the Iso14229Instance
  *
@@ -411,12 +1395,53 @@ extern uint32_t iso14229UserSendCAN(const uint32_t arbitration_id, const uint8_t
  *
  * @param self
  * @param sid
- * @return int 0: success, -1: service not found, -2:service already installed
+ * @return int 0: success, -1: service not in the service table, -2:service
+ * already enabled
  */
 int iso14229UserEnableService(Iso14229Instance *self, enum Iso14229DiagnosticServiceIdEnum sid);
 
 /**
- * @brief Register a 0x31 RoutineControl routine
+ * @brief Service handlers. Custom service tables (Iso14229ServerConfig.serviceTable)
+ * can be built from these and from user-defined handlers, e.g.
+ *
+ * const Iso14229Service myServices[ISO14229_MAX_DIAGNOSTIC_SERVICES] = {
+ *     [ISO14229_SID_INDEX(kSID_ECU_RESET)] = iso14229ECUReset,
+ *     [ISO14229_SID_INDEX(0xBA)] = mySupplierService,
+ * };
+ */
+void iso14229DiagnosticSessionControl(Iso14229Instance *self, const Iso14229ServiceRequest *req);
+void iso14229ECUReset(Iso14229Instance *self, const Iso14229ServiceRequest *req);
+void iso14229ClearDiagnosticInformation(Iso14229Instance *self, const Iso14229ServiceRequest *req);
+void iso14229ReadDTCInformation(Iso14229Instance *self, const Iso14229ServiceRequest *req);
+void iso14229ReadDataByIdentifier(Iso14229Instance *self, const Iso14229ServiceRequest *req);
+void iso14229SecurityAccess(Iso14229Instance *self, const Iso14229ServiceRequest *req);
+void iso14229CommunicationControl(Iso14229Instance *self, const Iso14229ServiceRequest *req);
+void iso14229ReadDataByPeriodicIdentifier(Iso14229Instance *self,
+                                          const Iso14229ServiceRequest *req);
+void iso14229DynamicallyDefineDataIdentifier(Iso14229Instance *self,
+                                             const Iso14229ServiceRequest *req);
+void iso14229WriteDataByIdentifier(Iso14229Instance *self, const Iso14229ServiceRequest *req);
+void iso14229InputOutputControlByIdentifier(Iso14229Instance *self,
+                                            const Iso14229ServiceRequest *req);
+void iso14229RoutineControl(Iso14229Instance *self, const Iso14229ServiceRequest *req);
+void iso14229RequestDownload(Iso14229Instance *self, const Iso14229ServiceRequest *req);
+void iso14229TransferData(Iso14229Instance *self, const Iso14229ServiceRequest *req);
+void iso14229RequestTransferExit(Iso14229Instance *self, const Iso14229ServiceRequest *req);
+void iso14229TesterPresent(Iso14229Instance *self, const Iso14229ServiceRequest *req);
+void iso14229ControlDTCSetting(Iso14229Instance *self, const Iso14229ServiceRequest *req);
+void iso14229ResponseOnEvent(Iso14229Instance *self, const Iso14229ServiceRequest *req);
+void iso14229LinkControl(Iso14229Instance *self, const Iso14229ServiceRequest *req);
+
+#if ISO14229_DEFAULT_SERVICE_TABLE
+/**
+ * @brief all services implemented by this library
+ */
+extern const Iso14229Service iso14229DefaultServiceTable[ISO14229_MAX_DIAGNOSTIC_SERVICES];
+#endif
+
+/**
+ * @brief Register a 0x31 RoutineControl routine. Registering the same routine
+ * again has no effect.
  *
  * @param self
  * @param routine
@@ -424,9 +1449,21 @@ int iso14229UserEnableService(Iso14229Instance *self, enum Iso14229DiagnosticSer
  */
 int iso14229UserRegisterRoutine(Iso14229Instance *self, const Iso14229Routine *routine);
 
+/**
+ * @brief Register a 0x2F InputOutputControlByIdentifier signal. Sets
+ * `*ioc->active` to `ioc->ecuValue`. Registering the same signal again only
+ * does that.
+ *
+ * @param self
+ * @param ioc
+ * @return int 0: success
+ */
+int iso14229UserRegisterIOControl(Iso14229Instance *self, const Iso14229IOControl *ioc);
+
 /**
  * @brief Register a handler for the sequence [0x34 RequestDownload, 0x36
- * TransferData, 0x37 RequestTransferExit]
+ * TransferData, 0x37 RequestTransferExit]. Registering the same handler again
+ * replaces its configuration and aborts its download.
  *
  * @param self
  * @param handler
@@ -436,10 +1473,103 @@ int iso14229UserRegisterRoutine(Iso14229Instance *self, const Iso14229Routine *r
 int iso14229UserRegisterDownloadHandler(Iso14229Instance *self, Iso14229DownloadHandler *handler,
                                         Iso14229DownloadHandlerConfig *cfg);
 
+/**
+ * @brief 0x31 RoutineControl callback reporting Iso14229DownloadResults of
+ * the Iso14229DownloadHandler passed as userCtx. Register it as startRoutine
+ * and/or requestRoutineResults of a vehicle-manufacturer specific routine.
+ * The statusRecord is ISO14229_DOWNLOAD_RESULTS_LEN bytes:
+ *  requestDownloadCode, firstRejectCode, transferExited, transferExitCode,
+ *  then blocksReceived, blocksWritten, firstRejectedBlock and imageHash as
+ *  32 bit big-endian values
+ */
+enum Iso14229ResponseCodeEnum iso14229DownloadResultsRoutine(void *userCtx,
+                                                             Iso14229RoutineControlArgs *args);
+
+/**
+ * @brief Whether 0x28 CommunicationControl allows the application to receive
+ * or transmit messages of `messageType` on this network. Check it before
+ * sending periodic application messages so that a download gets the bus.
+ *
+ * @param self
+ * @param messageType with kNormalAndNetworkManagementCommunicationMessages,
+ * true only if both are enabled
+ * @param tx true: transmission, false: reception
+ * @return true if enabled
+ */
+bool iso14229UserCommunicationEnabled(const Iso14229Instance *self,
+                                      enum Iso14229CommunicationMessageType messageType, bool tx);
+
+/**
+ * @brief Drop every cached response
+ *
+ * @param self
+ */
+void iso14229UserInvalidateCache(Iso14229Instance *self);
+
+/**
+ * @brief Drop the cached responses that contain `dataId`. Call it when the
+ * data of a cached data identifier changes.
+ *
+ * @param self
+ * @param dataId
+ */
+void iso14229UserInvalidateCachedDID(Iso14229Instance *self, uint16_t dataId);
+
+/**
+ * @brief Add a DTC to the DTC store with statusOfDTC 0
+ *
+ * @param self
+ * @param dtc 3-byte DTC number
+ * @return int the DTC index to be used with the store arrays, -1: store full or
+ * not configured, -2: DTC already present
+ */
+int iso14229UserAddDTC(Iso14229Instance *self, uint32_t dtc);
+
+/**
+ * @brief Queue monitor test results for the DTC status engine. Results are
+ * applied in iso14229UserPoll. While 0x85 ControlDTCSetting is off, results
+ * are discarded.
+ *
+ * @param self
+ * @param reports
+ * @param n number of reports
+ * @return int number of reports accepted. Less than n if the queue is full.
+ */
+int iso14229UserReportDTCResults(Iso14229Instance *self, const Iso14229DTCReport *reports,
+                                 uint16_t n);
+
+/**
+ * @brief Start a new operation cycle: age confirmed DTCs that completed the
+ * previous cycle without failing and reset the "this operation cycle" bits
+ *
+ * @param self
+ */
+void iso14229UserDTCOperationCycle(Iso14229Instance *self);
+
+/**
+ * @brief Look up a DTC in the DTC store
+ *
+ * @param self
+ * @param dtc 3-byte DTC number
+ * @return int the DTC index, -1: not found
+ */
+int iso14229UserFindDTC(const Iso14229Instance *self, uint32_t dtc);
+
 // ========================================================================
 //                              Helper functions
 // ========================================================================
 
+// ISO14229 fields are big-endian. Hosts that don't define __BYTE_ORDER__ are
+// taken to be little-endian.
+#if defined(__GNUC__) || defined(__clang__)
+#define ISO14229_BSWAP16(x) __builtin_bswap16(x)
+#define ISO14229_BSWAP32(x) __builtin_bswap32(x)
+#else
+#define ISO14229_BSWAP16(x) ((uint16_t)(((x) << 8) | ((x) >> 8)))
+#define ISO14229_BSWAP32(x)                                                                        \
+    ((((x)&0xff) << 24) | (((x)&0xff00) << 8) | (((x)&0xff0000) >> 8) | (((x)&0xff000000) >> 24))
+#endif
+
 /**
  * @brief host to network short
  *
@@ -447,7 +1577,11 @@ int iso14229UserRegisterDownloadHandler(Iso14229Instance *self, Iso14229Download
  * @return uint16_t
  */
 static inline uint16_t Iso14229htons(uint16_t hostshort) {
-    return ((hostshort & 0xff) << 8) | ((hostshort & 0xff00) >> 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return hostshort;
+#else
+    return ISO14229_BSWAP16(hostshort);
+#endif
 }
 
 /**
@@ -459,10 +1593,55 @@ static inline uint16_t Iso14229htons(uint16_t hostshort) {
 static inline uint16_t Iso14229ntohs(uint16_t networkshort) { return Iso14229htons(networkshort); }
 
 static inline uint32_t Iso14229htonl(uint32_t hostlong) {
-    return (((hostlong & 0xff) << 24) | ((hostlong & 0xff00) << 8) | ((hostlong & 0xff0000) >> 8) |
-            ((hostlong & 0xff000000) >> 24));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return hostlong;
+#else
+    return ISO14229_BSWAP32(hostlong);
+#endif
 }
 
 static inline uint32_t Iso14229ntohl(uint32_t networklong) { return Iso14229htonl(networklong); }
 
+/**
+ * @brief Loads and stores of big-endian fields in request and response
+ * buffers, which are not aligned. The fixed-size memcpy compiles to a single
+ * load or store on cores with unaligned access and to byte accesses on the
+ * others (e.g. Cortex-M0).
+ */
+static inline uint16_t iso14229LoadBE16(const uint8_t *p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return Iso14229ntohs(v);
+}
+
+static inline uint32_t iso14229LoadBE24(const uint8_t *p) {
+    return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+}
+
+static inline uint32_t iso14229LoadBE32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return Iso14229ntohl(v);
+}
+
+static inline void iso14229StoreBE16(uint8_t *p, uint16_t v) {
+    v = Iso14229htons(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline void iso14229StoreBE24(uint8_t *p, uint32_t v) {
+    p[0] = v >> 16;
+    p[1] = v >> 8;
+    p[2] = v;
+}
+
+static inline void iso14229StoreBE32(uint8_t *p, uint32_t v) {
+    v = Iso14229htonl(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,341 @@
+#ifndef ISO14229_HPP
+#define ISO14229_HPP
+
+/**
+ * @file iso14229.hpp
+ * @brief C++17 facade over the C server. The enabled services, the data
+ * identifiers and the routines are template parameters: the service table and
+ * a sorted data identifier table are built at compile time and end up in
+ * read-only memory, and the user handlers are plain functions without a
+ * `void *userCtx`. Uses neither RTTI nor exceptions.
+ *
+ * Build iso14229.c with ISO14229_DEFAULT_SERVICE_TABLE=0 so that the handlers
+ * of services missing from every Services<...> can be dropped by the linker.
+ *
+ * @code
+ * using Server = iso14229::Server<
+ *     iso14229::BuiltinServices<kSID_ECU_RESET, kSID_READ_DATA_BY_IDENTIFIER>,
+ *     iso14229::Dids<iso14229::Did<0xF190, readVin>>>;
+ * static Server server;
+ * server.init(cfg);
+ * @endcode
+ */
+
+#include <array>
+#include <stddef.h>
+#include <stdint.h>
+#include "iso14229.h"
+
+namespace iso14229 {
+
+using ResponseCode = enum Iso14229ResponseCodeEnum;
+
+// Same contract as Iso14229ServerConfig.userRDBIHandler for a single dataId
+using DidReadFn = ResponseCode (*)(uint8_t **data_location, uint16_t *len);
+// Same contract as Iso14229ServerConfig.userWDBIHandler for a single dataId
+using DidWriteFn = ResponseCode (*)(const uint8_t *data, uint16_t len);
+using RoutineFn = ResponseCode (*)(Iso14229RoutineControlArgs *args);
+
+/**
+ * @brief the handler this library implements for `sid`, nullptr if there is
+ * none
+ */
+constexpr Iso14229Service builtinService(uint8_t sid) {
+    switch (sid) {
+    case kSID_DIAGNOSTIC_SESSION_CONTROL:
+        return iso14229DiagnosticSessionControl;
+    case kSID_ECU_RESET:
+        return iso14229ECUReset;
+    case kSID_CLEAR_DIAGNOSTIC_INFORMATION:
+        return iso14229ClearDiagnosticInformation;
+    case kSID_READ_DTC_INFORMATION:
+        return iso14229ReadDTCInformation;
+    case kSID_READ_DATA_BY_IDENTIFIER:
+        return iso14229ReadDataByIdentifier;
+    case kSID_SECURITY_ACCESS:
+        return iso14229SecurityAccess;
+    case kSID_COMMUNICATION_CONTROL:
+        return iso14229CommunicationControl;
+    case kSID_READ_DATA_BY_PERIODIC_IDENTIFIER:
+        return iso14229ReadDataByPeriodicIdentifier;
+    case kSID_DYNAMICALLY_DEFINE_DATA_IDENTIFIER:
+        return iso14229DynamicallyDefineDataIdentifier;
+    case kSID_WRITE_DATA_BY_IDENTIFIER:
+        return iso14229WriteDataByIdentifier;
+    case kSID_INPUT_OUTPUT_CONTROL_BY_IDENTIFIER:
+        return iso14229InputOutputControlByIdentifier;
+    case kSID_ROUTINE_CONTROL:
+        return iso14229RoutineControl;
+    case kSID_REQUEST_DOWNLOAD:
+        return iso14229RequestDownload;
+    case kSID_TRANSFER_DATA:
+        return iso14229TransferData;
+    case kSID_REQUEST_TRANSFER_EXIT:
+        return iso14229RequestTransferExit;
+    case kSID_TESTER_PRESENT:
+        return iso14229TesterPresent;
+    case kSID_CONTROL_DTC_SETTING:
+        return iso14229ControlDTCSetting;
+    case kSID_RESPONSE_ON_EVENT:
+        return iso14229ResponseOnEvent;
+    case kSID_LINK_CONTROL:
+        return iso14229LinkControl;
+    default:
+        return nullptr;
+    }
+}
+
+/**
+ * @brief a service of the server. `Handler` defaults to the built-in handler
+ * and is required for SIDs this library does not implement.
+ */
+template <uint8_t Sid, Iso14229Service Handler = nullptr> struct Service {
+    static_assert(ISO14229_SID_IS_REQUEST(Sid), "not a request SID");
+    static constexpr uint8_t sid = Sid;
+    static constexpr Iso14229Service handler = Handler ? Handler : builtinService(Sid);
+    static_assert(nullptr != handler, "no built-in handler for this SID");
+};
+
+/**
+ * @brief the set of services of a server. Builds the table used as
+ * Iso14229ServerConfig.serviceTable, which only references these handlers.
+ */
+template <typename... S> struct Services {
+    using Table = std::array<Iso14229Service, ISO14229_MAX_DIAGNOSTIC_SERVICES>;
+
+    static constexpr bool contains(uint8_t sid) { return ((S::sid == sid) || ...); }
+
+  private:
+    static constexpr bool unique() {
+        const uint8_t sids[] = {0, S::sid...};
+        for (size_t i = 1; i < sizeof(sids); i++) {
+            for (size_t j = i + 1; j < sizeof(sids); j++) {
+                if (sids[i] == sids[j]) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    static_assert(unique(), "SID listed twice");
+
+    static constexpr Table build() {
+        Table table{};
+        ((table[ISO14229_SID_INDEX(S::sid)] = S::handler), ...);
+        return table;
+    }
+
+  public:
+    static constexpr Table table = build();
+
+    /**
+     * @return int 0: success, otherwise the number of services that could
+     * not be enabled
+     */
+    static int enable(Iso14229Instance *self) {
+        return ((0 != iso14229UserEnableService(
+                          self, static_cast<enum Iso14229DiagnosticServiceIdEnum>(S::sid))) +
+                ... + 0);
+    }
+};
+
+/**
+ * @brief Services made of the built-in handlers of `Sids`
+ */
+template <uint8_t... Sids> using BuiltinServices = Services<Service<Sids>...>;
+
+/**
+ * @brief a data identifier for 0x22 ReadDataByIdentifier and 0x2E
+ * WriteDataByIdentifier. nullptr: not readable / not writable
+ */
+template <uint16_t Id, DidReadFn Read, DidWriteFn Write = nullptr> struct Did {
+    static_assert(nullptr != Read || nullptr != Write, "DID neither readable nor writable");
+    static constexpr uint16_t id = Id;
+    static constexpr DidReadFn read = Read;
+    static constexpr DidWriteFn write = Write;
+};
+
+/**
+ * @brief the data identifiers of a server, sorted by dataId at compile time
+ * and looked up with a binary search. `read` and `write` are used as
+ * Iso14229ServerConfig.userRDBIHandler and userWDBIHandler.
+ */
+template <typename... D> struct Dids {
+    struct Entry {
+        uint16_t id = 0;
+        DidReadFn read = nullptr;
+        DidWriteFn write = nullptr;
+    };
+    static constexpr size_t size = sizeof...(D);
+
+  private:
+    using Table = std::array<Entry, sizeof...(D)>;
+
+    static constexpr Table build() {
+        Table table{};
+        size_t n = 0;
+        ((table[n++] = Entry{D::id, D::read, D::write}), ...);
+        // insertion sort, the tables are short and this runs at compile time
+        for (size_t i = 1; i < table.size(); i++) {
+            const Entry e = table[i];
+            size_t j = i;
+            for (; j > 0 && table[j - 1].id > e.id; j--) {
+                table[j] = table[j - 1];
+            }
+            table[j] = e;
+        }
+        return table;
+    }
+
+  public:
+    static constexpr Table table = build();
+
+  private:
+    static constexpr bool unique() {
+        for (size_t i = 1; i < table.size(); i++) {
+            if (table[i - 1].id == table[i].id) {
+                return false;
+            }
+        }
+        return true;
+    }
+    static_assert(unique(), "dataId listed twice");
+
+  public:
+    /**
+     * @brief the entry for `dataId`, nullptr if there is none
+     */
+    static constexpr const Entry *find(uint16_t dataId) {
+        size_t lo = 0, hi = table.size();
+        while (lo < hi) {
+            const size_t mid = lo + (hi - lo) / 2;
+            if (table[mid].id < dataId) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return (lo < table.size() && table[lo].id == dataId) ? &table[lo] : nullptr;
+    }
+
+    static ResponseCode read(uint16_t dataId, uint8_t **data_location, uint16_t *len) {
+        const Entry *e = find(dataId);
+        if (nullptr == e || nullptr == e->read) {
+            return kRequestOutOfRange;
+        }
+        return e->read(data_location, len);
+    }
+
+    static ResponseCode write(uint16_t dataId, const uint8_t *data, uint16_t len) {
+        const Entry *e = find(dataId);
+        if (nullptr == e || nullptr == e->write) {
+            return kRequestOutOfRange;
+        }
+        return e->write(data, len);
+    }
+};
+
+/**
+ * @brief a 0x31 RoutineControl routine. nullptr: the routine control type is
+ * not supported
+ */
+template <uint16_t Id, RoutineFn Start, RoutineFn Stop = nullptr, RoutineFn Results = nullptr>
+struct Routine {
+    static constexpr uint16_t id = Id;
+
+  private:
+    template <RoutineFn F> static ResponseCode call(void *, Iso14229RoutineControlArgs *args) {
+        return F(args);
+    }
+    template <RoutineFn F> static constexpr Iso14229RoutineControlUserCallbackType callback() {
+        if constexpr (nullptr == F) {
+            return nullptr;
+        } else {
+            return call<F>;
+        }
+    }
+
+  public:
+    static constexpr Iso14229Routine routine = {
+        Id, callback<Start>(), callback<Stop>(), callback<Results>(), nullptr,
+    };
+};
+
+/**
+ * @brief the routines of a server, registered with iso14229UserRegisterRoutine
+ */
+template <typename... R> struct Routines {
+    static constexpr size_t size = sizeof...(R);
+    static_assert(size <= ISO14229_USER_DEFINED_MAX_ROUTINES,
+                  "raise ISO14229_USER_DEFINED_MAX_ROUTINES");
+
+  private:
+    static constexpr bool unique() {
+        const uint16_t ids[] = {0, R::id...};
+        for (size_t i = 1; i < sizeof(ids) / sizeof(ids[0]); i++) {
+            for (size_t j = i + 1; j < sizeof(ids) / sizeof(ids[0]); j++) {
+                if (ids[i] == ids[j]) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    static_assert(unique(), "routineIdentifier listed twice");
+
+  public:
+    static int registerAll(Iso14229Instance *self) {
+        return ((0 != iso14229UserRegisterRoutine(self, &R::routine)) + ... + 0);
+    }
+};
+
+/**
+ * @brief a server made of `ServiceSet`, `DidSet` and `RoutineSet`
+ */
+template <typename ServiceSet, typename DidSet = Dids<>, typename RoutineSet = Routines<>>
+class Server {
+    static_assert(0 == DidSet::size || ServiceSet::contains(kSID_READ_DATA_BY_IDENTIFIER) ||
+                      ServiceSet::contains(kSID_WRITE_DATA_BY_IDENTIFIER),
+                  "DIDs without 0x22 or 0x2E");
+    static_assert(0 == RoutineSet::size || ServiceSet::contains(kSID_ROUTINE_CONTROL),
+                  "routines without 0x31");
+
+  public:
+    /**
+     * @brief Fills in the service table and, if there are DIDs, the RDBI and
+     * WDBI handlers of `cfg`, then initializes the server, enables the
+     * services and registers the routines.
+     *
+     * @param cfg must outlive the server
+     * @return int 0 on success
+     */
+    int init(Iso14229ServerConfig &cfg) {
+        cfg.serviceTable = ServiceSet::table.data();
+        if constexpr (DidSet::size > 0) {
+            cfg.userRDBIHandler = DidSet::read;
+            cfg.userWDBIHandler = DidSet::write;
+        }
+        int err = iso14229UserInit(&instance_, &cfg);
+        if (err) {
+            return err;
+        }
+        if (ServiceSet::enable(&instance_)) {
+            return -1;
+        }
+        if (RoutineSet::registerAll(&instance_)) {
+            return -1;
+        }
+        return 0;
+    }
+
+    void poll() { iso14229UserPoll(&instance_); }
+
+    Iso14229Instance *instance() { return &instance_; }
+
+  private:
+    Iso14229Instance instance_{};
+};
+
+} // namespace iso14229
+
+#endif
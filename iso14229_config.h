@@ -15,14 +15,185 @@
 #define ISO14229_USER_DEFINED_MAX_DOWNLOAD_HANDLERS 1
 #endif
 
+/**
+ * @brief maximum number of 0x2F InputOutputControlByIdentifier signals
+ */
+#ifndef ISO14229_MAX_IO_CONTROLS
+#define ISO14229_MAX_IO_CONTROLS 16
+#endif
+
+/**
+ * @brief maximum number of 0x2C dynamically defined data identifiers
+ *
+ */
+#ifndef ISO14229_MAX_DYNAMIC_DIDS
+#define ISO14229_MAX_DYNAMIC_DIDS 8
+#endif
+
+/**
+ * @brief number of gather list entries shared by all dynamically defined data
+ * identifiers. Each sourceDataIdentifier or memoryAddress in a 0x2C request
+ * uses one entry.
+ */
+#ifndef ISO14229_DYNAMIC_DID_ARENA_SIZE
+#define ISO14229_DYNAMIC_DID_ARENA_SIZE 32
+#endif
+
+/**
+ * @brief number of DTC test results that can be queued by
+ * iso14229UserReportDTCResults before they are processed in iso14229UserPoll
+ */
+#ifndef ISO14229_DTC_REPORT_QUEUE_SIZE
+#define ISO14229_DTC_REPORT_QUEUE_SIZE 32
+#endif
+
+/**
+ * @brief maximum number of queued DTC test results processed per call to
+ * iso14229UserPoll
+ */
+#ifndef ISO14229_DTC_POLL_BUDGET
+#define ISO14229_DTC_POLL_BUDGET 8
+#endif
+
+/**
+ * @brief 0x27 SecurityAccess seed and key buffer sizes in bytes
+ */
+#ifndef ISO14229_SECURITY_MAX_SEED_LEN
+#define ISO14229_SECURITY_MAX_SEED_LEN 16
+#endif
+
+#ifndef ISO14229_SECURITY_MAX_KEY_LEN
+#define ISO14229_SECURITY_MAX_KEY_LEN 128
+#endif
+
+/**
+ * @brief number of 0x27 SecurityAccess seeds generated ahead of time so that
+ * requestSeed can be answered without calling the seed generator
+ */
+#ifndef ISO14229_SECURITY_SEED_POOL_SIZE
+#define ISO14229_SECURITY_SEED_POOL_SIZE 4
+#endif
+
+/**
+ * @brief time in ms before a failed userGenerateSeed is retried to refill the
+ * seed pool
+ */
+#ifndef ISO14229_SECURITY_SEED_RETRY_MS
+#define ISO14229_SECURITY_SEED_RETRY_MS 10
+#endif
+
+/**
+ * @brief maximum number of entries in Iso14229ServerConfig.accessRules
+ */
+#ifndef ISO14229_MAX_ACCESS_RULES
+#define ISO14229_MAX_ACCESS_RULES 64
+#endif
+
+/**
+ * @brief maximum number of periodic data identifiers scheduled at once by 0x2A
+ * ReadDataByPeriodicIdentifier
+ */
+#ifndef ISO14229_MAX_PERIODIC_DIDS
+#define ISO14229_MAX_PERIODIC_DIDS 8
+#endif
+
+/**
+ * @brief maximum number of events set up at once by 0x86 ResponseOnEvent
+ */
+#ifndef ISO14229_MAX_ROE_EVENTS
+#define ISO14229_MAX_ROE_EVENTS 4
+#endif
+
+/**
+ * @brief maximum length of a 0x86 serviceToRespondToRecord, SID included
+ */
+#ifndef ISO14229_ROE_MAX_SERVICE_RECORD_LEN
+#define ISO14229_ROE_MAX_SERVICE_RECORD_LEN 8
+#endif
+
+/**
+ * @brief interval at which the data identifiers watched by started 0x86
+ * events are read and compared
+ */
+#ifndef ISO14229_ROE_SAMPLE_MS
+#define ISO14229_ROE_SAMPLE_MS 10
+#endif
+
+/*
+0x2A periodic DIDs are scheduled on a hashed timer wheel of
+ISO14229_PERIODIC_WHEEL_SLOTS slots (a power of two), advanced once every
+ISO14229_PERIODIC_TICK_MS milliseconds. Periods longer than one revolution of
+the wheel wait for the required number of revolutions in their slot.
+*/
+#ifndef ISO14229_PERIODIC_WHEEL_SLOTS
+#define ISO14229_PERIODIC_WHEEL_SLOTS 16
+#endif
+
+#ifndef ISO14229_PERIODIC_TICK_MS
+#define ISO14229_PERIODIC_TICK_MS 10
+#endif
+
+/**
+ * @brief default 0x2A transmission periods, used when the corresponding
+ * Iso14229ServerConfig field is 0
+ */
+#ifndef ISO14229_PERIODIC_SLOW_MS
+#define ISO14229_PERIODIC_SLOW_MS 1000
+#endif
+
+#ifndef ISO14229_PERIODIC_MEDIUM_MS
+#define ISO14229_PERIODIC_MEDIUM_MS 200
+#endif
+
+#ifndef ISO14229_PERIODIC_FAST_MS
+#define ISO14229_PERIODIC_FAST_MS 50
+#endif
+
+/**
+ * @brief longest request, SID included, whose response can be cached by
+ * Iso14229ServerConfig.responseCache
+ */
+#ifndef ISO14229_RESPONSE_CACHE_KEY_LEN
+#define ISO14229_RESPONSE_CACHE_KEY_LEN 7
+#endif
+
+/**
+ * @brief maximum number of data identifiers in
+ * Iso14229ServerConfig.writeBack
+ */
+#ifndef ISO14229_MAX_WRITE_BACK_DIDS
+#define ISO14229_MAX_WRITE_BACK_DIDS 32
+#endif
+
+/**
+ * @brief 1: iso14229DefaultServiceTable is built and used when
+ * Iso14229ServerConfig.serviceTable is NULL. 0: every server provides its own
+ * table, so the linker can drop the handlers of services that are not in it.
+ */
+#ifndef ISO14229_DEFAULT_SERVICE_TABLE
+#define ISO14229_DEFAULT_SERVICE_TABLE 1
+#endif
+
+/**
+ * @brief maximum Iso14229Cipher.ivLength in bytes
+ */
+#ifndef ISO14229_MAX_CIPHER_IV_LEN
+#define ISO14229_MAX_CIPHER_IV_LEN 16
+#endif
+
 /*
 The iso14229 server must delay sending an outgoing response for up to p2
 milliseconds. Outgoing responses go in a buffer of this size until p2 elapses.
 
 This extraneous buffer can be removed by using the one in the ISO-TP layer
 but I didn't see an obvious way of doing that.
+
+Large responses such as 0x19 ReadDTCInformation reports over a big DTC store
+need a larger buffer (up to the ISO-TP limit of 4095).
 */
+#ifndef ISO14229_TPORT_SEND_BUFSIZE
 #define ISO14229_TPORT_SEND_BUFSIZE 255
+#endif
 
 /*
 provide a debug function with -DISO14229USERDEBUG=printf when compiling this
@@ -0,0 +1,383 @@
+#ifndef LZ4DECODER_H
+#define LZ4DECODER_H
+
+/**
+ * @file lz4decoder.h
+ * @brief streaming decoder for the LZ4 frame format
+ * (https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md)
+ *
+ * Input may be split at any byte. Decoded data is kept in a caller-provided
+ * ring buffer (the window) and passed to a sink in contiguous chunks. The
+ * window bounds RAM use: back-references further than the window size are
+ * rejected, so images must be compressed with a match distance no greater
+ * than the window. Any window at least as large as the decompressed image,
+ * or 64KiB, accepts every stream.
+ *
+ * ASSUMPTION: checksums are skipped rather than verified. Image integrity is
+ * expected to be checked after the download, e.g. by applicationIsValid.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LZ4DECODER_FRAME_MAGIC 0x184D2204UL
+
+#define LZ4DECODER_OK 0
+#define LZ4DECODER_ERR_CORRUPT -1 // malformed or unsupported input
+#define LZ4DECODER_ERR_SINK -2    // the sink returned nonzero
+
+/**
+ * @brief receives decoded data. `data` points into the window, which later
+ * matches copy from, so it is read-only.
+ * @return 0 on success
+ */
+typedef int (*LZ4DecoderSink)(void *sinkCtx, const uint8_t *data, size_t len);
+
+enum LZ4DecoderState {
+    kLZ4DecoderStateMagic = 0,
+    kLZ4DecoderStateFrameDescriptor,
+    kLZ4DecoderStateBlockSize,
+    kLZ4DecoderStateUncompressedBlock,
+    kLZ4DecoderStateToken,
+    kLZ4DecoderStateLiteralLength,
+    kLZ4DecoderStateLiterals,
+    kLZ4DecoderStateOffset,
+    kLZ4DecoderStateMatchLength,
+    kLZ4DecoderStateBlockChecksum,
+    kLZ4DecoderStateContentChecksum,
+    kLZ4DecoderStateDone,
+};
+
+typedef struct {
+    uint8_t *window;
+    size_t windowMask; // window size - 1
+
+    enum LZ4DecoderState state;
+    uint8_t flg;           // frame FLG byte
+    uint8_t header[15];    // frame header field being collected
+    uint8_t headerLen;     // bytes collected into header
+    uint8_t headerNeeded;  // bytes needed to complete the current field
+    uint32_t blockLeft;    // input bytes left in the current block
+    size_t literalLength;  // literals left to copy
+    size_t matchLength;    // bytes in the current match
+    uint16_t matchOffset;  // distance of the current match
+    size_t head;           // total bytes decoded
+    size_t flushed;        // total bytes passed to the sink
+} LZ4Decoder;
+
+/**
+ * @brief
+ *
+ * @param self
+ * @param window ring buffer for decoded data
+ * @param windowSize size of window in bytes. Must be a power of two.
+ * @return int 0 on success
+ */
+static inline int lz4DecoderInit(LZ4Decoder *self, uint8_t *window, size_t windowSize) {
+    if (NULL == window || 0 == windowSize || (windowSize & (windowSize - 1))) {
+        return -1;
+    }
+    memset(self, 0, sizeof(LZ4Decoder));
+    self->window = window;
+    self->windowMask = windowSize - 1;
+    self->state = kLZ4DecoderStateMagic;
+    self->headerNeeded = 4;
+    return 0;
+}
+
+static inline uint32_t lz4DecoderLoadLE32(const uint8_t *buf) {
+    return (uint32_t)buf[0] | ((uint32_t)buf[1] << 8) | ((uint32_t)buf[2] << 16) |
+           ((uint32_t)buf[3] << 24);
+}
+
+/**
+ * @brief passes decoded bytes that haven't been passed yet to the sink. They
+ * are contiguous in the window because this is called whenever head wraps.
+ */
+static inline int lz4DecoderFlush(LZ4Decoder *self, LZ4DecoderSink sink, void *sinkCtx) {
+    size_t len = self->head - self->flushed;
+    if (0 == len) {
+        return LZ4DECODER_OK;
+    }
+    const uint8_t *start = self->window + (self->flushed & self->windowMask);
+    self->flushed = self->head;
+    return 0 == sink(sinkCtx, start, len) ? LZ4DECODER_OK : LZ4DECODER_ERR_SINK;
+}
+
+/**
+ * @brief appends `len` bytes of `src` to the window
+ */
+static inline int lz4DecoderEmit(LZ4Decoder *self, const uint8_t *src, size_t len,
+                                 LZ4DecoderSink sink, void *sinkCtx) {
+    while (len) {
+        size_t pos = self->head & self->windowMask;
+        size_t n = self->windowMask + 1 - pos;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(self->window + pos, src, n);
+        self->head += n;
+        src += n;
+        len -= n;
+        if (0 == (self->head & self->windowMask)) {
+            int err = lz4DecoderFlush(self, sink, sinkCtx);
+            if (err) {
+                return err;
+            }
+        }
+    }
+    return LZ4DECODER_OK;
+}
+
+/**
+ * @brief appends a copy of earlier output. The source and destination may
+ * overlap (offset < length), so this copies a byte at a time.
+ */
+static inline int lz4DecoderCopyMatch(LZ4Decoder *self, LZ4DecoderSink sink, void *sinkCtx) {
+    const size_t mask = self->windowMask;
+    size_t len = self->matchLength;
+    size_t src = self->head - self->matchOffset;
+
+    while (len--) {
+        self->window[self->head & mask] = self->window[src & mask];
+        self->head++;
+        src++;
+        if (0 == (self->head & mask)) {
+            int err = lz4DecoderFlush(self, sink, sinkCtx);
+            if (err) {
+                return err;
+            }
+        }
+    }
+    return LZ4DECODER_OK;
+}
+
+/**
+ * @brief collects header fields that may be split across input chunks
+ * @return 1 once headerNeeded bytes have been collected
+ */
+static inline int lz4DecoderCollect(LZ4Decoder *self, const uint8_t **in, size_t *len) {
+    while (self->headerLen < self->headerNeeded && *len) {
+        self->header[self->headerLen++] = **in;
+        (*in)++;
+        (*len)--;
+    }
+    return self->headerLen == self->headerNeeded;
+}
+
+static inline void lz4DecoderExpect(LZ4Decoder *self, enum LZ4DecoderState state,
+                                    uint8_t nBytes) {
+    self->state = state;
+    self->headerLen = 0;
+    self->headerNeeded = nBytes;
+}
+
+/**
+ * @brief called when the current block has been consumed
+ */
+static inline void lz4DecoderEndBlock(LZ4Decoder *self) {
+    if (self->flg & 0x10) { // block checksum flag
+        lz4DecoderExpect(self, kLZ4DecoderStateBlockChecksum, 4);
+    } else {
+        lz4DecoderExpect(self, kLZ4DecoderStateBlockSize, 4);
+    }
+}
+
+/**
+ * @brief decodes `len` bytes of `in`. Everything decoded so far has been
+ * passed to `sink` when this returns.
+ *
+ * @param self
+ * @param in
+ * @param len
+ * @param sink
+ * @param sinkCtx
+ * @return int LZ4DECODER_OK, LZ4DECODER_ERR_CORRUPT or LZ4DECODER_ERR_SINK
+ */
+static inline int lz4DecoderUpdate(LZ4Decoder *self, const uint8_t *in, size_t len,
+                                   LZ4DecoderSink sink, void *sinkCtx) {
+    int err = LZ4DECODER_OK;
+
+    while (len && LZ4DECODER_OK == err) {
+        switch (self->state) {
+        case kLZ4DecoderStateMagic:
+            if (lz4DecoderCollect(self, &in, &len)) {
+                if (LZ4DECODER_FRAME_MAGIC != lz4DecoderLoadLE32(self->header)) {
+                    return LZ4DECODER_ERR_CORRUPT;
+                }
+                // FLG and BD, then the optional content size and the header
+                // checksum once FLG is known
+                lz4DecoderExpect(self, kLZ4DecoderStateFrameDescriptor, 2);
+            }
+            break;
+
+        case kLZ4DecoderStateFrameDescriptor:
+            if (lz4DecoderCollect(self, &in, &len)) {
+                if (2 == self->headerNeeded) {
+                    self->flg = self->header[0];
+                    // version 01, no dictionary ID, reserved bit clear
+                    if (0x40 != (self->flg & 0xC3)) {
+                        return LZ4DECODER_ERR_CORRUPT;
+                    }
+                    self->headerNeeded += ((self->flg & 0x08) ? 8 : 0) + 1;
+                } else {
+                    lz4DecoderExpect(self, kLZ4DecoderStateBlockSize, 4);
+                }
+            }
+            break;
+
+        case kLZ4DecoderStateBlockSize:
+            if (lz4DecoderCollect(self, &in, &len)) {
+                uint32_t blockSize = lz4DecoderLoadLE32(self->header);
+                if (0 == blockSize) { // EndMark
+                    if (self->flg & 0x04) {
+                        lz4DecoderExpect(self, kLZ4DecoderStateContentChecksum, 4);
+                    } else {
+                        self->state = kLZ4DecoderStateDone;
+                    }
+                } else if (blockSize & 0x80000000UL) {
+                    self->blockLeft = blockSize & 0x7FFFFFFFUL;
+                    self->state = kLZ4DecoderStateUncompressedBlock;
+                } else {
+                    self->blockLeft = blockSize;
+                    self->state = kLZ4DecoderStateToken;
+                }
+            }
+            break;
+
+        case kLZ4DecoderStateUncompressedBlock: {
+            size_t n = len < self->blockLeft ? len : self->blockLeft;
+            err = lz4DecoderEmit(self, in, n, sink, sinkCtx);
+            in += n;
+            len -= n;
+            self->blockLeft -= n;
+            if (0 == self->blockLeft) {
+                lz4DecoderEndBlock(self);
+            }
+            break;
+        }
+
+        case kLZ4DecoderStateToken: {
+            const uint8_t token = *in++;
+            len--;
+            self->blockLeft--;
+            self->literalLength = token >> 4;
+            self->matchLength = (token & 0x0F) + 4;
+            self->state = (15 == self->literalLength) ? kLZ4DecoderStateLiteralLength
+                                                      : kLZ4DecoderStateLiterals;
+            break;
+        }
+
+        case kLZ4DecoderStateLiteralLength:
+        case kLZ4DecoderStateMatchLength: {
+            if (0 == self->blockLeft) {
+                return LZ4DECODER_ERR_CORRUPT;
+            }
+            const uint8_t b = *in++;
+            len--;
+            self->blockLeft--;
+            if (kLZ4DecoderStateLiteralLength == self->state) {
+                self->literalLength += b;
+                if (255 != b) {
+                    self->state = kLZ4DecoderStateLiterals;
+                }
+            } else {
+                self->matchLength += b;
+                if (255 != b) {
+                    err = lz4DecoderCopyMatch(self, sink, sinkCtx);
+                    self->state = kLZ4DecoderStateToken;
+                }
+            }
+            break;
+        }
+
+        case kLZ4DecoderStateLiterals: {
+            size_t n = self->literalLength;
+            if (n > len) {
+                n = len;
+            }
+            if (n > self->blockLeft) {
+                return LZ4DECODER_ERR_CORRUPT;
+            }
+            err = lz4DecoderEmit(self, in, n, sink, sinkCtx);
+            in += n;
+            len -= n;
+            self->blockLeft -= n;
+            self->literalLength -= n;
+            if (0 == self->literalLength) {
+                if (0 == self->blockLeft) { // the last sequence has no match
+                    lz4DecoderEndBlock(self);
+                } else {
+                    lz4DecoderExpect(self, kLZ4DecoderStateOffset, 2);
+                }
+            }
+            break;
+        }
+
+        case kLZ4DecoderStateOffset:
+            if (self->blockLeft < (uint32_t)(self->headerNeeded - self->headerLen)) {
+                return LZ4DECODER_ERR_CORRUPT;
+            }
+            {
+                const uint8_t before = self->headerLen;
+                int done = lz4DecoderCollect(self, &in, &len);
+                self->blockLeft -= self->headerLen - before;
+                if (!done) {
+                    break;
+                }
+            }
+            self->matchOffset = self->header[0] | (self->header[1] << 8);
+            if (0 == self->matchOffset || self->matchOffset > self->windowMask + 1 ||
+                self->matchOffset > self->head) {
+                return LZ4DECODER_ERR_CORRUPT;
+            }
+            if (15 + 4 == self->matchLength) {
+                self->state = kLZ4DecoderStateMatchLength;
+            } else {
+                err = lz4DecoderCopyMatch(self, sink, sinkCtx);
+                self->state = kLZ4DecoderStateToken;
+            }
+            break;
+
+        case kLZ4DecoderStateBlockChecksum:
+            if (lz4DecoderCollect(self, &in, &len)) {
+                lz4DecoderExpect(self, kLZ4DecoderStateBlockSize, 4);
+            }
+            break;
+
+        case kLZ4DecoderStateContentChecksum:
+            if (lz4DecoderCollect(self, &in, &len)) {
+                self->state = kLZ4DecoderStateDone;
+            }
+            break;
+
+        case kLZ4DecoderStateDone:
+        default:
+            // ASSUMPTION: one frame per download
+            return LZ4DECODER_ERR_CORRUPT;
+        }
+
+        // A block must not end in the middle of a sequence
+        if (kLZ4DecoderStateToken == self->state && 0 == self->blockLeft) {
+            return LZ4DECODER_ERR_CORRUPT;
+        }
+    }
+
+    if (LZ4DECODER_OK != err) {
+        return err;
+    }
+    return lz4DecoderFlush(self, sink, sinkCtx);
+}
+
+/**
+ * @brief
+ *
+ * @param self
+ * @return int 0 if the input ended with a complete frame
+ */
+static inline int lz4DecoderFinish(const LZ4Decoder *self) {
+    return kLZ4DecoderStateDone == self->state ? LZ4DECODER_OK : LZ4DECODER_ERR_CORRUPT;
+}
+
+#endif
@@ -1,6 +1,6 @@
 #! /bin/bash
 
-files=`find . -type f \( -name '*.c' -o -name '*.h' \) -not -path "./isotp/*"`
+files=`find . -type f \( -name '*.c' -o -name '*.h' -o -name '*.cpp' -o -name '*.hpp' \) -not -path "./isotp/*"`
 
 for file in $files ; do
     clang-format -i $file
@@ -0,0 +1,153 @@
+/**
+ * @file test_ctrstream.c
+ * @brief run with `gcc test_ctrstream.c && ./a.out`
+ */
+
+#include "ctrstream.h"
+#include <assert.h>
+#include <stdio.h>
+
+// NIST SP 800-38A F.5.1 CTR-AES128.Encrypt
+static const uint8_t g_key[16] = {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+                                  0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+static const uint8_t g_initialCounter[16] = {0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+                                             0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff};
+static const uint8_t g_plaintext[64] = {
+    0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+    0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+    0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+    0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10,
+};
+static const uint8_t g_ciphertext[64] = {
+    0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26, 0x1b, 0xef, 0x68, 0x64, 0x99, 0x0d, 0xb6, 0xce,
+    0x98, 0x06, 0xf6, 0x6b, 0x79, 0x70, 0xfd, 0xff, 0x86, 0x17, 0x18, 0x7b, 0xb9, 0xff, 0xfd, 0xff,
+    0x5a, 0xe4, 0xdf, 0x3e, 0xdb, 0xd5, 0xd3, 0x5e, 0x5b, 0x4f, 0x09, 0x02, 0x0d, 0xb0, 0x3e, 0xab,
+    0x1e, 0x03, 0x1d, 0xda, 0x2f, 0xbe, 0x03, 0xd1, 0x79, 0x21, 0x70, 0xa0, 0xf3, 0x00, 0x9c, 0xee,
+};
+
+/*******************************************************************************
+ * Minimal AES-128 forward cipher (FIPS-197), good enough to check the CTR mode
+ ******************************************************************************/
+
+static uint8_t g_sbox[256];
+static uint8_t g_roundKeys[176];
+
+static uint8_t xtime(uint8_t x) { return (uint8_t)((x << 1) ^ ((x & 0x80) ? 0x1b : 0)); }
+
+static void aesBuildSbox() {
+    uint8_t p = 1, q = 1;
+    // p and q walk the multiplicative group with generator 3 and its inverse
+    do {
+        p = p ^ xtime(p);
+        q ^= q << 1;
+        q ^= q << 2;
+        q ^= q << 4;
+        q ^= (q & 0x80) ? 0x09 : 0;
+        uint8_t x = q ^ (uint8_t)((q << 1) | (q >> 7)) ^ (uint8_t)((q << 2) | (q >> 6)) ^
+                    (uint8_t)((q << 3) | (q >> 5)) ^ (uint8_t)((q << 4) | (q >> 4));
+        g_sbox[p] = x ^ 0x63;
+    } while (p != 1);
+    g_sbox[0] = 0x63;
+}
+
+static void aesExpandKey(const uint8_t key[16]) {
+    uint8_t rcon = 1;
+    memcpy(g_roundKeys, key, 16);
+    for (int i = 16; i < 176; i += 4) {
+        uint8_t t[4];
+        memcpy(t, &g_roundKeys[i - 4], 4);
+        if (0 == i % 16) {
+            uint8_t t0 = t[0];
+            t[0] = g_sbox[t[1]] ^ rcon;
+            t[1] = g_sbox[t[2]];
+            t[2] = g_sbox[t[3]];
+            t[3] = g_sbox[t0];
+            rcon = xtime(rcon);
+        }
+        for (int j = 0; j < 4; j++) {
+            g_roundKeys[i + j] = g_roundKeys[i - 16 + j] ^ t[j];
+        }
+    }
+}
+
+static void aesEncrypt(void *ctx, const uint8_t in[16], uint8_t out[16]) {
+    uint8_t s[16], t[16];
+    for (int i = 0; i < 16; i++) {
+        s[i] = in[i] ^ g_roundKeys[i];
+    }
+    for (int round = 1; round <= 10; round++) {
+        // SubBytes and ShiftRows
+        for (int i = 0; i < 16; i++) {
+            t[i] = g_sbox[s[(i + 4 * (i % 4)) % 16]];
+        }
+        // MixColumns
+        for (int c = 0; c < 16; c += 4) {
+            uint8_t a0 = t[c], a1 = t[c + 1], a2 = t[c + 2], a3 = t[c + 3];
+            if (round < 10) {
+                uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+                t[c] ^= all ^ xtime(a0 ^ a1);
+                t[c + 1] ^= all ^ xtime(a1 ^ a2);
+                t[c + 2] ^= all ^ xtime(a2 ^ a3);
+                t[c + 3] ^= all ^ xtime(a3 ^ a0);
+            }
+        }
+        for (int i = 0; i < 16; i++) {
+            s[i] = t[i] ^ g_roundKeys[16 * round + i];
+        }
+    }
+    memcpy(out, s, 16);
+}
+
+/******************************************************************************/
+
+void run_test(size_t chunkSize) {
+    CTRStream ctr;
+    uint8_t buf[64];
+
+    memcpy(buf, g_plaintext, sizeof(buf));
+    assert(0 == ctrStreamInit(&ctr, aesEncrypt, NULL, g_initialCounter));
+    for (size_t offset = 0; offset < sizeof(buf); offset += chunkSize) {
+        size_t len = sizeof(buf) - offset < chunkSize ? sizeof(buf) - offset : chunkSize;
+        ctrStreamXor(&ctr, buf + offset, len);
+    }
+    assert(0 == memcmp(buf, g_ciphertext, sizeof(buf)));
+
+    // decryption is the same operation
+    assert(0 == ctrStreamInit(&ctr, aesEncrypt, NULL, g_initialCounter));
+    for (size_t offset = 0; offset < sizeof(buf); offset += chunkSize) {
+        size_t len = sizeof(buf) - offset < chunkSize ? sizeof(buf) - offset : chunkSize;
+        ctrStreamXor(&ctr, buf + offset, len);
+    }
+    assert(0 == memcmp(buf, g_plaintext, sizeof(buf)));
+}
+
+void test_counter_carry() {
+    CTRStream ctr;
+    uint8_t counter[16] = {0};
+    uint8_t buf[32] = {0};
+    uint8_t expected[16];
+    memset(counter + 12, 0xff, 4);
+
+    // the counter is incremented across all 128 bits
+    assert(0 == ctrStreamInit(&ctr, aesEncrypt, NULL, counter));
+    ctrStreamXor(&ctr, buf, sizeof(buf));
+    memset(counter + 12, 0, 4);
+    counter[11] = 1;
+    aesEncrypt(NULL, counter, expected);
+    assert(0 == memcmp(buf + 16, expected, 16));
+}
+
+int main(int ac, char **av) {
+    aesBuildSbox();
+    aesExpandKey(g_key);
+
+    run_test(1);
+    run_test(5);
+    run_test(16);
+    run_test(17);
+    run_test(64);
+    test_counter_carry();
+    assert(0 != ctrStreamInit(&(CTRStream){0}, NULL, NULL, g_initialCounter));
+
+    printf("pass\n");
+}
@@ -9,6 +9,24 @@ from udsoncan.client import Client
 from udsoncan.connections import PythonIsoTpConnection
 from udsoncan.services import *
 from ctypes import *
+from can.interfaces.virtual import VirtualBus
+from can import Message
+
+
+def send_raw(client, payload: bytes) -> bytes:
+    """ send a raw request for services that udsoncan doesn't wrap and return the raw response """
+    client.conn.empty_rxqueue()
+    client.conn.send(payload)
+    return client.conn.wait_frame(timeout=2, exception=True)
+
+
+def send_functional(payload: bytes):
+    """ send a single frame request to the functional address """
+    bus = VirtualBus(channel=1)
+    data = bytes([len(payload)]) + payload
+    bus.send(Message(arbitration_id=0x7DF, is_extended_id=False, data=data.ljust(8, b"\xAA")))
+    bus.shutdown()
+    time.sleep(0.05)
 
 
 def test_ecu_reset(client, iso14229):
@@ -16,6 +34,28 @@ def test_ecu_reset(client, iso14229):
     iso14229.assertCFuncCalled("mockSystemReset")
 
 
+def test_ecu_soft_reset(log, client, iso14229):
+    enabled = iso14229.lib.harnessCommunicationEnabled
+    enabled.restype = c_bool
+    calls = c_uint32.in_dll(iso14229.lib, "g_mockCommunicationControlCallCount")
+    client.change_session(DiagnosticSessionControl.Session.extendedDiagnosticSession)
+    resp = send_raw(client, bytes([0x28, 0x01, 0x01]))
+    assert resp == bytes([0x68, 0x01])
+    before = calls.value
+    client.ecu_reset(ECUReset.ResetType.softReset)
+    iso14229.assertCFuncCalled("mockSoftReset")
+
+    # the application is told that communication is enabled again
+    assert enabled(1, True)
+    assert calls.value == before + 1
+
+    # back in the default session with the services still enabled
+    resp = send_raw(client, bytes([0x22, 0x00, 0x01]))
+    assert resp[0] == 0x62
+    resp = send_raw(client, bytes([0x2F, 0x01, 0x00, 0x03, 0x00]))
+    assert resp == bytes([0x7F, 0x2F, 0x7F])
+
+
 # @pytest.mark.parametrize("srvcfg", [
 #     pytest.param(("boot", {}))]
 # )
@@ -85,6 +125,509 @@ def test_rdbi_multiple_did(log, client, iso14229):
     assert vals[0x0007] == (7,)
     assert vals[0x0008] == (1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20)
 
+def test_dddi_define_by_identifier(log, client, iso14229):
+    # 0xF200 := u8arr[0:4] + u16
+    resp = send_raw(client, bytes([0x2C, 0x01, 0xF2, 0x00, 0x00, 0x08, 1, 4, 0x00, 0x02, 1, 2]))
+    assert resp == bytes([0x6C, 0x01, 0xF2, 0x00])
+
+    resp = send_raw(client, bytes([0x22, 0xF2, 0x00]))
+    assert resp == bytes([0x62, 0xF2, 0x00, 1, 2, 3, 4]) + (2).to_bytes(2, sys.byteorder)
+
+    resp = send_raw(client, bytes([0x2C, 0x03, 0xF2, 0x00]))
+    assert resp == bytes([0x6C, 0x03, 0xF2, 0x00])
+
+def test_dddi_define_over_write_back(log, client, iso14229):
+    resp = send_raw(client, bytes([0x2E, 0x02, 0x00, 0x34, 0x56]))
+    assert resp == bytes([0x6E, 0x02, 0x00])
+
+    # 0xF203 := 0x0200[1:2], read from the RAM shadow
+    resp = send_raw(client, bytes([0x2C, 0x01, 0xF2, 0x03, 0x02, 0x00, 2, 1]))
+    assert resp == bytes([0x6C, 0x01, 0xF2, 0x03])
+    resp = send_raw(client, bytes([0x22, 0xF2, 0x03]))
+    assert resp == bytes([0x62, 0xF2, 0x03, 0x56])
+
+    resp = send_raw(client, bytes([0x2E, 0x02, 0x00, 0x34, 0x78]))
+    assert resp == bytes([0x6E, 0x02, 0x00])
+    resp = send_raw(client, bytes([0x22, 0xF2, 0x03]))
+    assert resp == bytes([0x62, 0xF2, 0x03, 0x78])
+
+def test_read_dtc_information_by_status_mask(log, client, iso14229):
+    count = client.get_number_of_dtc_by_status_mask(0x08).service_data.dtc_count
+    assert count == 2
+
+    dtcs = client.get_dtc_by_status_mask(0x01).service_data.dtcs
+    assert [dtc.id for dtc in dtcs] == [0x123456]
+
+def test_clear_diagnostic_information(log, client, iso14229):
+    client.control_dtc_setting(ControlDTCSetting.SettingType.off)
+    client.clear_dtc(0xFFFFFF)
+    assert client.get_number_of_dtc_by_status_mask(0x08).service_data.dtc_count == 0
+
+def test_security_access(log, client, iso14229):
+    client.unlock_security_access(1)
+    # an unlocked level is answered with an all-zero seed
+    resp = send_raw(client, bytes([0x27, 0x01]))
+    assert resp == bytes([0x67, 0x01, 0, 0, 0, 0])
+
+    resp = send_raw(client, bytes([0x27, 0x02, 0x00]))
+    assert resp == bytes([0x7F, 0x27, 0x24])
+
+    resp = send_raw(client, bytes([0x27, 0x03]))
+    assert resp == bytes([0x7F, 0x27, 0x12])
+
+def test_did_access_rule(log, client, iso14229):
+    resp = send_raw(client, bytes([0x22, 0x00, 0x09]))
+    assert resp == bytes([0x7F, 0x22, 0x33])
+
+    client.unlock_security_access(1)
+    resp = send_raw(client, bytes([0x22, 0x00, 0x09]))
+    assert resp[:3] == bytes([0x62, 0x00, 0x09])
+
+def test_subfunction_and_service_access_rules(log, client, iso14229):
+    # softReset is restricted to the extended and programming sessions
+    resp = send_raw(client, bytes([0x11, 0x03]))
+    assert resp == bytes([0x7F, 0x11, 0x7E])
+
+    # ControlDTCSetting is restricted to the extended session
+    resp = send_raw(client, bytes([0x85, 0x02]))
+    assert resp == bytes([0x7F, 0x85, 0x7F])
+
+    client.change_session(DiagnosticSessionControl.Session.extendedDiagnosticSession)
+    resp = send_raw(client, bytes([0x85, 0x02]))
+    assert resp == bytes([0xC5, 0x02])
+
+    client.change_session(DiagnosticSessionControl.Session.programmingSession)
+    resp = send_raw(client, bytes([0x85, 0x01]))
+    assert resp == bytes([0x7F, 0x85, 0x7F])
+
+def test_dynamic_did_cleared_on_relock(log, client, iso14229):
+    client.change_session(DiagnosticSessionControl.Session.extendedDiagnosticSession)
+    client.unlock_security_access(1)
+    # 0xF201 := 0x0009, which requires security level 1
+    resp = send_raw(client, bytes([0x2C, 0x01, 0xF2, 0x01, 0x00, 0x09, 1, 4]))
+    assert resp == bytes([0x6C, 0x01, 0xF2, 0x01])
+    resp = send_raw(client, bytes([0x22, 0xF2, 0x01]))
+    assert resp[:3] == bytes([0x62, 0xF2, 0x01])
+
+    # the session change relocks the server and takes 0xF201 with it
+    client.change_session(DiagnosticSessionControl.Session.programmingSession)
+    resp = send_raw(client, bytes([0x22, 0xF2, 0x01]))
+    assert resp == bytes([0x7F, 0x22, 0x31])
+
+    # definitions made while locked survive a change between non-default sessions
+    resp = send_raw(client, bytes([0x2C, 0x01, 0xF2, 0x02, 0x00, 0x01, 1, 1]))
+    assert resp == bytes([0x6C, 0x01, 0xF2, 0x02])
+    client.change_session(DiagnosticSessionControl.Session.extendedDiagnosticSession)
+    resp = send_raw(client, bytes([0x22, 0xF2, 0x02]))
+    assert resp[:3] == bytes([0x62, 0xF2, 0x02])
+
+def test_suppress_positive_response(log, client, iso14229):
+    client.conn.empty_rxqueue()
+    client.conn.send(bytes([0x3E, 0x80]))
+    assert client.conn.wait_frame(timeout=0.5) is None
+
+    # negative responses are never suppressed on the physical link
+    resp = send_raw(client, bytes([0x3E, 0x81]))
+    assert resp == bytes([0x7F, 0x3E, 0x12])
+
+def test_response_on_event(log, client, iso14229):
+    # onChangeOfDataIdentifier 0x0000, answered with ReadDataByIdentifier 0x0000
+    resp = send_raw(client, bytes([0x86, 0x03, 0x02, 0x00, 0x00, 0x22, 0x00, 0x00]))
+    assert resp == bytes([0xC6, 0x03, 0x00, 0x02, 0x00, 0x00, 0x22, 0x00, 0x00])
+
+    resp = send_raw(client, bytes([0x86, 0x05, 0x02]))
+    assert resp == bytes([0xC6, 0x05, 0x00, 0x02])
+
+    u8 = c_uint8.in_dll(iso14229.lib, "rdbiData")
+    client.conn.empty_rxqueue()
+    u8.value = (u8.value + 1) & 0xFF
+    assert client.conn.wait_frame(timeout=2, exception=True) == bytes([0x62, 0x00, 0x00, u8.value])
+
+    resp = send_raw(client, bytes([0x86, 0x06, 0x02]))
+    assert resp == bytes([0xC6, 0x06, 0x00, 0x02])
+
+def test_input_output_control(log, client, iso14229):
+    resp = send_raw(client, bytes([0x2F, 0x01, 0x00, 0x03, 0xAA]))
+    assert resp == bytes([0x7F, 0x2F, 0x7F])
+
+    client.change_session(DiagnosticSessionControl.Session.extendedDiagnosticSession)
+    resp = send_raw(client, bytes([0x2F, 0x01, 0x00, 0x03, 0xAA]))
+    assert resp == bytes([0x6F, 0x01, 0x00, 0x03, 0xAA])
+
+    # resetToDefault is not supported by this signal
+    resp = send_raw(client, bytes([0x2F, 0x01, 0x00, 0x01]))
+    assert resp == bytes([0x7F, 0x2F, 0x31])
+
+    resp = send_raw(client, bytes([0x2F, 0x01, 0x00, 0x00]))
+    assert resp == bytes([0x6F, 0x01, 0x00, 0x00, 0x55])
+
+def test_rdbi_response_cache(log, client, iso14229):
+    u8 = c_uint8.in_dll(iso14229.lib, "rdbiData")
+    resp = send_raw(client, bytes([0x22, 0x00, 0x00]))
+    assert resp == bytes([0x62, 0x00, 0x00, u8.value])
+
+    # served from the cache without reading the data again
+    old = u8.value
+    u8.value = (old + 1) & 0xFF
+    resp = send_raw(client, bytes([0x22, 0x00, 0x00]))
+    assert resp == bytes([0x62, 0x00, 0x00, old])
+
+    # a write invalidates the cached response
+    resp = send_raw(client, bytes([0x2E, 0x00, 0x00, u8.value]))
+    assert resp == bytes([0x6E, 0x00, 0x00])
+    resp = send_raw(client, bytes([0x22, 0x00, 0x00]))
+    assert resp == bytes([0x62, 0x00, 0x00, u8.value])
+
+def test_overload_busy_repeat_request(log, client, iso14229):
+    backlog = c_uint32.in_dll(iso14229.lib, "g_mockBacklog")
+    backlog.value = 100
+    time.sleep(0.1)
+    resp = send_raw(client, bytes([0x22, 0x00, 0x03]))
+    assert resp == bytes([0x7F, 0x22, 0x21])
+
+    # still overloaded until the backlog drops to the low threshold
+    backlog.value = 50
+    time.sleep(0.1)
+    resp = send_raw(client, bytes([0x22, 0x00, 0x03]))
+    assert resp == bytes([0x7F, 0x22, 0x21])
+
+    backlog.value = 20
+    time.sleep(0.1)
+    assert client.read_data_by_identifier(didlist=[0x0003]).service_data.values[0x0003] == (3,)
+
+def test_wdbi_write_back(log, client, iso14229):
+    writes = c_uint32.in_dll(iso14229.lib, "g_mockNvmWriteCount")
+    before = writes.value
+    for value in range(3):
+        resp = send_raw(client, bytes([0x2E, 0x02, 0x00, 0x12, value]))
+        assert resp == bytes([0x6E, 0x02, 0x00])
+    assert writes.value == before
+
+    # read back from the RAM shadow
+    resp = send_raw(client, bytes([0x22, 0x02, 0x00]))
+    assert resp == bytes([0x62, 0x02, 0x00, 0x12, 0x02])
+
+    # the three writes are coalesced into one
+    time.sleep(0.5)
+    assert writes.value == before + 1
+
+def test_transfer_data_repeated_block(log, client, iso14229):
+    offset = c_uint32.in_dll(iso14229.lib, "g_mockFlashOffset")
+    resp = send_raw(client, bytes([0x34, 0x00, 0x44, 0, 0, 0, 0, 0, 0, 0, 4]))
+    assert resp == bytes([0x74, 0x20, 0x00, 0x40])
+    resp = send_raw(client, bytes([0x36, 0x01, 0xAA, 0xBB]))
+    assert resp == bytes([0x76, 0x01])
+
+    # the positive response was lost and the client repeats the block
+    resp = send_raw(client, bytes([0x36, 0x01, 0xAA, 0xBB]))
+    assert resp == bytes([0x76, 0x01])
+    assert offset.value == 2
+
+    resp = send_raw(client, bytes([0x36, 0x03, 0xCC, 0xDD]))
+    assert resp == bytes([0x7F, 0x36, 0x73])
+    resp = send_raw(client, bytes([0x36, 0x02, 0xCC, 0xDD]))
+    assert resp == bytes([0x76, 0x02])
+    resp = send_raw(client, bytes([0x37]))
+    assert resp == bytes([0x77])
+
+    mock_flash = (c_uint8 * 4).in_dll(iso14229.lib, "mock_flash")
+    assert bytes(mock_flash) == bytes([0xAA, 0xBB, 0xCC, 0xDD])
+
+def test_restart_encrypted_download(log, client, iso14229):
+    # encryptingMethod 1: the data is XORed with the 4 byte IV that starts the stream
+    def encrypt(iv, data):
+        return bytes(x ^ iv[i % 4] for i, x in enumerate(data))
+
+    resp = send_raw(client, bytes([0x34, 0x01, 0x44, 0, 0, 0, 0, 0, 0, 0, 4]))
+    assert resp == bytes([0x74, 0x20, 0x00, 0x40])
+    iv = bytes([0x10, 0x20, 0x30, 0x40])
+    resp = send_raw(client, bytes([0x36, 0x01]) + iv + encrypt(iv, bytes([0x11, 0x22])))
+    assert resp == bytes([0x76, 0x01])
+
+    # the client gives up without 0x37 and starts over with a fresh IV
+    resp = send_raw(client, bytes([0x34, 0x01, 0x44, 0, 0, 0, 0, 0, 0, 0, 4]))
+    assert resp == bytes([0x74, 0x20, 0x00, 0x40])
+    iv = bytes([0x01, 0x02, 0x03, 0x04])
+    image = bytes([0xAA, 0xBB, 0xCC, 0xDD])
+    resp = send_raw(client, bytes([0x36, 0x01]) + iv + encrypt(iv, image[:2]))
+    assert resp == bytes([0x76, 0x01])
+    resp = send_raw(client, bytes([0x36, 0x02]) + encrypt(iv[2:] + iv[:2], image[2:]))
+    assert resp == bytes([0x76, 0x02])
+    assert send_raw(client, bytes([0x37])) == bytes([0x77])
+
+    mock_flash = (c_uint8 * 4).in_dll(iso14229.lib, "mock_flash")
+    assert bytes(mock_flash) == image
+
+def test_request_download_address_and_length_format(log, client, iso14229):
+    # 1 byte memoryAddress, 3 byte memorySize
+    resp = send_raw(client, bytes([0x34, 0x00, 0x31, 0x10, 0x00, 0x00, 0x80]))
+    assert resp == bytes([0x74, 0x20, 0x00, 0x40])
+    assert send_raw(client, bytes([0x37])) == bytes([0x77])
+
+    # 8 byte memoryAddress
+    address = bytes([0x00, 0x00, 0x7F, 0xFF, 0x12, 0x34, 0x56, 0x78])
+    resp = send_raw(client, bytes([0x34, 0x00, 0x18]) + address + bytes([0x80]))
+    assert resp == bytes([0x74, 0x20, 0x00, 0x40])
+    assert send_raw(client, bytes([0x37])) == bytes([0x77])
+
+    # field lengths must be 1 to 8 bytes
+    resp = send_raw(client, bytes([0x34, 0x00, 0x19]) + bytes(10))
+    assert resp == bytes([0x7F, 0x34, 0x31])
+
+def test_multicast_download(log, client, iso14229):
+    client.conn.empty_rxqueue()
+    send_functional(bytes([0x34, 0x00, 0x11, 0x00, 0x04]))
+    send_functional(bytes([0x36, 0x01, 0x01, 0x02]))
+    send_functional(bytes([0x36, 0x03, 0x05, 0x06]))  # wrong blockSequenceCounter
+    send_functional(bytes([0x36, 0x02, 0x03, 0x04]))
+    send_functional(bytes([0x37]))
+    assert client.conn.wait_frame(timeout=0.5) is None
+
+    image_hash = 2166136261
+    for b in [1, 2, 3, 4]:
+        image_hash = ((image_hash ^ b) * 16777619) & 0xFFFFFFFF
+    resp = send_raw(client, bytes([0x31, 0x01, 0xFF, 0x01]))
+    assert resp == bytes([0x71, 0x01, 0xFF, 0x01, 0x00, 0x00, 0x73, 0x01, 0x00]) + \
+        (3).to_bytes(4, "big") + (2).to_bytes(4, "big") + (1).to_bytes(4, "big") + \
+        image_hash.to_bytes(4, "big")
+
+def test_communication_control(log, client, iso14229):
+    enabled = iso14229.lib.harnessCommunicationEnabled
+    enabled.restype = c_bool
+    calls = c_uint32.in_dll(iso14229.lib, "g_mockCommunicationControlCallCount")
+    before = calls.value
+
+    # enableRxAndDisableTx, normalCommunicationMessages
+    resp = send_raw(client, bytes([0x28, 0x01, 0x01]))
+    assert resp == bytes([0x68, 0x01])
+    assert not enabled(1, True)
+    assert enabled(1, False)
+    assert enabled(2, True)
+
+    # enableRxAndTxWithEnhancedAddressInformation carries a nodeIdentificationNumber
+    resp = send_raw(client, bytes([0x28, 0x05, 0x01, 0x12, 0x34]))
+    assert resp == bytes([0x68, 0x05])
+    assert c_uint16.in_dll(iso14229.lib, "g_mockNodeIdentificationNumber").value == 0x1234
+    resp = send_raw(client, bytes([0x28, 0x05, 0x01]))
+    assert resp == bytes([0x7F, 0x28, 0x13])
+    resp = send_raw(client, bytes([0x28, 0x03, 0x00]))
+    assert resp == bytes([0x7F, 0x28, 0x31])
+
+    # communication is enabled again in the default session
+    resp = send_raw(client, bytes([0x10, 0x01]))
+    assert resp[0] == 0x50
+    assert enabled(3, True)
+    assert calls.value == before + 3
+
+def recv_periodic(duration: float) -> list:
+    """ collect the 0x2A periodic frames sent over `duration` seconds """
+    bus = VirtualBus(channel=1)
+    frames = []
+    deadline = time.time() + duration
+    while time.time() < deadline:
+        msg = bus.recv(timeout=0.01)
+        if msg and msg.arbitration_id == 0x6A8:
+            frames.append(bytes(msg.data))
+    bus.shutdown()
+    return frames
+
+def test_read_data_by_periodic_identifier(log, client, iso14229):
+    # the schedule is cleared on entering the default session, so it can't be started there
+    resp = send_raw(client, bytes([0x2A, 0x03, 0x10]))
+    assert resp == bytes([0x7F, 0x2A, 0x7F])
+    client.change_session(DiagnosticSessionControl.Session.extendedDiagnosticSession)
+
+    # sendAtFastRate: 50ms
+    resp = send_raw(client, bytes([0x2A, 0x03, 0x10]))
+    assert resp == bytes([0x6A])
+    frames = recv_periodic(0.5)
+    assert len(frames) >= 5
+    assert all(f == bytes([0x10, 0x02, 0x00]) for f in frames)
+
+    # sendAtSlowRate: 1000ms
+    resp = send_raw(client, bytes([0x2A, 0x01, 0x10]))
+    assert resp == bytes([0x6A])
+    time.sleep(0.1)
+    assert len(recv_periodic(0.5)) <= 1
+
+    # stopSending
+    resp = send_raw(client, bytes([0x2A, 0x04, 0x10]))
+    assert resp == bytes([0x6A])
+    time.sleep(0.1)
+    assert recv_periodic(1.2) == []
+
+def test_periodic_identifier_table_full(log, client, iso14229):
+    client.change_session(DiagnosticSessionControl.Session.extendedDiagnosticSession)
+    resp = send_raw(client, bytes([0x2A, 0x01, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16]))
+    assert resp == bytes([0x6A])
+    # an identifier repeated in the request takes one of the 8 entries
+    resp = send_raw(client, bytes([0x2A, 0x01, 0x17, 0x17]))
+    assert resp == bytes([0x6A])
+    resp = send_raw(client, bytes([0x2A, 0x01, 0x00]))
+    assert resp == bytes([0x7F, 0x2A, 0x31])
+    resp = send_raw(client, bytes([0x2A, 0x04]))
+    assert resp == bytes([0x6A])
+
+def test_periodic_dynamic_did(log, client, iso14229):
+    u8 = c_uint8.in_dll(iso14229.lib, "rdbiData")
+    u8.value = 0x5A
+    client.change_session(DiagnosticSessionControl.Session.extendedDiagnosticSession)
+
+    # 0xF201 := 1 byte of 0x0000, sent as periodicDataIdentifier 0x01
+    resp = send_raw(client, bytes([0x2C, 0x01, 0xF2, 0x01, 0x00, 0x00, 0x01, 0x01]))
+    assert resp == bytes([0x6C, 0x01, 0xF2, 0x01])
+    resp = send_raw(client, bytes([0x2A, 0x03, 0x01]))
+    assert resp == bytes([0x6A])
+    frames = recv_periodic(0.3)
+    assert len(frames) > 0
+    assert all(f == bytes([0x01, 0x5A]) for f in frames)
+
+    # clearing the definition stops the periodic transmission
+    resp = send_raw(client, bytes([0x2C, 0x03, 0xF2, 0x01]))
+    assert resp == bytes([0x6C, 0x03, 0xF2, 0x01])
+    time.sleep(0.1)
+    assert recv_periodic(0.3) == []
+
+def test_link_control(log, client, iso14229):
+    calls = c_uint32.in_dll(iso14229.lib, "g_mockLinkControlTransitionCallCount")
+    baudrate = c_uint32.in_dll(iso14229.lib, "g_mockLinkBaudrate")
+    before = calls.value
+
+    # transitionMode without a verify first
+    resp = send_raw(client, bytes([0x87, 0x03]))
+    assert resp == bytes([0x7F, 0x87, 0x24])
+
+    # verifyModeTransitionWithFixedParameter CAN500000Baud, then transitionMode
+    resp = send_raw(client, bytes([0x87, 0x01, 0x12]))
+    assert resp == bytes([0xC7, 0x01])
+    assert calls.value == before
+    resp = send_raw(client, bytes([0x87, 0x03]))
+    assert resp == bytes([0xC7, 0x03])
+    time.sleep(0.05)
+    assert calls.value == before + 1
+    assert baudrate.value == 500000
+
+    # a verify is good for one transition
+    resp = send_raw(client, bytes([0x87, 0x03]))
+    assert resp == bytes([0x7F, 0x87, 0x24])
+
+    # verifyModeTransitionWithSpecificParameter, rejected by the application
+    resp = send_raw(client, bytes([0x87, 0x02, 0x00, 0x25, 0x80]))
+    assert resp == bytes([0x7F, 0x87, 0x31])
+    resp = send_raw(client, bytes([0x87, 0x03]))
+    assert resp == bytes([0x7F, 0x87, 0x24])
+
+    resp = send_raw(client, bytes([0x87, 0x02, 0x03, 0xD0, 0x90]))
+    assert resp == bytes([0xC7, 0x02])
+    resp = send_raw(client, bytes([0x87, 0x03]))
+    assert resp == bytes([0xC7, 0x03])
+    time.sleep(0.05)
+    assert calls.value == before + 2
+    assert baudrate.value == 250000
+
+def test_poll_budget(log, client, iso14229):
+    # the poll task must not finish the rounds left open here
+    iso14229.poll_paused.set()
+    time.sleep(0.05)
+    step = iso14229.lib.harnessPollStep
+    step.restype = c_uint8
+    per_call = c_uint32.in_dll(iso14229.lib, "g_mockUsPerCall")
+    now = c_uint32.in_dll(iso14229.lib, "g_mock_ms").value
+    assert step() == 0
+
+    # every read of the fake clock takes 10us: a 15us budget runs two steps
+    per_call.value = 10
+    assert iso14229.lib.harnessPollBudget(now, 15) == 1
+    assert step() == 2
+    # the next call resumes at step 2 rather than starting a new round
+    assert iso14229.lib.harnessPollBudget(now, 15) == 1
+    assert step() == 4
+
+    # iso14229UserPoll finishes the open round
+    iso14229.lib.harnessPoll(now)
+    assert step() == 0
+
+    # with time to spare the round completes
+    assert iso14229.lib.harnessPollBudget(now, 1000) == 0
+    assert step() == 0
+    per_call.value = 0
+    iso14229.poll_paused.clear()
+
+def test_next_deadline(log, iso14229):
+    # drive the server by hand with a fixed clock
+    iso14229.poll_paused.set()
+    time.sleep(0.05)
+    lib = iso14229.lib
+    deadline = lib.harnessNextDeadline
+    deadline.restype = c_uint32
+    no_deadline = 0xFFFFFFFF
+    now = c_uint32.in_dll(lib, "g_mock_ms").value
+
+    def recv(data: bytes):
+        data = data.ljust(8, b"\xAA")
+        lib.harnessRecvCAN(0x7A0, (c_uint8 * 8)(*data), 8)
+
+    def poll(ms: int):
+        nonlocal now
+        lib.harnessPoll(now)
+        for _ in range(ms):
+            now += 1
+            lib.harnessPoll(now)
+
+    # the seed pool is filled one seed per poll, after that there is nothing to do
+    for _ in range(100):
+        if deadline() != 0:
+            break
+        poll(0)
+    assert deadline() == no_deadline
+
+    # P2: the response waits for the server's P2 time
+    recv(bytes([0x02, 0x10, 0x03]))
+    poll(0)
+    assert 0 < deadline() <= 51
+    poll(60)
+    # S3: the non-default session times out
+    assert 4900 < deadline() <= 5001
+
+    # taking a seed from the pool means there is work to do right away
+    recv(bytes([0x02, 0x27, 0x01]))
+    poll(0)
+    assert deadline() == 0
+    poll(0)
+    assert 0 < deadline() <= 51
+    poll(60)
+
+    # STmin: 0x0008 takes a first frame and three consecutive frames
+    recv(bytes([0x03, 0x22, 0x00, 0x08]))
+    poll(60)
+    recv(bytes([0x30, 0x00, 20]))  # flow control: STmin 20ms
+    poll(25)
+    assert 15 < deadline() <= 21
+
+    # ROE: the data identifier is sampled every ISO14229_ROE_SAMPLE_MS
+    poll(100)
+    recv(bytes([0x10, 0x08, 0x86, 0x03, 0x02, 0x00, 0x00, 0x22]))
+    poll(1)
+    recv(bytes([0x21, 0x00, 0x00]))
+    poll(60)
+    recv(bytes([0x30, 0x00, 0x00]))
+    poll(5)
+    recv(bytes([0x03, 0x86, 0x05, 0x02]))
+    poll(60)
+    assert deadline() <= 10
+
+    # back in the default session with ROE cleared, the server is idle
+    recv(bytes([0x02, 0x10, 0x01]))
+    poll(60)
+    assert deadline() == no_deadline
+    iso14229.poll_paused.clear()
+
+def test_short_requests(log, client, iso14229):
+    # requests shorter than the service's fixed fields are rejected before the handler runs
+    for req in ([0x22, 0x01], [0x2E, 0x01, 0x02], [0x31, 0x01, 0xFF], [0x34, 0x00], [0x11]):
+        resp = send_raw(client, bytes(req))
+        assert resp == bytes([0x7F, req[0], 0x13])
+
 
 if __name__ == "__main__":
     sys.exit(pytest.main([__file__]))
\ No newline at end of file
@@ -19,12 +19,37 @@ static enum Iso14229ResponseCodeEnum wdbiHandler(uint16_t dataId, const uint8_t
                                                  uint16_t len);
 
 static void mockSystemReset();
+static void mockSoftReset(uint8_t resetType);
+static int mockGenerateSeed(uint8_t *seed, uint8_t len);
+static enum Iso14229ResponseCodeEnum mockVerifyKey(uint8_t level, const uint8_t *seed,
+                                                   uint8_t seedLen, const uint8_t *key,
+                                                   uint16_t keyLen);
 static int mockWriteAppProgramFlash(uint8_t *const addr, const uint32_t len,
                                     const uint8_t *const data);
 static enum Iso14229ResponseCodeEnum mockEraseAppProgramFlash(void *userCtx,
                                                               Iso14229RoutineControlArgs *args);
 static bool mockUserApplicationIsValid();
 static void mockUserEnterApplication();
+static uint32_t mockGetBacklog();
+static uint32_t mockGetUs(void);
+static int mockNvmWrite(const Iso14229WriteBackDID *did);
+static enum Iso14229ResponseCodeEnum mockDownloadRequest(void *userCtx,
+                                                         const uint8_t dataFormatIdentifier,
+                                                         const uint64_t memoryAddress,
+                                                         const uint64_t memorySize,
+                                                         uint16_t *maxNumberOfBlockLength);
+static enum Iso14229ResponseCodeEnum mockDownloadTransfer(void *userCtx, uint8_t *data,
+                                                          uint32_t len);
+static enum Iso14229ResponseCodeEnum mockDownloadExit(void *userCtx);
+static int mockCipherInit(void *ctx);
+static int mockCipherSetIV(void *ctx, const uint8_t *iv);
+static int mockCipherDecrypt(void *ctx, uint8_t *data, uint32_t len);
+static enum Iso14229ResponseCodeEnum mockCommunicationControl(uint8_t controlType,
+                                                              uint8_t communicationType,
+                                                              uint16_t nodeIdentificationNumber);
+static enum Iso14229ResponseCodeEnum mockLinkControlVerify(uint8_t modeIdentifier,
+                                                           uint32_t baudrate);
+static void mockLinkControlTransition(uint8_t modeIdentifier, uint32_t baudrate);
 
 /*******************************************************************************
  * Preprocessor definitions
@@ -33,17 +58,32 @@ static void mockUserEnterApplication();
 #define UDS_SEND_ID 0x7A8
 #define UDS_PHYS_RECV_ID 0x7A0
 #define UDS_FUNC_RECV_ID 0x7DF
+#define UDS_PERIODIC_SEND_ID 0x6A8
 #define ISOTP_BUFSIZE 8192
+#define DTC_STORE_CAPACITY 16
+#define MOCK_FLASH_SIZE 256
+#define MOCK_CIPHER_IV_LEN 4
 
 /*******************************************************************************
  * Global variable definitions
  ******************************************************************************/
 
 uint32_t g_mockSystemResetCallCount = 0;
+uint32_t g_mockSoftResetCallCount = 0;
 uint32_t g_mockEraseProgramFlashCallCount = 0;
 bool g_mockUserApplicationIsValid = true;
 uint32_t g_mockUserApplicationIsValidCallCount = 0;
 uint32_t g_mock_ms = 0; // 时间
+uint32_t g_mock_us = 0;
+uint32_t g_mockUsPerCall = 0; // how far g_mock_us advances on each read
+uint32_t g_mockBacklog = 0;
+uint32_t g_mockNvmWriteCount = 0;
+uint8_t mock_flash[MOCK_FLASH_SIZE];
+uint32_t g_mockFlashOffset = 0;
+uint32_t g_mockCommunicationControlCallCount = 0;
+uint16_t g_mockNodeIdentificationNumber = 0;
+uint32_t g_mockLinkControlTransitionCallCount = 0;
+uint32_t g_mockLinkBaudrate = 0;
 
 /*******************************************************************************
  * Local variable definitions ('static')
@@ -62,18 +102,156 @@ static IsoTpLink isotpFuncLink;
 
 static Iso14229Instance uds;
 
+static uint8_t dtcs[3 * DTC_STORE_CAPACITY];
+static uint8_t dtcStatuses[DTC_STORE_CAPACITY];
+static uint16_t dtcSortedIndex[DTC_STORE_CAPACITY];
+
+static const Iso14229DTCStoreConfig dtcStoreCfg = {
+    .dtcs = dtcs,
+    .statuses = dtcStatuses,
+    .sortedIndex = dtcSortedIndex,
+    .capacity = DTC_STORE_CAPACITY,
+    .statusAvailabilityMask = 0xFF,
+};
+
+static uint8_t ioEcuValue[1] = {0x55};
+static uint8_t ioOverride[1];
+static const uint8_t *ioActive;
+
+static const Iso14229IOControl ioControl = {
+    .dataId = 0x0100,
+    .size = sizeof(ioEcuValue),
+    .ecuValue = ioEcuValue,
+    .override = ioOverride,
+    .active = &ioActive,
+    .controlParameters = ISO14229_IO_CONTROL_PARAMETER(kReturnControlToECU) |
+                         ISO14229_IO_CONTROL_PARAMETER(kFreezeCurrentState) |
+                         ISO14229_IO_CONTROL_PARAMETER(kShortTermAdjustment),
+};
+
+static const Iso14229SecurityAccessConfig securityAccessCfg = {
+    .supportedLevels = 1 << 1,
+    .seedLength = 4,
+    .maxAttempts = 3,
+    .delay_ms = 10000,
+    .userGenerateSeed = mockGenerateSeed,
+    .userVerifyKeyStart = mockVerifyKey,
+};
+
+static const Iso14229AccessRule accessRules[] = {
+    {
+        .sid = kSID_ECU_RESET,
+        .type = kAccessRuleSubFunction,
+        .id = kSoftReset,
+        .sessions = ISO14229_SESSION_MASK(kDiagModeExtendedDiagnostic) |
+                    ISO14229_SESSION_MASK(kDiagModeProgramming),
+        .securityLevels = ISO14229_ALL_SECURITY_LEVELS,
+    },
+    {
+        .sid = kSID_READ_DATA_BY_IDENTIFIER,
+        .type = kAccessRuleDataIdentifier,
+        .id = 0x0009,
+        .sessions = ISO14229_ALL_SESSIONS,
+        .securityLevels = ISO14229_SECURITY_MASK(1),
+    },
+    {
+        .sid = kSID_CONTROL_DTC_SETTING,
+        .type = kAccessRuleService,
+        .sessions = ISO14229_SESSION_MASK(kDiagModeExtendedDiagnostic),
+        .securityLevels = ISO14229_ALL_SECURITY_LEVELS,
+    },
+};
+
+static const Iso14229CacheRule cacheRules[] = {
+    {.dataId = 0x0000, .ttl_ms = ISO14229_CACHE_TTL_UNTIL_INVALIDATED},
+};
+static Iso14229CacheEntry cacheEntries[2];
+static uint8_t cachedResponses[2 * 16];
+
+static const Iso14229ResponseCacheConfig responseCacheCfg = {
+    .rules = cacheRules,
+    .nRules = sizeof(cacheRules) / sizeof(cacheRules[0]),
+    .entries = cacheEntries,
+    .responses = cachedResponses,
+    .responseSize = 16,
+    .nEntries = 2,
+};
+
+static Iso14229DownloadHandler downloadHandler;
+
+/* XORs the data with the repeated IV, see test_restart_encrypted_download */
+static struct {
+    uint8_t iv[MOCK_CIPHER_IV_LEN];
+    uint32_t pos;
+} mockCipherCtx;
+
+static const Iso14229Cipher mockCipher = {
+    .encryptingMethod = 0x1,
+    .init = mockCipherInit,
+    .ivLength = MOCK_CIPHER_IV_LEN,
+    .setIV = mockCipherSetIV,
+    .decrypt = mockCipherDecrypt,
+    .ctx = &mockCipherCtx,
+};
+
+static Iso14229DownloadHandlerConfig downloadHandlerCfg = {
+    .onRequest = mockDownloadRequest,
+    .onTransfer = mockDownloadTransfer,
+    .onExit = mockDownloadExit,
+    .ciphers = &mockCipher,
+    .nCiphers = 1,
+    .functional = true,
+};
+
+static const Iso14229Routine downloadResultsRoutine = {
+    .routineIdentifier = 0xFF01,
+    .startRoutine = iso14229DownloadResultsRoutine,
+    .userCtx = &downloadHandler,
+};
+
+static uint8_t nvmShadow[2];
+
+static const Iso14229WriteBackDID writeBackDIDs[] = {
+    {.dataId = 0x0200, .size = sizeof(nvmShadow), .shadow = nvmShadow},
+};
+
+static const Iso14229WriteBackConfig writeBackCfg = {
+    .dids = writeBackDIDs,
+    .nDIDs = sizeof(writeBackDIDs) / sizeof(writeBackDIDs[0]),
+    .nvmWriteDelay_ms = 200,
+    .userNvmWrite = mockNvmWrite,
+};
+
+static const Iso14229OverloadConfig overloadCfg = {
+    .backlog = {.high = 100, .low = 20},
+    .userGetBacklog = mockGetBacklog,
+};
+
 static Iso14229ServerConfig uds_srv_cfg = {
     .phys_recv_id = UDS_PHYS_RECV_ID,
     .func_recv_id = UDS_FUNC_RECV_ID,
     .send_id = UDS_SEND_ID,
+    .periodic_send_id = UDS_PERIODIC_SEND_ID,
     .phys_link = &isotpPhysLink,
     .func_link = &isotpFuncLink,
     .userRDBIHandler = rdbiHandler,
     .userWDBIHandler = wdbiHandler,
     .userHardReset = mockSystemReset,
+    .userSoftReset = mockSoftReset,
+    .userGetUs = mockGetUs,
+    .userCommunicationControl = mockCommunicationControl,
+    .userLinkControlVerify = mockLinkControlVerify,
+    .userLinkControlTransition = mockLinkControlTransition,
     .p2_ms = 50,
     .p2_star_ms = 2000,
     .s3_ms = 5000,
+    .dtcStore = &dtcStoreCfg,
+    .securityAccess = &securityAccessCfg,
+    .accessRules = accessRules,
+    .nAccessRules = sizeof(accessRules) / sizeof(accessRules[0]),
+    .responseCache = &responseCacheCfg,
+    .writeBack = &writeBackCfg,
+    .overload = &overloadCfg,
 };
 
 typedef struct {
@@ -135,6 +313,12 @@ enum Iso14229ResponseCodeEnum rdbiHandler(uint16_t dataId, uint8_t **data_locati
     case 0x0008:
         SET_TO(u8arr);
         break;
+    case 0x0009: // requires security level 1, see accessRules
+        SET_TO(u32);
+        break;
+    case 0xF210 ... 0xF217: // periodicDataIdentifiers 0x10-0x17
+        SET_TO(u16);
+        break;
     default:
         return kRequestOutOfRange;
     }
@@ -151,6 +335,102 @@ enum Iso14229ResponseCodeEnum wdbiHandler(uint16_t dataId, const uint8_t *data,
 
 void mockSystemReset() { g_mockSystemResetCallCount++; }
 
+static void mockSoftReset(uint8_t resetType) { g_mockSoftResetCallCount++; }
+
+static uint32_t mockGetBacklog() { return g_mockBacklog; }
+
+static uint32_t mockGetUs(void) {
+    uint32_t now = g_mock_us;
+    g_mock_us += g_mockUsPerCall;
+    return now;
+}
+
+static int mockNvmWrite(const Iso14229WriteBackDID *did) {
+    (void)did;
+    g_mockNvmWriteCount++;
+    return 0;
+}
+
+static enum Iso14229ResponseCodeEnum mockCommunicationControl(uint8_t controlType,
+                                                              uint8_t communicationType,
+                                                              uint16_t nodeIdentificationNumber) {
+    g_mockCommunicationControlCallCount++;
+    g_mockNodeIdentificationNumber = nodeIdentificationNumber;
+    return kPositiveResponse;
+}
+
+/* CAN bit rates only */
+static enum Iso14229ResponseCodeEnum mockLinkControlVerify(uint8_t modeIdentifier,
+                                                           uint32_t baudrate) {
+    (void)modeIdentifier;
+    return (baudrate >= 125000 && baudrate <= 1000000) ? kPositiveResponse : kRequestOutOfRange;
+}
+
+static void mockLinkControlTransition(uint8_t modeIdentifier, uint32_t baudrate) {
+    (void)modeIdentifier;
+    g_mockLinkControlTransitionCallCount++;
+    g_mockLinkBaudrate = baudrate;
+}
+
+static enum Iso14229ResponseCodeEnum mockDownloadRequest(void *userCtx,
+                                                         const uint8_t dataFormatIdentifier,
+                                                         const uint64_t memoryAddress,
+                                                         const uint64_t memorySize,
+                                                         uint16_t *maxNumberOfBlockLength) {
+    if (memorySize > MOCK_FLASH_SIZE) {
+        return kRequestOutOfRange;
+    }
+    g_mockFlashOffset = 0;
+    *maxNumberOfBlockLength = 64;
+    return kPositiveResponse;
+}
+
+static enum Iso14229ResponseCodeEnum mockDownloadTransfer(void *userCtx, uint8_t *data,
+                                                          uint32_t len) {
+    if (g_mockFlashOffset + len > MOCK_FLASH_SIZE) {
+        return kTransferDataSuspended;
+    }
+    memcpy(mock_flash + g_mockFlashOffset, data, len);
+    g_mockFlashOffset += len;
+    return kPositiveResponse;
+}
+
+static enum Iso14229ResponseCodeEnum mockDownloadExit(void *userCtx) { return kPositiveResponse; }
+
+static int mockCipherInit(void *ctx) {
+    memset(ctx, 0, sizeof(mockCipherCtx));
+    return 0;
+}
+
+static int mockCipherSetIV(void *ctx, const uint8_t *iv) {
+    memcpy(mockCipherCtx.iv, iv, MOCK_CIPHER_IV_LEN);
+    return 0;
+}
+
+static int mockCipherDecrypt(void *ctx, uint8_t *data, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++, mockCipherCtx.pos++) {
+        data[i] ^= mockCipherCtx.iv[mockCipherCtx.pos % MOCK_CIPHER_IV_LEN];
+    }
+    return 0;
+}
+
+static int mockGenerateSeed(uint8_t *seed, uint8_t len) {
+    for (uint8_t i = 0; i < len; i++) {
+        seed[i] = (uint8_t)(g_mock_ms + i) | 1;
+    }
+    return 0;
+}
+
+/* matches security_algo in conftest.py */
+static enum Iso14229ResponseCodeEnum mockVerifyKey(uint8_t level, const uint8_t *seed,
+                                                   uint8_t seedLen, const uint8_t *key,
+                                                   uint16_t keyLen) {
+    (void)level;
+    (void)seed;
+    (void)seedLen;
+    return (1 == keyLen && 0 == key[0]) ? kPositiveResponse : kInvalidKey;
+}
+
 int mockWriteAppProgramFlash(uint8_t *const addr, const uint32_t len, const uint8_t *const data) {
     return 0;
 }
@@ -194,8 +474,32 @@ int harnessInit() {
                     ISOTP_BUFSIZE);
 
     int retval = iso14229UserInit(&uds, (const Iso14229ServerConfig *)&uds_srv_cfg);
+    iso14229UserEnableService(&uds, kSID_DIAGNOSTIC_SESSION_CONTROL);
     iso14229UserEnableService(&uds, kSID_ECU_RESET);
     iso14229UserEnableService(&uds, kSID_READ_DATA_BY_IDENTIFIER);
+    iso14229UserEnableService(&uds, kSID_WRITE_DATA_BY_IDENTIFIER);
+    iso14229UserEnableService(&uds, kSID_SECURITY_ACCESS);
+    iso14229UserEnableService(&uds, kSID_READ_DATA_BY_PERIODIC_IDENTIFIER);
+    iso14229UserEnableService(&uds, kSID_DYNAMICALLY_DEFINE_DATA_IDENTIFIER);
+    iso14229UserEnableService(&uds, kSID_READ_DTC_INFORMATION);
+    iso14229UserEnableService(&uds, kSID_CLEAR_DIAGNOSTIC_INFORMATION);
+    iso14229UserEnableService(&uds, kSID_CONTROL_DTC_SETTING);
+    iso14229UserEnableService(&uds, kSID_RESPONSE_ON_EVENT);
+    iso14229UserEnableService(&uds, kSID_INPUT_OUTPUT_CONTROL_BY_IDENTIFIER);
+    iso14229UserEnableService(&uds, kSID_REQUEST_DOWNLOAD);
+    iso14229UserEnableService(&uds, kSID_TRANSFER_DATA);
+    iso14229UserEnableService(&uds, kSID_REQUEST_TRANSFER_EXIT);
+    iso14229UserEnableService(&uds, kSID_ROUTINE_CONTROL);
+    iso14229UserEnableService(&uds, kSID_COMMUNICATION_CONTROL);
+    iso14229UserEnableService(&uds, kSID_LINK_CONTROL);
+
+    iso14229UserRegisterIOControl(&uds, &ioControl);
+    iso14229UserRegisterDownloadHandler(&uds, &downloadHandler, &downloadHandlerCfg);
+    iso14229UserRegisterRoutine(&uds, &downloadResultsRoutine);
+
+    dtcStatuses[iso14229UserAddDTC(&uds, 0x123456)] = 0x09; // testFailed | confirmedDTC
+    dtcStatuses[iso14229UserAddDTC(&uds, 0x000102)] = 0x08; // confirmedDTC
+    dtcStatuses[iso14229UserAddDTC(&uds, 0xABCDEF)] = 0x00;
     return retval;
 }
 
@@ -208,6 +512,33 @@ void harnessPoll(uint32_t time_now_ms) {
     iso14229UserPoll(&uds);
 }
 
+/**
+ * @brief run the iso14229 main loop for at most `budget` microseconds of
+ * g_mock_us
+ * @return iso14229UserPollBudget's result
+ */
+int harnessPollBudget(uint32_t time_now_ms, uint32_t budget) {
+    g_mock_ms = time_now_ms;
+    return iso14229UserPollBudget(&uds, budget);
+}
+
+/**
+ * @brief milliseconds until the next poll has work to do
+ */
+uint32_t harnessNextDeadline() { return iso14229UserNextDeadline(&uds); }
+
+/**
+ * @brief the step the next iso14229UserPollBudget call resumes from
+ */
+uint8_t harnessPollStep() { return uds.poll.step; }
+
+/**
+ * @brief state of 0x28 CommunicationControl as seen by the application
+ */
+bool harnessCommunicationEnabled(uint8_t messageType, bool tx) {
+    return iso14229UserCommunicationEnabled(&uds, messageType, tx);
+}
+
 /**
  * @brief implementation of iso14229 extern function
  */
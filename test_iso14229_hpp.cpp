@@ -0,0 +1,135 @@
+/**
+ * @file test_iso14229_hpp.cpp
+ * @brief run with
+ * `gcc -Iisotp -c iso14229.c isotp/isotp.c &&
+ *  g++ -std=c++17 -fno-rtti -fno-exceptions -Iisotp test_iso14229_hpp.cpp iso14229.o isotp.o &&
+ *  ./a.out`
+ */
+
+#include "iso14229.hpp"
+#include <assert.h>
+#include <stdio.h>
+
+using iso14229::ResponseCode;
+
+static uint32_t g_ms = 0;
+extern "C" uint32_t iso14229UserGetms() { return g_ms; }
+extern "C" uint32_t iso14229UserSendCAN(const uint32_t, const uint8_t *, const uint8_t) {
+    return 0;
+}
+
+static uint8_t g_vin[4] = {'V', 'I', 'N', '1'};
+static uint8_t g_counter = 0;
+static int g_startCount = 0;
+
+static ResponseCode readVin(uint8_t **data_location, uint16_t *len) {
+    *data_location = g_vin;
+    *len = sizeof(g_vin);
+    return kPositiveResponse;
+}
+
+static ResponseCode readCounter(uint8_t **data_location, uint16_t *len) {
+    *data_location = &g_counter;
+    *len = 1;
+    return kPositiveResponse;
+}
+
+static ResponseCode writeCounter(const uint8_t *data, uint16_t len) {
+    if (len != 1) {
+        return kIncorrectMessageLengthOrInvalidFormat;
+    }
+    g_counter = data[0];
+    return kPositiveResponse;
+}
+
+static ResponseCode startSelfTest(Iso14229RoutineControlArgs *args) {
+    g_startCount++;
+    args->statusRecord[0] = 0x5A;
+    *args->statusRecordLength = 1;
+    return kPositiveResponse;
+}
+
+// declared out of order: the table is sorted at compile time
+using TestDids = iso14229::Dids<iso14229::Did<0xF190, readVin>,
+                                iso14229::Did<0x0100, readCounter, writeCounter>,
+                                iso14229::Did<0x0200, nullptr, writeCounter>>;
+static_assert(TestDids::table[0].id == 0x0100);
+static_assert(TestDids::table[1].id == 0x0200);
+static_assert(TestDids::table[2].id == 0xF190);
+static_assert(TestDids::find(0xF190) == &TestDids::table[2]);
+static_assert(TestDids::find(0x0101) == nullptr);
+
+using TestServices =
+    iso14229::BuiltinServices<kSID_READ_DATA_BY_IDENTIFIER, kSID_WRITE_DATA_BY_IDENTIFIER,
+                              kSID_ROUTINE_CONTROL>;
+static_assert(TestServices::table[ISO14229_SID_INDEX(kSID_READ_DATA_BY_IDENTIFIER)] ==
+              iso14229ReadDataByIdentifier);
+static_assert(TestServices::table[ISO14229_SID_INDEX(kSID_ECU_RESET)] == nullptr);
+
+using TestRoutines = iso14229::Routines<iso14229::Routine<0x0301, startSelfTest>>;
+static_assert(iso14229::Routine<0x0301, startSelfTest>::routine.stopRoutine == nullptr);
+
+using TestServer = iso14229::Server<TestServices, TestDids, TestRoutines>;
+
+static uint8_t g_physRx[64], g_physTx[64], g_funcRx[64], g_funcTx[64];
+static IsoTpLink g_physLink, g_funcLink;
+static TestServer g_server;
+
+static void request(const uint8_t *buf, uint16_t size) {
+    Iso14229Instance *self = g_server.instance();
+    self->tport_send.pending = false;
+    iso14229CallRequestedService(self, buf, size, false);
+}
+
+static void expect(const uint8_t *buf, uint16_t size) {
+    const TportSend *tport = &g_server.instance()->tport_send;
+    assert(tport->pending);
+    assert(tport->buf_len_used == size);
+    assert(0 == memcmp(tport->buf.raw, buf, size));
+}
+
+int main() {
+    isotp_init_link(&g_physLink, 0x7A8, g_physTx, sizeof(g_physTx), g_physRx, sizeof(g_physRx));
+    isotp_init_link(&g_funcLink, 0x7A8, g_funcTx, sizeof(g_funcTx), g_funcRx, sizeof(g_funcRx));
+    Iso14229ServerConfig cfg = {};
+    cfg.phys_link = &g_physLink;
+    cfg.func_link = &g_funcLink;
+    cfg.p2_ms = 50;
+    cfg.s3_ms = 5000;
+    assert(0 == g_server.init(cfg));
+    assert(cfg.serviceTable == TestServices::table.data());
+
+    const uint8_t rdbi[] = {0x22, 0xF1, 0x90, 0x01, 0x00};
+    const uint8_t rdbiResponse[] = {0x62, 0xF1, 0x90, 'V', 'I', 'N', '1', 0x01, 0x00, 0x00};
+    request(rdbi, sizeof(rdbi));
+    expect(rdbiResponse, sizeof(rdbiResponse));
+
+    // 0x0200 is write-only, 0x0101 does not exist
+    const uint8_t rdbiWriteOnly[] = {0x22, 0x02, 0x00};
+    const uint8_t rdbiUnknown[] = {0x22, 0x01, 0x01};
+    const uint8_t outOfRange[] = {0x7F, 0x22, 0x31};
+    request(rdbiWriteOnly, sizeof(rdbiWriteOnly));
+    expect(outOfRange, sizeof(outOfRange));
+    request(rdbiUnknown, sizeof(rdbiUnknown));
+    expect(outOfRange, sizeof(outOfRange));
+
+    const uint8_t wdbi[] = {0x2E, 0x01, 0x00, 0x42};
+    const uint8_t wdbiResponse[] = {0x6E, 0x01, 0x00};
+    request(wdbi, sizeof(wdbi));
+    expect(wdbiResponse, sizeof(wdbiResponse));
+    assert(0x42 == g_counter);
+
+    const uint8_t routine[] = {0x31, 0x01, 0x03, 0x01};
+    const uint8_t routineResponse[] = {0x71, 0x01, 0x03, 0x01, 0x00, 0x5A}; // routineInfo 0
+    request(routine, sizeof(routine));
+    expect(routineResponse, sizeof(routineResponse));
+    assert(1 == g_startCount);
+
+    // services missing from the set are not supported
+    const uint8_t ecuReset[] = {0x11, 0x01};
+    const uint8_t serviceNotSupported[] = {0x7F, 0x11, 0x11};
+    request(ecuReset, sizeof(ecuReset));
+    expect(serviceNotSupported, sizeof(serviceNotSupported));
+
+    printf("pass\n");
+}
@@ -0,0 +1,202 @@
+/**
+ * @file test_lz4decoder.c
+ * @brief run with `gcc test_lz4decoder.c && ./a.out`
+ */
+
+#include "lz4decoder.h"
+#include <assert.h>
+#include <stdio.h>
+
+#define DECOMPRESSED_SIZE 1024
+
+// lz4 -B256 -BD -BX --content-size: dependent 256 byte blocks, block and
+// content checksums. The third block is stored uncompressed.
+static const uint8_t g_linkedBlocks[] = {
+    0x04, 0x22, 0x4d, 0x18, 0x5c, 0x40, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0xa0, 0x4f, 0x00, 0x00, 0x00, 0xf1, 0x01, 0x69, 0x69, 0x69,
+    0x73, 0x73, 0x73, 0x6f, 0x6f, 0x6f, 0x31, 0x31, 0x31, 0x34, 0x34, 0x34,
+    0x32, 0x01, 0x00, 0xff, 0x21, 0x39, 0x39, 0x39, 0x20, 0x20, 0x20, 0x74,
+    0x74, 0x74, 0x72, 0x72, 0x72, 0x61, 0x61, 0x61, 0x6e, 0x6e, 0x6e, 0x73,
+    0x73, 0x73, 0x66, 0x66, 0x66, 0x65, 0x65, 0x65, 0x72, 0x72, 0x72, 0x20,
+    0x20, 0x20, 0x64, 0x64, 0x64, 0x61, 0x61, 0x61, 0x74, 0x74, 0x74, 0x61,
+    0x61, 0x61, 0x20, 0x20, 0x20, 0x45, 0x00, 0xa3, 0x50, 0x66, 0x65, 0x65,
+    0x65, 0x72, 0x03, 0xfa, 0x75, 0x8f, 0x4f, 0x00, 0x00, 0x00, 0xf1, 0x15,
+    0x73, 0x73, 0x21, 0x21, 0x21, 0x65, 0x65, 0x65, 0x62, 0x62, 0x62, 0x75,
+    0x75, 0x75, 0x62, 0x62, 0x62, 0x21, 0x21, 0x21, 0x6a, 0x6a, 0x6a, 0x74,
+    0x74, 0x74, 0x70, 0x70, 0x70, 0x32, 0x32, 0x32, 0x35, 0x35, 0x35, 0x33,
+    0x01, 0x00, 0xff, 0x0d, 0x3a, 0x3a, 0x3a, 0x21, 0x21, 0x21, 0x75, 0x75,
+    0x75, 0x73, 0x73, 0x73, 0x62, 0x62, 0x62, 0x6f, 0x6f, 0x6f, 0x74, 0x74,
+    0x74, 0x67, 0x67, 0x67, 0x66, 0x66, 0x66, 0x73, 0x45, 0x00, 0xa3, 0x50,
+    0x21, 0x21, 0x21, 0x75, 0x75, 0x79, 0x2d, 0xcf, 0xeb, 0x00, 0x01, 0x00,
+    0x80, 0xc6, 0x7e, 0x81, 0x6b, 0x4b, 0xfb, 0xe2, 0xfb, 0x54, 0xf6, 0xbd,
+    0xdf, 0x7c, 0x1c, 0xe1, 0x87, 0x01, 0xbf, 0x31, 0xde, 0x56, 0x72, 0x0f,
+    0x47, 0x67, 0x66, 0x87, 0x59, 0xaa, 0x88, 0x3c, 0x59, 0xea, 0x56, 0x13,
+    0x7b, 0xd2, 0x85, 0xa1, 0xd8, 0x3c, 0x54, 0x55, 0x2f, 0x37, 0xae, 0x65,
+    0x5b, 0xda, 0x02, 0x79, 0x98, 0xcc, 0xe3, 0x1a, 0x76, 0x8e, 0x5f, 0xd9,
+    0x99, 0x8f, 0x1f, 0x3f, 0x36, 0xee, 0x43, 0x78, 0x4d, 0x0d, 0xfa, 0xbe,
+    0xa6, 0xda, 0xe4, 0x86, 0x8e, 0xdc, 0x29, 0x6d, 0x4e, 0xff, 0x56, 0xe1,
+    0x70, 0x20, 0xfb, 0x8f, 0xb1, 0x58, 0x05, 0x90, 0xc5, 0x09, 0xdc, 0x53,
+    0xcd, 0xaa, 0x3b, 0x48, 0x99, 0x52, 0xd3, 0x52, 0x9d, 0x06, 0x9f, 0xea,
+    0xb5, 0xc2, 0x06, 0x13, 0x98, 0x49, 0xb2, 0x01, 0x1e, 0xac, 0x32, 0x88,
+    0x31, 0x9c, 0x52, 0x46, 0x95, 0x71, 0x36, 0x8f, 0x57, 0xf6, 0x39, 0x1d,
+    0x16, 0xfa, 0x88, 0x74, 0xf5, 0x98, 0x7c, 0x17, 0x5c, 0x41, 0xbb, 0x6d,
+    0x71, 0x8e, 0x0f, 0x70, 0x59, 0xc7, 0x01, 0x1b, 0x2f, 0x33, 0x3d, 0x91,
+    0xc0, 0x1d, 0xa5, 0x0d, 0x0d, 0xab, 0x33, 0x8d, 0x7e, 0x5e, 0x8f, 0x3e,
+    0xe6, 0x68, 0x74, 0xa6, 0x3a, 0xb1, 0xc3, 0x93, 0x11, 0xa8, 0x64, 0xc7,
+    0xdb, 0xca, 0xe0, 0x60, 0xe1, 0xf3, 0xbf, 0x09, 0x00, 0x67, 0xa2, 0xe3,
+    0x25, 0xa0, 0x21, 0x31, 0x87, 0xd5, 0x62, 0xc5, 0xa8, 0x4f, 0x7e, 0x2e,
+    0x09, 0x6b, 0x94, 0x9f, 0xb0, 0x6d, 0xa9, 0x9e, 0x5a, 0x0b, 0x46, 0x70,
+    0x80, 0xb6, 0xcf, 0x47, 0x0c, 0xa6, 0xa5, 0x2a, 0xd8, 0xac, 0xfb, 0xa0,
+    0xeb, 0xb7, 0x79, 0x24, 0x72, 0x23, 0x92, 0x48, 0x80, 0xc5, 0xa6, 0xa7,
+    0x85, 0xb7, 0xd7, 0x8c, 0x90, 0xe4, 0xab, 0x63, 0x44, 0x52, 0x66, 0xe3,
+    0x9c, 0x33, 0x25, 0xf9, 0x5e, 0x80, 0x27, 0xdc, 0x8c, 0x4e, 0x00, 0x00,
+    0x00, 0x71, 0x34, 0x34, 0x34, 0x37, 0x37, 0x37, 0x35, 0x01, 0x00, 0xff,
+    0x2a, 0x3c, 0x3c, 0x3c, 0x23, 0x23, 0x23, 0x77, 0x77, 0x77, 0x75, 0x75,
+    0x75, 0x64, 0x64, 0x64, 0x71, 0x71, 0x71, 0x76, 0x76, 0x76, 0x69, 0x69,
+    0x69, 0x68, 0x68, 0x68, 0x75, 0x75, 0x75, 0x23, 0x23, 0x23, 0x67, 0x67,
+    0x67, 0x64, 0x64, 0x64, 0x77, 0x77, 0x77, 0x64, 0x64, 0x64, 0x23, 0x23,
+    0x23, 0x6c, 0x6c, 0x6c, 0x76, 0x76, 0x76, 0x72, 0x72, 0x72, 0x45, 0x00,
+    0xa3, 0x50, 0x23, 0x67, 0x67, 0x67, 0x64, 0x9a, 0x06, 0x4c, 0xfa, 0x00,
+    0x00, 0x00, 0x00, 0xa6, 0xd7, 0x18, 0xec,
+};
+
+// lz4 --no-frame-crc: a single independent block
+static const uint8_t g_singleBlock[] = {
+    0x04, 0x22, 0x4d, 0x18, 0x60, 0x40, 0x82, 0xe3, 0x01, 0x00, 0x00, 0xf1,
+    0x01, 0x69, 0x69, 0x69, 0x73, 0x73, 0x73, 0x6f, 0x6f, 0x6f, 0x31, 0x31,
+    0x31, 0x34, 0x34, 0x34, 0x32, 0x01, 0x00, 0xff, 0x21, 0x39, 0x39, 0x39,
+    0x20, 0x20, 0x20, 0x74, 0x74, 0x74, 0x72, 0x72, 0x72, 0x61, 0x61, 0x61,
+    0x6e, 0x6e, 0x6e, 0x73, 0x73, 0x73, 0x66, 0x66, 0x66, 0x65, 0x65, 0x65,
+    0x72, 0x72, 0x72, 0x20, 0x20, 0x20, 0x64, 0x64, 0x64, 0x61, 0x61, 0x61,
+    0x74, 0x74, 0x74, 0x61, 0x61, 0x61, 0x20, 0x20, 0x20, 0x45, 0x00, 0xa8,
+    0xf1, 0x15, 0x73, 0x73, 0x21, 0x21, 0x21, 0x65, 0x65, 0x65, 0x62, 0x62,
+    0x62, 0x75, 0x75, 0x75, 0x62, 0x62, 0x62, 0x21, 0x21, 0x21, 0x6a, 0x6a,
+    0x6a, 0x74, 0x74, 0x74, 0x70, 0x70, 0x70, 0x32, 0x32, 0x32, 0x35, 0x35,
+    0x35, 0x33, 0x01, 0x00, 0xff, 0x0d, 0x3a, 0x3a, 0x3a, 0x21, 0x21, 0x21,
+    0x75, 0x75, 0x75, 0x73, 0x73, 0x73, 0x62, 0x62, 0x62, 0x6f, 0x6f, 0x6f,
+    0x74, 0x74, 0x74, 0x67, 0x67, 0x67, 0x66, 0x66, 0x66, 0x73, 0x45, 0x00,
+    0xa8, 0xff, 0xff, 0x37, 0xc6, 0x7e, 0x81, 0x6b, 0x4b, 0xfb, 0xe2, 0xfb,
+    0x54, 0xf6, 0xbd, 0xdf, 0x7c, 0x1c, 0xe1, 0x87, 0x01, 0xbf, 0x31, 0xde,
+    0x56, 0x72, 0x0f, 0x47, 0x67, 0x66, 0x87, 0x59, 0xaa, 0x88, 0x3c, 0x59,
+    0xea, 0x56, 0x13, 0x7b, 0xd2, 0x85, 0xa1, 0xd8, 0x3c, 0x54, 0x55, 0x2f,
+    0x37, 0xae, 0x65, 0x5b, 0xda, 0x02, 0x79, 0x98, 0xcc, 0xe3, 0x1a, 0x76,
+    0x8e, 0x5f, 0xd9, 0x99, 0x8f, 0x1f, 0x3f, 0x36, 0xee, 0x43, 0x78, 0x4d,
+    0x0d, 0xfa, 0xbe, 0xa6, 0xda, 0xe4, 0x86, 0x8e, 0xdc, 0x29, 0x6d, 0x4e,
+    0xff, 0x56, 0xe1, 0x70, 0x20, 0xfb, 0x8f, 0xb1, 0x58, 0x05, 0x90, 0xc5,
+    0x09, 0xdc, 0x53, 0xcd, 0xaa, 0x3b, 0x48, 0x99, 0x52, 0xd3, 0x52, 0x9d,
+    0x06, 0x9f, 0xea, 0xb5, 0xc2, 0x06, 0x13, 0x98, 0x49, 0xb2, 0x01, 0x1e,
+    0xac, 0x32, 0x88, 0x31, 0x9c, 0x52, 0x46, 0x95, 0x71, 0x36, 0x8f, 0x57,
+    0xf6, 0x39, 0x1d, 0x16, 0xfa, 0x88, 0x74, 0xf5, 0x98, 0x7c, 0x17, 0x5c,
+    0x41, 0xbb, 0x6d, 0x71, 0x8e, 0x0f, 0x70, 0x59, 0xc7, 0x01, 0x1b, 0x2f,
+    0x33, 0x3d, 0x91, 0xc0, 0x1d, 0xa5, 0x0d, 0x0d, 0xab, 0x33, 0x8d, 0x7e,
+    0x5e, 0x8f, 0x3e, 0xe6, 0x68, 0x74, 0xa6, 0x3a, 0xb1, 0xc3, 0x93, 0x11,
+    0xa8, 0x64, 0xc7, 0xdb, 0xca, 0xe0, 0x60, 0xe1, 0xf3, 0xbf, 0x09, 0x00,
+    0x67, 0xa2, 0xe3, 0x25, 0xa0, 0x21, 0x31, 0x87, 0xd5, 0x62, 0xc5, 0xa8,
+    0x4f, 0x7e, 0x2e, 0x09, 0x6b, 0x94, 0x9f, 0xb0, 0x6d, 0xa9, 0x9e, 0x5a,
+    0x0b, 0x46, 0x70, 0x80, 0xb6, 0xcf, 0x47, 0x0c, 0xa6, 0xa5, 0x2a, 0xd8,
+    0xac, 0xfb, 0xa0, 0xeb, 0xb7, 0x79, 0x24, 0x72, 0x23, 0x92, 0x48, 0x80,
+    0xc5, 0xa6, 0xa7, 0x85, 0xb7, 0xd7, 0x8c, 0x90, 0xe4, 0xab, 0x63, 0x44,
+    0x52, 0x66, 0xe3, 0x9c, 0x33, 0x25, 0xf9, 0x5e, 0x34, 0x34, 0x34, 0x37,
+    0x37, 0x37, 0x35, 0x35, 0x35, 0x35, 0x35, 0x35, 0x3c, 0x3c, 0x3c, 0x23,
+    0x23, 0x23, 0x77, 0x77, 0x77, 0x75, 0x75, 0x75, 0x64, 0x64, 0x64, 0x71,
+    0x71, 0x71, 0x76, 0x76, 0x76, 0x69, 0x69, 0x69, 0x68, 0x68, 0x68, 0x75,
+    0x75, 0x75, 0x23, 0x23, 0x23, 0x67, 0x67, 0x67, 0x64, 0x64, 0x64, 0x77,
+    0x77, 0x77, 0x64, 0x64, 0x64, 0x23, 0x23, 0x23, 0x6c, 0x6c, 0x6c, 0x76,
+    0x76, 0x76, 0x72, 0x72, 0x72, 0x45, 0x00, 0xa3, 0x50, 0x23, 0x67, 0x67,
+    0x67, 0x64, 0x00, 0x00, 0x00, 0x00,
+};
+
+uint8_t g_expected[DECOMPRESSED_SIZE] = {0};
+uint8_t g_output[DECOMPRESSED_SIZE * 2] = {0};
+size_t g_outputLen = 0;
+uint8_t g_window[DECOMPRESSED_SIZE * 2] = {0};
+
+int sink(void *sinkCtx, const uint8_t *data, size_t len) {
+    assert(g_outputLen + len <= sizeof(g_output));
+    memcpy(g_output + g_outputLen, data, len);
+    g_outputLen += len;
+    return 0;
+}
+
+int discardSink(void *sinkCtx, const uint8_t *data, size_t len) { return 0; }
+
+int failingSink(void *sinkCtx, const uint8_t *data, size_t len) { return 1; }
+
+void run_test(const uint8_t *frame, size_t frameLen, size_t windowSize, size_t chunkSize) {
+    LZ4Decoder dec;
+    g_outputLen = 0;
+    memset(g_output, 0, sizeof(g_output));
+
+    assert(0 == lz4DecoderInit(&dec, g_window, windowSize));
+
+    for (size_t offset = 0; offset < frameLen; offset += chunkSize) {
+        size_t len = frameLen - offset < chunkSize ? frameLen - offset : chunkSize;
+        assert(LZ4DECODER_OK == lz4DecoderUpdate(&dec, frame + offset, len, sink, NULL));
+    }
+
+    assert(LZ4DECODER_OK == lz4DecoderFinish(&dec));
+    assert(DECOMPRESSED_SIZE == g_outputLen);
+    assert(0 == memcmp(g_output, g_expected, DECOMPRESSED_SIZE));
+}
+
+void test_errors() {
+    LZ4Decoder dec;
+    uint8_t corrupt[sizeof(g_singleBlock)];
+
+    // window size must be a power of two
+    assert(0 != lz4DecoderInit(&dec, g_window, 1000));
+
+    // truncated frame
+    assert(0 == lz4DecoderInit(&dec, g_window, sizeof(g_window)));
+    assert(LZ4DECODER_OK == lz4DecoderUpdate(&dec, g_singleBlock, 100, discardSink, NULL));
+    assert(LZ4DECODER_OK != lz4DecoderFinish(&dec));
+
+    // bad magic
+    memcpy(corrupt, g_singleBlock, sizeof(corrupt));
+    corrupt[0] ^= 1;
+    assert(0 == lz4DecoderInit(&dec, g_window, sizeof(g_window)));
+    assert(LZ4DECODER_ERR_CORRUPT ==
+           lz4DecoderUpdate(&dec, corrupt, sizeof(corrupt), discardSink, NULL));
+
+    // trailing data after the frame
+    assert(0 == lz4DecoderInit(&dec, g_window, sizeof(g_window)));
+    assert(LZ4DECODER_OK ==
+           lz4DecoderUpdate(&dec, g_singleBlock, sizeof(g_singleBlock), discardSink, NULL));
+    assert(LZ4DECODER_ERR_CORRUPT == lz4DecoderUpdate(&dec, g_singleBlock, 1, discardSink, NULL));
+
+    // back-references beyond the window are rejected
+    assert(0 == lz4DecoderInit(&dec, g_window, 16));
+    assert(LZ4DECODER_ERR_CORRUPT ==
+           lz4DecoderUpdate(&dec, g_singleBlock, sizeof(g_singleBlock), discardSink, NULL));
+
+    assert(0 == lz4DecoderInit(&dec, g_window, sizeof(g_window)));
+    assert(LZ4DECODER_ERR_SINK ==
+           lz4DecoderUpdate(&dec, g_singleBlock, sizeof(g_singleBlock), failingSink, NULL));
+}
+
+void setup() {
+    uint32_t x = 1;
+    for (size_t i = 0; i < DECOMPRESSED_SIZE; i++) {
+        if (i >= 512 && i < 768) {
+            // incompressible
+            x = x * 1103515245 + 12345;
+            g_expected[i] = x >> 16;
+        } else {
+            g_expected[i] = "iso14229 transfer data "[(i / 3) % 23] + (i >> 8);
+        }
+    }
+}
+
+int main(int ac, char **av) {
+    setup();
+    size_t chunkSizes[] = {1, 2, 7, 64, 255, 256, 4095};
+    for (size_t i = 0; i < sizeof(chunkSizes) / sizeof(chunkSizes[0]); i++) {
+        run_test(g_linkedBlocks, sizeof(g_linkedBlocks), 2048, chunkSizes[i]);
+        run_test(g_linkedBlocks, sizeof(g_linkedBlocks), 1024, chunkSizes[i]);
+        run_test(g_singleBlock, sizeof(g_singleBlock), 2048, chunkSizes[i]);
+        run_test(g_singleBlock, sizeof(g_singleBlock), 1024, chunkSizes[i]);
+    }
+    test_errors();
+
+    printf("pass\n");
+}